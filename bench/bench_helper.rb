@@ -0,0 +1,127 @@
+# frozen_string_literal: true
+
+require_relative '../lib/taglib_simple'
+require 'fileutils'
+require 'tmpdir'
+
+# Minimal benchmark harness for the FileRef read/write paths
+#
+# Each case is run repeatedly for BENCH_TIME seconds (default 1.0) after a short warmup and reports iterations per
+# second, mean time per iteration and Ruby objects allocated per iteration.
+#
+# Set BENCH to a regular expression to only run matching cases
+module Bench
+  FIXTURE_DIR = File.expand_path('../spec/fixture', __dir__)
+  TIME = Float(ENV.fetch('BENCH_TIME', '1.0'))
+  FILTER = ENV['BENCH'] && Regexp.new(ENV['BENCH'])
+
+  LARGE_TAG_FIELDS = 200
+  LARGE_TAG_VALUE_SIZE = 1024
+  LARGE_LYRICS_SIZE = 64 * 1024
+  LARGE_ARTWORK_SIZE = 2 * 1024 * 1024
+
+  class << self
+    def complex_properties?
+      TagLib::MAJOR_VERSION >= 2
+    end
+
+    # Runs the block with a temporary directory of generated fixtures
+    # @yield [Hash<String,String>] fixture name => path
+    def with_fixtures
+      Dir.mktmpdir('taglib-bench') do |dir|
+        yield generate_fixtures(dir)
+      end
+    end
+
+    # Run block for each input style
+    # @yield [Symbol, Proc] :path or :io, and a lambda that opens a file ref on a path with that input style, yields
+    #   it and closes it (and any IO it opened)
+    def each_input
+      yield :path, ->(path, style = nil, &blk) { with_file_ref(path, style, &blk) }
+      yield :io, lambda { |path, style = nil, &blk|
+        File.open(path, 'r+b') { |io| with_file_ref(io, style, &blk) }
+      }
+    end
+
+    def measure(label, &)
+      return if FILTER && !FILTER.match?(label)
+
+      run_for(TIME / 10, &) # warmup
+      GC.start
+      allocated = GC.stat(:total_allocated_objects)
+      iterations, elapsed = run_for(TIME, &)
+      allocated = GC.stat(:total_allocated_objects) - allocated
+      report(label, iterations, elapsed, allocated)
+    end
+
+    private
+
+    def with_file_ref(file, style)
+      fr = TagLib::Simple::FileRef.new(file, style)
+      yield fr
+    ensure
+      fr&.close
+    end
+
+    def run_for(seconds)
+      iterations = 0
+      start = now
+      deadline = start + seconds
+      loop do
+        yield iterations
+        iterations += 1
+        break if now >= deadline
+      end
+      [iterations, now - start]
+    end
+
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    def report(label, iterations, elapsed, allocated)
+      puts format('%-50<label>s %10<ips>.1f i/s %12<us>.1f us/i %10<objs>d objs/i',
+                  label:, ips: iterations / elapsed, us: elapsed * 1_000_000 / iterations,
+                  objs: allocated / iterations)
+    end
+
+    def generate_fixtures(dir)
+      %w[itunes10.mp3 has-tags.m4a test.ogg].each_with_object({}) do |name, fixtures|
+        ext = File.extname(name)
+        base = File.join(dir, File.basename(name, ext))
+        fixtures["small#{ext}"] = copy_fixture(name, "#{base}-small#{ext}")
+        fixtures["large-tag#{ext}"] = large_tags(copy_fixture(name, "#{base}-large-tag#{ext}"))
+        next unless complex_properties?
+
+        fixtures["large-artwork#{ext}"] = large_artwork(copy_fixture(name, "#{base}-large-artwork#{ext}"))
+      end
+    end
+
+    def copy_fixture(name, path)
+      FileUtils.cp(File.join(FIXTURE_DIR, name), path)
+      path
+    end
+
+    def large_tags(path)
+      props = (1..LARGE_TAG_FIELDS).to_h { |i| ["BENCHFIELD#{i}", ['x' * LARGE_TAG_VALUE_SIZE]] }
+      props['LYRICS'] = ['l' * LARGE_LYRICS_SIZE]
+      update(path) { |fr| fr.merge_properties(props) }
+    end
+
+    def large_artwork(path)
+      picture = {
+        'data' => Random.new(42).bytes(LARGE_ARTWORK_SIZE), 'mimeType' => 'image/png',
+        'pictureType' => 'Front Cover', 'description' => 'bench'
+      }
+      update(path) { |fr| fr.merge_complex_properties({ 'PICTURE' => [picture] }, true) }
+    end
+
+    def update(path)
+      fr = TagLib::Simple::FileRef.new(path, nil)
+      yield fr
+      fr.save
+      fr.close
+      path
+    end
+  end
+end
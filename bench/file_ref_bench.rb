@@ -0,0 +1,33 @@
+# frozen_string_literal: true
+
+require_relative 'bench_helper'
+
+# FileRef open/read/write throughput for path and IO inputs across formats and tag sizes
+Bench.with_fixtures do |fixtures|
+  fixtures.each do |name, path|
+    Bench.each_input do |input, open|
+      prefix = "#{name} #{input}"
+
+      Bench.measure("#{prefix} open") { open.call(path) { nil } }
+      Bench.measure("#{prefix} open audio_properties") { open.call(path, :average) { nil } }
+      # FileRef#properties is converted once and then cached, so each iteration opens a new FileRef
+      Bench.measure("#{prefix} open+properties") { open.call(path, &:properties) }
+
+      open.call(path) do |fr|
+        Bench.measure("#{prefix} tag") { fr.tag }
+        if Bench.complex_properties?
+          Bench.measure("#{prefix} complex_property(PICTURE)") { fr.complex_property('PICTURE') }
+        end
+      end
+
+      copy = "#{path}.#{input}.write#{File.extname(path)}"
+      FileUtils.cp(path, copy)
+      open.call(copy) do |fr|
+        Bench.measure("#{prefix} merge_properties+save") do |i|
+          fr.merge_properties({ 'TITLE' => ["Title #{i}"] })
+          fr.save
+        end
+      end
+    end
+  end
+end
@@ -0,0 +1,158 @@
+#include "AtomicSave.hpp"
+#include "Stats.hpp"
+#include "without_gvl.h"
+#if !defined(_WIN32)
+#include <cerrno>
+#include <system_error>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace TagLib {
+    namespace Simple {
+        namespace {
+            constexpr size_t COPY_BUFFER_SIZE = 1024 * 1024;
+
+            [[noreturn]] void fail(const std::string &what) {
+                throw std::system_error(systemErrno(), std::generic_category(), what);
+            }
+
+            // closes the descriptor on scope exit
+            struct Descriptor {
+                int fd;
+
+                explicit Descriptor(const int fd) : fd(fd) {}
+
+                ~Descriptor() {
+                    if (fd >= 0) {
+                        ::close(fd);
+                    }
+                }
+
+                Descriptor(const Descriptor &) = delete;
+                Descriptor &operator=(const Descriptor &) = delete;
+            };
+
+            void writeAll(const int fd, const char *data, size_t length) {
+                while (length > 0) {
+                    const ssize_t written = ::write(fd, data, length);
+                    if (written < 0) {
+                        if (systemErrno() == EINTR) {
+                            continue;
+                        }
+                        fail("write");
+                    }
+                    data += written;
+                    length -= static_cast<size_t>(written);
+                    Stats::add(Stats::RewriteBytes, static_cast<uint64_t>(written));
+                }
+            }
+
+            void copyRange(const int in, const int out, off_t offset, off_t length) {
+#if defined(__linux__)
+                // in kernel copy, falls back to read/write below if not supported between these files
+                while (length > 0) {
+                    loff_t inOffset = offset;
+                    const ssize_t copied = ::copy_file_range(in, &inOffset, out, nullptr, static_cast<size_t>(length), 0);
+                    if (copied < 0) {
+                        if (systemErrno() == EINTR) {
+                            continue;
+                        }
+                        const int error = systemErrno();
+                        if (error == EXDEV || error == ENOSYS || error == EINVAL || error == EOPNOTSUPP) {
+                            break;
+                        }
+                        fail("copy_file_range");
+                    }
+                    if (copied == 0) {
+                        return;
+                    }
+                    offset += copied;
+                    length -= copied;
+                    Stats::add(Stats::RewriteBytes, static_cast<uint64_t>(copied));
+                }
+#endif
+                std::vector<char> buffer(std::min<off_t>(length, COPY_BUFFER_SIZE));
+                while (length > 0) {
+                    const ssize_t count = ::pread(in, buffer.data(), std::min<off_t>(length, buffer.size()), offset);
+                    if (count < 0) {
+                        if (systemErrno() == EINTR) {
+                            continue;
+                        }
+                        fail("pread");
+                    }
+                    if (count == 0) {
+                        return;
+                    }
+                    writeAll(out, buffer.data(), static_cast<size_t>(count));
+                    offset += count;
+                    length -= count;
+                }
+            }
+        }
+
+        void replaceFile(const std::string &path, OverlayStream &overlay,
+                         const std::function<void(const std::string &tempPath)> &beforeRename) {
+            const Descriptor in(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+            if (in.fd < 0) {
+                fail("open " + path);
+            }
+            struct stat st{};
+            if (::fstat(in.fd, &st) != 0) {
+                fail("stat " + path);
+            }
+#if defined(POSIX_FADV_SEQUENTIAL)
+            (void) ::posix_fadvise(in.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+            const size_t slash = path.rfind('/');
+            const std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+            const std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+            std::string tempPath = dir + (slash == std::string::npos ? "/." : ".") + name + ".XXXXXX";
+
+            Descriptor out(::mkstemp(tempPath.data()));
+            if (out.fd < 0) {
+                fail("mkstemp " + tempPath);
+            }
+            try {
+                if (::fchmod(out.fd, st.st_mode & 07777) != 0) {
+                    fail("chmod " + tempPath);
+                }
+                // best effort, only privileged processes can give away files
+                if (::fchown(out.fd, st.st_uid, st.st_gid) != 0) {
+                    // keep the owner of the temporary file
+                }
+
+                overlay.replay(
+                    [&](const offset_type offset, const offset_type length) {
+                        copyRange(in.fd, out.fd, static_cast<off_t>(offset), static_cast<off_t>(length));
+                    },
+                    [&](const ByteVector &data) { writeAll(out.fd, data.data(), data.size()); });
+
+                if (::fsync(out.fd) != 0) {
+                    fail("fsync " + tempPath);
+                }
+                const int fd = out.fd;
+                out.fd = -1;
+                if (::close(fd) != 0) {
+                    fail("close " + tempPath);
+                }
+                beforeRename(tempPath);
+                if (::rename(tempPath.c_str(), path.c_str()) != 0) {
+                    fail("rename " + tempPath);
+                }
+            } catch (...) {
+                ::unlink(tempPath.c_str());
+                throw;
+            }
+
+            // make the rename itself durable
+            const Descriptor directory(::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+            if (directory.fd >= 0) {
+                (void) ::fsync(directory.fd);
+            }
+        }
+    }
+}
+#endif
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "OverlayStream.hpp"
+#include <functional>
+#include <string>
+
+namespace TagLib {
+    namespace Simple {
+#if !defined(_WIN32)
+        // Write the content of overlay to a new temporary file in the same directory as path, flush it to disk and
+        // rename it over path, so readers see either the old or the new file, never a partial save.
+        //
+        // The file is written sequentially. Unchanged content is copied from path with copy_file_range where
+        // available, which avoids copying through user space and can share extents on file systems that support it.
+        // beforeRename is called with the name of the complete temporary file just before it is renamed, so the caller
+        // can open it while failing is still harmless. After the rename nothing else can fail.
+        //
+        // The replacement is a new file, so hard links to path keep the old content, and extended attributes and ACLs
+        // are not carried over (only the mode bits and, if permitted, the owner).
+        // The original file is untouched on failure, including if beforeRename throws. Throws std::system_error
+        void replaceFile(const std::string &path, OverlayStream &overlay,
+                         const std::function<void(const std::string &tempPath)> &beforeRename);
+#endif
+    }
+}
@@ -0,0 +1,363 @@
+#include "Batch.hpp"
+#include "Cache.hpp"
+#include "Stats.hpp"
+#include "without_gvl.h"
+#include <taglib/fileref.h>
+#include <filesystem>
+#include <map>
+#include <set>
+#include <vector>
+#if !defined(_WIN32)
+#include <sys/stat.h>
+#endif
+
+using namespace Rice;
+
+namespace TagLib {
+    namespace Simple {
+
+        ScanResult scanFile(const std::string &path, const bool readAudioProperties,
+                            const TagLib::AudioProperties::ReadStyle style) {
+            ScanResult result;
+            if (path.empty()) {
+                return result;
+            }
+
+            Stats::Timer timer(Stats::ParseNanos);
+            const TagLib::FileRef fileRef(path.c_str(), readAudioProperties, style);
+            if (fileRef.isNull()) {
+                return result;
+            }
+
+            result.valid = true;
+            if (const TagLib::Tag *tag = fileRef.tag()) {
+                result.tag = std::make_unique<TagValues>(*tag);
+            }
+            if (const TagLib::AudioProperties *props = fileRef.audioProperties()) {
+                result.audioProperties = std::make_unique<AudioPropertyValues>(*props);
+            }
+            result.properties = fileRef.file()->properties();
+            return result;
+        }
+
+        static bool mergeTagUpdate(TagLib::Tag &tag, const TagUpdate &update) {
+            bool changed = false;
+            auto mergeString = [&changed, &tag](const std::optional<TagLib::String> &value,
+                                                TagLib::String (TagLib::Tag::*get)() const,
+                                                void (TagLib::Tag::*set)(const TagLib::String &)) {
+                if (value && (tag.*get)() != *value) {
+                    (tag.*set)(*value);
+                    changed = true;
+                }
+            };
+            auto mergeUInt = [&changed, &tag](const std::optional<unsigned int> &value,
+                                              unsigned int (TagLib::Tag::*get)() const,
+                                              void (TagLib::Tag::*set)(unsigned int)) {
+                if (value && (tag.*get)() != *value) {
+                    (tag.*set)(*value);
+                    changed = true;
+                }
+            };
+            mergeString(update.title, &TagLib::Tag::title, &TagLib::Tag::setTitle);
+            mergeString(update.artist, &TagLib::Tag::artist, &TagLib::Tag::setArtist);
+            mergeString(update.album, &TagLib::Tag::album, &TagLib::Tag::setAlbum);
+            mergeString(update.genre, &TagLib::Tag::genre, &TagLib::Tag::setGenre);
+            mergeString(update.comment, &TagLib::Tag::comment, &TagLib::Tag::setComment);
+            mergeUInt(update.year, &TagLib::Tag::year, &TagLib::Tag::setYear);
+            mergeUInt(update.track, &TagLib::Tag::track, &TagLib::Tag::setTrack);
+            return changed;
+        }
+
+        ApplyStatus applyFile(const ApplyUpdate &update, const bool replaceAll) {
+            if (update.path.empty()) {
+                return ApplyStatus::Invalid;
+            }
+            TagLib::FileRef fileRef(update.path.c_str(), false);
+            if (fileRef.isNull()) {
+                return ApplyStatus::Invalid;
+            }
+            TagLib::File *file = fileRef.file();
+            if (file->readOnly()) {
+                return ApplyStatus::ReadOnly;
+            }
+
+            bool changed = false;
+            if (replaceAll || !update.properties.isEmpty()) {
+                const TagLib::PropertyMap current = file->properties();
+                TagLib::PropertyMap properties;
+                if (!replaceAll) {
+                    properties = current;
+                }
+                for (const auto &property: update.properties) {
+                    properties.replace(property.first, property.second);
+                }
+                properties.removeEmpty();
+                if (properties != current) {
+                    file->setProperties(properties);
+                    changed = true;
+                }
+            }
+            // after properties, so tag members win where both are given
+            if (TagLib::Tag *tag = fileRef.tag()) {
+                changed = mergeTagUpdate(*tag, update.tag) || changed;
+            }
+            if (!changed) {
+                return ApplyStatus::Unchanged;
+            }
+
+            Stats::Timer timer(Stats::SaveNanos);
+            return fileRef.save() ? ApplyStatus::Saved : ApplyStatus::Failed;
+        }
+
+        Object scanResultToRuby(const std::string &path, const ScanResult &result, const ConversionLimits &limits) {
+            if (!result.valid) {
+                return {Qnil};
+            }
+
+            ConversionBudget budget(limits);
+            Hash hash;
+            hash[Symbol("path")] = Rice::String(path);
+            hash[Symbol("tag")] = result.tag ? tagValuesToRubyAudioTag(*result.tag, &budget) : Object(Qnil);
+            hash[Symbol("audio_properties")] = result.audioProperties
+                                                   ? audioPropertyValuesToRuby(*result.audioProperties)
+                                                   : Object(Qnil);
+            hash[Symbol("properties")] = tagLibPropertyMapToRubyHash(result.properties, &budget);
+            return hash;
+        }
+
+        // Fixed size Array of nil, filled in by row index
+        static Array nilColumn(const size_t rows) {
+            Array column(rb_ary_new_capa(static_cast<long>(rows)));
+            rb_ary_resize(column.value(), static_cast<long>(rows));
+            return column;
+        }
+
+        Hash scanResultsToColumns(const std::vector<std::string> &paths, const std::vector<ScanResult> &results,
+                                  const bool readAudioProperties, const ConversionLimits &limits) {
+            const size_t rows = paths.size();
+            Hash columns;
+            auto column = [&columns, rows](const char *name) {
+                Array array = nilColumn(rows);
+                columns[Symbol(name)] = array;
+                return array;
+            };
+
+            Array path = column("path"), valid = column("valid");
+            Array title = column("title"), artist = column("artist"), album = column("album"), genre = column("genre");
+            Array year = column("year"), track = column("track"), comment = column("comment");
+            Array audioLength, bitrate, sampleRate, channels;
+            if (readAudioProperties) {
+                audioLength = column("audio_length");
+                bitrate = column("bitrate");
+                sampleRate = column("sample_rate");
+                channels = column("channels");
+            }
+            Hash properties;
+            columns[Symbol("properties")] = properties;
+            // property key => its column, each column is also held by the properties Hash
+            std::map<TagLib::String, VALUE> propertyColumns;
+
+            // repeated values (artist, album, genre) are interned so rows share a single frozen String, unless the
+            // value must be truncated to fit the budget
+            auto interned = [](const TagLib::String &value, ConversionBudget &budget) -> Object {
+                if (value.isEmpty()) {
+                    return {Qnil};
+                }
+                const size_t bytes = tagLibStringToUTF8(value).size();
+                if (!budget.fits(bytes)) {
+                    return tagLibStringToRubyUTF8String(value, &budget);
+                }
+                budget.take(bytes);
+                return tagLibStringToInternedRubyUTF8String(value);
+            };
+
+            for (size_t i = 0; i < rows; i++) {
+                const auto row = static_cast<long>(i);
+                const ScanResult &result = results[i];
+                ConversionBudget budget(limits);
+                rb_ary_store(path.value(), row, Rice::String(paths[i]).value());
+                rb_ary_store(valid.value(), row, result.valid ? Qtrue : Qfalse);
+                if (const TagValues *tag = result.tag.get()) {
+                    rb_ary_store(title.value(), row, tagLibStringToNonEmptyRubyUTF8String(tag->title, &budget).value());
+                    rb_ary_store(artist.value(), row, interned(tag->artist, budget).value());
+                    rb_ary_store(album.value(), row, interned(tag->album, budget).value());
+                    rb_ary_store(genre.value(), row, interned(tag->genre, budget).value());
+                    rb_ary_store(year.value(), row, uintToNonZeroRubyInteger(tag->year).value());
+                    rb_ary_store(track.value(), row, uintToNonZeroRubyInteger(tag->track).value());
+                    rb_ary_store(comment.value(), row,
+                                 tagLibStringToNonEmptyRubyUTF8String(tag->comment, &budget).value());
+                }
+                if (const AudioPropertyValues *props = result.audioProperties.get()) {
+                    rb_ary_store(audioLength.value(), row, INT2NUM(props->lengthInMilliseconds));
+                    rb_ary_store(bitrate.value(), row, INT2NUM(props->bitrate));
+                    rb_ary_store(sampleRate.value(), row, INT2NUM(props->sampleRate));
+                    rb_ary_store(channels.value(), row, INT2NUM(props->channels));
+                }
+                for (const auto &property: result.properties) {
+                    // the interned name is shared by all rows, but is counted against each row's budget
+                    const Object key = tagLibNameToRuby(property.first, &budget);
+                    if (key.is_nil()) {
+                        continue;
+                    }
+                    auto found = propertyColumns.find(property.first);
+                    if (found == propertyColumns.end()) {
+                        Array array = nilColumn(rows);
+                        properties[key] = array;
+                        found = propertyColumns.emplace(property.first, array.value()).first;
+                    }
+                    Array values = tagLibStringListToRuby(property.second, &budget);
+                    values.freeze();
+                    rb_ary_store(found->second, row, values.value());
+                }
+            }
+            return columns;
+        }
+
+        // Path names are extracted up front so the worker threads never see a Ruby object
+        static std::vector<std::string> rubyArrayToPaths(const Array &paths) {
+            std::vector<std::string> result;
+            result.reserve(paths.size());
+            for (const auto &item: paths) {
+                result.emplace_back(rubyPathToString(Object(item.value())));
+            }
+            return result;
+        }
+
+        static TagUpdate rubyObjectToTagUpdate(const Object &tag) {
+            TagUpdate update;
+            if (tag.is_nil()) {
+                return update;
+            }
+            const Hash in = tag.call("to_h");
+            for (const auto &pair: in) {
+                const std::string key = Symbol(pair.key).str();
+                const Object value(pair.value);
+                if (key == "title") {
+                    update.title = rubyStringOrNilToTagLibString(value);
+                } else if (key == "artist") {
+                    update.artist = rubyStringOrNilToTagLibString(value);
+                } else if (key == "album") {
+                    update.album = rubyStringOrNilToTagLibString(value);
+                } else if (key == "genre") {
+                    update.genre = rubyStringOrNilToTagLibString(value);
+                } else if (key == "comment") {
+                    update.comment = rubyStringOrNilToTagLibString(value);
+                } else if (key == "year") {
+                    update.year = rubyIntegerOrNilToUInt(value);
+                } else if (key == "track") {
+                    update.track = rubyIntegerOrNilToUInt(value);
+                } else {
+                    throw Exception(rb_eKeyError, "Unknown tag property: %s", key.c_str());
+                }
+            }
+            return update;
+        }
+
+        static ApplyUpdate rubyArrayToApplyUpdate(const Object &item) {
+            if (!item.is_a(rb_cArray)) {
+                throw Exception(rb_eTypeError, "expects [path, properties, tag], got %s", item.class_name().c_str());
+            }
+            Array entry(item);
+            ApplyUpdate update;
+            update.path = rubyPathToString(entry[0]);
+            const Object properties = entry.size() > 1 ? Object(entry[1]) : Object(Qnil);
+            if (!properties.is_nil()) {
+                for (const auto &pair: Hash(properties)) {
+                    const Object values(pair.value);
+                    update.properties.replace(rubyStringToTagLibString(pair.key),
+                                              values.is_nil() ? TagLib::StringList() : rubyObjectToTagLibStringList(values));
+                }
+            }
+            update.tag = rubyObjectToTagUpdate(entry.size() > 2 ? Object(entry[2]) : Object(Qnil));
+            return update;
+        }
+
+        // Identifies the file at path, so the same file reached by different names is recognised
+        static std::string fileIdentity(const std::string &path) {
+#if !defined(_WIN32)
+            struct stat st {};
+            if (stat(path.c_str(), &st) == 0) {
+                return "inode:" + std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino);
+            }
+#endif
+            std::error_code ec;
+            const std::filesystem::path absolute = std::filesystem::absolute(path, ec);
+            return "path:" + (ec ? path : absolute.lexically_normal().string());
+        }
+
+        Array apply(Array updates, Object options) {
+            std::vector<ApplyUpdate> converted;
+            converted.reserve(updates.size());
+            std::set<std::string> files;
+            for (const auto &item: updates) {
+                converted.push_back(rubyArrayToApplyUpdate(Object(item.value())));
+                // two workers saving the same file at once would corrupt it
+                const std::string &path = converted.back().path;
+                if (!files.insert(fileIdentity(path)).second) {
+                    throw Exception(rb_eArgError, "Duplicate update for %s", path.c_str());
+                }
+            }
+            const unsigned threads = rubyOptionToThreads(options);
+            const bool replaceAll = rubyOption(options, "replace_all").test();
+
+            std::vector<ApplyStatus> statuses(converted.size(), ApplyStatus::Failed);
+            std::atomic<bool> cancelled{false};
+
+            withoutGVL([&]() {
+                parallelFor(converted.size(), threads, cancelled, [&](const size_t i) {
+                    statuses[i] = applyFile(converted[i], replaceAll);
+                });
+            }, cancelParallelFor, &cancelled);
+
+            // raise Interrupt etc... if we were cancelled, files already saved stay saved
+            rb_thread_check_ints();
+
+            static const char *names[] = {"saved", "unchanged", "invalid", "read_only", "failed"};
+            Array result;
+            for (const ApplyStatus status: statuses) {
+                result.push(Symbol(names[static_cast<int>(status)]));
+            }
+            return result;
+        }
+
+        Object scan(Array paths, Object options) {
+            const std::vector<std::string> pathNames = rubyArrayToPaths(paths);
+            const unsigned threads = rubyOptionToThreads(options);
+            const Object readAudioProperties = rubyOption(options, "audio_properties");
+            const TagLib::AudioProperties::ReadStyle style = rubyObjectToTagLibAudioPropertiesReadStyle(readAudioProperties);
+            const bool columnar = rubyOption(options, "columns").test();
+            const Object cacheOption = rubyOption(options, "cache");
+            const Cache *cache = cacheOption.is_nil() ? nullptr : Data_Object<Cache>(cacheOption).get();
+            const ConversionLimits limits = rubyOptionsToConversionLimits(options);
+
+            std::vector<ScanResult> results(pathNames.size());
+            std::atomic<bool> cancelled{false};
+
+            withoutGVL([&]() {
+                parallelFor(pathNames.size(), threads, cancelled, [&](const size_t i) {
+                    results[i] = cache ? cache->scan(pathNames[i], readAudioProperties.test(), style)
+                                       : scanFile(pathNames[i], readAudioProperties.test(), style);
+                });
+            }, cancelParallelFor, &cancelled);
+
+            // raise Interrupt etc... if we were cancelled
+            rb_thread_check_ints();
+
+            if (columnar) {
+                return scanResultsToColumns(pathNames, results, readAudioProperties.test(), limits);
+            }
+
+            Array result;
+            for (size_t i = 0; i < pathNames.size(); i++) {
+                result.push(scanResultToRuby(pathNames[i], results[i], limits));
+            }
+            return result;
+        }
+    }
+}
+
+void define_taglib_simple_batch(const Module &rb_mParent) {
+    Module(rb_mParent)
+            .define_module_function("scan", &TagLib::Simple::scan, Arg("paths"), Arg("options") = Qnil)
+            .define_module_function("apply", &TagLib::Simple::apply, Arg("updates"), Arg("options") = Qnil);
+}
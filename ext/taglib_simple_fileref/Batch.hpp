@@ -0,0 +1,113 @@
+#pragma once
+
+#include "taglib_wrap.h"
+#include "conversions.h"
+#include <taglib/tpropertymap.h>
+#include <rice/rice.hpp>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+using namespace Rice;
+
+// @!yard module TagLib
+namespace TagLib {
+ // @!yard module Simple
+ namespace Simple {
+
+  // Everything read from a single file on a worker thread, ready for conversion to Ruby under the GVL
+  struct ScanResult {
+   bool valid = false;
+   std::unique_ptr<TagValues> tag;
+   std::unique_ptr<AudioPropertyValues> audioProperties;
+   TagLib::PropertyMap properties;
+  };
+
+  // Tag fields to set, unset fields are left as they are
+  struct TagUpdate {
+   std::optional<TagLib::String> title, artist, album, genre, comment;
+   std::optional<unsigned int> year, track;
+  };
+
+  // One file's changes for apply, converted from Ruby before any worker thread starts
+  struct ApplyUpdate {
+   std::string path;
+   TagLib::PropertyMap properties;
+   TagUpdate tag;
+  };
+
+  enum class ApplyStatus { Saved, Unchanged, Invalid, ReadOnly, Failed };
+
+  // Open path with TagLib, merge the update and save only if anything changed. Must not touch any Ruby objects.
+  ApplyStatus applyFile(const ApplyUpdate &update, bool replaceAll);
+
+  // Open, parse and close path with TagLib. Must not touch any Ruby objects.
+  ScanResult scanFile(const std::string &path, bool readAudioProperties, TagLib::AudioProperties::ReadStyle style);
+
+  // Convert a ScanResult to the Ruby result Hash (or nil if TagLib could not read the file), limits apply to the
+  // tag and property values of the file
+  Object scanResultToRuby(const std::string &path, const ScanResult &result,
+                          const ConversionLimits &limits = ConversionLimits());
+
+  // Convert all results to a Hash of columns, one Array per field with an entry per path. limits apply to each
+  // file's row
+  Hash scanResultsToColumns(const std::vector<std::string> &paths, const std::vector<ScanResult> &results,
+                            bool readAudioProperties, const ConversionLimits &limits = ConversionLimits());
+
+  /** @!yard
+   # @!group Batch Processing
+
+   # Read tags from many files in parallel.
+   #
+   # TagLib opens and parses each file on native worker threads with the GVL released, results are converted to
+   # Ruby objects once all files have been read.
+   # @param [Array<String|:to_path>] paths file names to read, IO objects are not supported
+   # @param [Integer] threads number of worker threads, 0 to use one per processor. Negative values raise ArgumentError
+   # @param [Symbol<:average,:fast, :accurate>|nil] audio_properties
+   #   :fast, :accurate, :average indicator for reading audio properties. nil/false to skip
+   # @param [Boolean] columns return column oriented results rather than an entry per path
+   # @param [Cache|nil] cache serve unchanged files from, and store newly read files in, this cache
+   # @param [Integer|nil] max_value_size as per {FileRef#initialize}, applied to each file's values
+   # @param [Integer|nil] max_total_size as per {FileRef#initialize}, applied to each file's tag and properties
+   # @param [Symbol<:raise,:truncate>] oversize as per {FileRef#initialize}
+   # @return [Array<Hash|nil>] for each path (in order) a Hash with :path, :tag, :audio_properties and :properties
+   #   entries, or nil if TagLib could not read the file.
+   # @return [Hash<Symbol,Array|Hash>] with columns: true, one Array per field holding an entry for each path (in
+   #   order), nil where a file has no value (or could not be read).
+   #
+   #   * :path, :valid
+   #   * :title, :artist, :album, :genre, :year, :track, :comment - as per {AudioTag}.
+   #     Artist, album and genre values are interned, ie identical values are a single shared frozen String.
+   #   * :audio_length, :bitrate, :sample_rate, :channels - as per {AudioProperties}, if audio_properties requested
+   #   * :properties - Hash of property name to its column of frozen value Arrays
+   def self.scan(paths, threads: 0, audio_properties: nil, columns: false, cache: nil, max_value_size: nil, max_total_size: nil, oversize: :raise); end
+
+   # Update tags in many files in parallel.
+   #
+   # All updates are converted to native values first (so invalid input raises before any file is touched), then
+   # each file is opened, merged and saved by TagLib on native worker threads with the GVL released.
+   # As with {FileRef#save}, a file is only written if the update changes it. Each file may appear only once.
+   # @param [Array<Array(String|:to_path, Hash<String,String|Array<String>|nil>|nil, Hash<Symbol>|AudioTag|nil)>]
+   #   updates path, properties to merge (nil values remove the property) and {AudioTag} members to set for each file
+   # @param [Integer] threads number of worker threads, 0 to use one per processor. Negative values raise ArgumentError
+   # @param [Boolean] replace_all the given properties replace all existing properties (as per
+   #   {FileRef#merge_properties})
+   # @return [Array<Symbol>] for each update (in order) :saved, :unchanged (nothing to write), :invalid (TagLib could
+   #   not read the file), :read_only or :failed (TagLib could not save it)
+   # @raise [TypeError, KeyError] for invalid updates, before any file is opened
+   # @raise [ArgumentError] if more than one update is for the same file (by any name), before any file is opened
+   def self.apply(updates, threads: 0, replace_all: false); end
+
+   # @!endgroup
+   */
+  Object scan(Array paths, Object options);
+
+  Array apply(Array updates, Object options);
+ }
+
+ //@!yard end # Simple
+}
+
+//@!yard end # TagLib
+void define_taglib_simple_batch(const Module &rb_mTagLibRuby);
@@ -0,0 +1,366 @@
+#include "Cache.hpp"
+#include "FileRef.hpp"
+#include "Stats.hpp"
+#include "without_gvl.h"
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#if !defined(_WIN32)
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace Rice;
+
+namespace TagLib {
+    namespace Simple {
+#if !defined(_WIN32)
+        namespace {
+            // Record layout, all integers in native byte order, strings are a uint32 length followed by UTF-8 bytes
+            //   magic, key, flags
+            //   [tag] title, artist, album, genre, year:uint32, track:uint32, comment
+            //   [audio properties] length, bitrate, sample rate, channels:int32
+            //   property count:uint32, then each key, value count:uint32, values
+            // The last magic byte is the format version, records from other versions are misses.
+            constexpr char MAGIC[8] = {'T', 'L', 'S', 'C', 'A', 'C', 'H', '1'};
+
+            enum Flags : uint32_t {
+                Valid = 1,
+                HasTag = 2,
+                HasAudioProperties = 4,
+                // audio properties were requested when the record was written (the file may not have any)
+                ReadAudioProperties = 8
+            };
+
+            // Identifies a specific version of a specific file
+            struct Key {
+                uint64_t device;
+                uint64_t inode;
+                int64_t mtimeSeconds;
+                int64_t mtimeNanos;
+                uint64_t size;
+
+                bool operator==(const Key &other) const {
+                    return device == other.device && inode == other.inode && mtimeSeconds == other.mtimeSeconds &&
+                           mtimeNanos == other.mtimeNanos && size == other.size;
+                }
+
+                bool operator!=(const Key &other) const { return !(*this == other); }
+            };
+
+            bool statKey(const std::string &path, Key &key) {
+                struct stat st{};
+                if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+                    return false;
+                }
+#if defined(__APPLE__)
+                const struct timespec &mtime = st.st_mtimespec;
+#else
+                const struct timespec &mtime = st.st_mtim;
+#endif
+                key = {static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino),
+                       static_cast<int64_t>(mtime.tv_sec), static_cast<int64_t>(mtime.tv_nsec),
+                       static_cast<uint64_t>(st.st_size)};
+                return true;
+            }
+
+            class RecordWriter {
+                std::string buffer;
+
+            public:
+                template<typename T>
+                void put(const T value) {
+                    buffer.append(reinterpret_cast<const char *>(&value), sizeof(T));
+                }
+
+                void put(const TagLib::String &value) {
+                    const std::string_view utf8 = tagLibStringToUTF8(value);
+                    put(static_cast<uint32_t>(utf8.size()));
+                    buffer.append(utf8.data(), utf8.size());
+                }
+
+                void put(const char *data, const size_t length) {
+                    buffer.append(data, length);
+                }
+
+                [[nodiscard]] const std::string &data() const { return buffer; }
+            };
+
+            // Bounds checked reads from a mapped record, ok() is false once any read has overrun
+            class RecordReader {
+                const char *position;
+                const char *end;
+                bool valid = true;
+
+                bool take(const size_t length) {
+                    valid = valid && static_cast<size_t>(end - position) >= length;
+                    return valid;
+                }
+
+            public:
+                RecordReader(const char *data, const size_t length) : position(data), end(data + length) {}
+
+                template<typename T>
+                T get() {
+                    T value{};
+                    if (take(sizeof(T))) {
+                        std::memcpy(&value, position, sizeof(T));
+                        position += sizeof(T);
+                    }
+                    return value;
+                }
+
+                TagLib::String getString() {
+                    const auto length = get<uint32_t>();
+                    if (!take(length)) {
+                        return {};
+                    }
+                    TagLib::String value = utf8ToTagLibString(position, length);
+                    position += length;
+                    return value;
+                }
+
+                bool match(const char *expected, const size_t length) {
+                    if (!take(length) || std::memcmp(position, expected, length) != 0) {
+                        valid = false;
+                        return false;
+                    }
+                    position += length;
+                    return true;
+                }
+
+                [[nodiscard]] bool ok() const { return valid; }
+                [[nodiscard]] bool atEnd() const { return valid && position == end; }
+            };
+
+            Key getKey(RecordReader &in) {
+                Key key{};
+                key.device = in.get<uint64_t>();
+                key.inode = in.get<uint64_t>();
+                key.mtimeSeconds = in.get<int64_t>();
+                key.mtimeNanos = in.get<int64_t>();
+                key.size = in.get<uint64_t>();
+                return key;
+            }
+
+            bool parseRecord(const char *data, const size_t length, const Key &key, const bool readAudioProperties,
+                             ScanResult &result) {
+                RecordReader in(data, length);
+                if (!in.match(MAGIC, sizeof(MAGIC)) || getKey(in) != key) {
+                    return false;
+                }
+                const auto flags = in.get<uint32_t>();
+                if (!in.ok() || (readAudioProperties && !(flags & ReadAudioProperties))) {
+                    return false;
+                }
+
+                result.valid = flags & Valid;
+                if (flags & HasTag) {
+                    auto tag = std::make_unique<TagValues>();
+                    tag->title = in.getString();
+                    tag->artist = in.getString();
+                    tag->album = in.getString();
+                    tag->genre = in.getString();
+                    tag->year = in.get<uint32_t>();
+                    tag->track = in.get<uint32_t>();
+                    tag->comment = in.getString();
+                    result.tag = std::move(tag);
+                }
+                if (flags & HasAudioProperties) {
+                    auto props = std::make_unique<AudioPropertyValues>();
+                    props->lengthInMilliseconds = in.get<int32_t>();
+                    props->bitrate = in.get<int32_t>();
+                    props->sampleRate = in.get<int32_t>();
+                    props->channels = in.get<int32_t>();
+                    if (readAudioProperties) {
+                        result.audioProperties = std::move(props);
+                    }
+                }
+                for (auto count = in.get<uint32_t>(); in.ok() && count > 0; count--) {
+                    const TagLib::String name = in.getString();
+                    TagLib::StringList values;
+                    for (auto valueCount = in.get<uint32_t>(); in.ok() && valueCount > 0; valueCount--) {
+                        values.append(in.getString());
+                    }
+                    result.properties.insert(name, values);
+                }
+                return in.atEnd();
+            }
+
+            std::string formatRecord(const Key &key, const bool readAudioProperties, const ScanResult &result) {
+                RecordWriter out;
+                out.put(MAGIC, sizeof(MAGIC));
+                out.put(key.device);
+                out.put(key.inode);
+                out.put(key.mtimeSeconds);
+                out.put(key.mtimeNanos);
+                out.put(key.size);
+
+                uint32_t flags = readAudioProperties ? static_cast<uint32_t>(ReadAudioProperties) : 0u;
+                flags |= result.valid ? static_cast<uint32_t>(Valid) : 0u;
+                flags |= result.tag ? static_cast<uint32_t>(HasTag) : 0u;
+                flags |= result.audioProperties ? static_cast<uint32_t>(HasAudioProperties) : 0u;
+                out.put(flags);
+
+                if (const TagValues *tag = result.tag.get()) {
+                    out.put(tag->title);
+                    out.put(tag->artist);
+                    out.put(tag->album);
+                    out.put(tag->genre);
+                    out.put(static_cast<uint32_t>(tag->year));
+                    out.put(static_cast<uint32_t>(tag->track));
+                    out.put(tag->comment);
+                }
+                if (const AudioPropertyValues *props = result.audioProperties.get()) {
+                    out.put(static_cast<int32_t>(props->lengthInMilliseconds));
+                    out.put(static_cast<int32_t>(props->bitrate));
+                    out.put(static_cast<int32_t>(props->sampleRate));
+                    out.put(static_cast<int32_t>(props->channels));
+                }
+                out.put(static_cast<uint32_t>(result.properties.size()));
+                for (const auto &property: result.properties) {
+                    out.put(property.first);
+                    out.put(static_cast<uint32_t>(property.second.size()));
+                    for (const auto &value: property.second) {
+                        out.put(value);
+                    }
+                }
+                return out.data();
+            }
+
+            bool loadRecord(const std::string &recordPath, const Key &key, const bool readAudioProperties,
+                            ScanResult &result) {
+                const int fd = ::open(recordPath.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0) {
+                    return false;
+                }
+                struct stat st{};
+                void *mapping = MAP_FAILED;
+                if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+                    mapping = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                }
+                ::close(fd);
+                if (mapping == MAP_FAILED) {
+                    return false;
+                }
+                const bool loaded = parseRecord(static_cast<const char *>(mapping), static_cast<size_t>(st.st_size),
+                                                key, readAudioProperties, result);
+                ::munmap(mapping, static_cast<size_t>(st.st_size));
+                return loaded;
+            }
+
+            // Best effort, a record that cannot be written is simply a miss next time
+            void storeRecord(const std::string &shardPath, const std::string &name, const std::string &record) {
+                if (::mkdir(shardPath.c_str(), 0777) != 0 && systemErrno() != EEXIST) {
+                    return;
+                }
+                std::string tempPath = shardPath + "/." + name + ".XXXXXX";
+                const int fd = ::mkstemp(&tempPath[0]);
+                if (fd < 0) {
+                    return;
+                }
+                const char *data = record.data();
+                size_t remaining = record.size();
+                while (remaining > 0) {
+                    const ssize_t written = ::write(fd, data, remaining);
+                    if (written < 0 && systemErrno() == EINTR) {
+                        continue;
+                    }
+                    if (written <= 0) {
+                        break;
+                    }
+                    data += written;
+                    remaining -= static_cast<size_t>(written);
+                }
+                const bool closed = ::close(fd) == 0;
+                if (remaining > 0 || !closed || ::rename(tempPath.c_str(), (shardPath + "/" + name).c_str()) != 0) {
+                    ::unlink(tempPath.c_str());
+                }
+            }
+        }
+
+        ScanResult Cache::scan(const std::string &path, const bool readAudioProperties,
+                               const TagLib::AudioProperties::ReadStyle style) const {
+            Key key{};
+            if (path.empty() || !statKey(path, key)) {
+                return scanFile(path, readAudioProperties, style);
+            }
+
+            // records are spread over 256 sub directories
+            char shard[4], name[48];
+            std::snprintf(shard, sizeof(shard), "%02x", static_cast<unsigned>(key.inode & 0xff));
+            std::snprintf(name, sizeof(name), "%llx-%llx", static_cast<unsigned long long>(key.device),
+                          static_cast<unsigned long long>(key.inode));
+            const std::string shardPath = directory + "/" + shard;
+
+            ScanResult result;
+            if (loadRecord(shardPath + "/" + name, key, readAudioProperties, result)) {
+                Stats::add(Stats::CacheHits);
+                return result;
+            }
+            Stats::add(Stats::CacheMisses);
+
+            result = scanFile(path, readAudioProperties, style);
+            // don't record a result for content that changed while it was being read
+            Key after{};
+            if (statKey(path, after) && after == key) {
+                storeRecord(shardPath, name, formatRecord(key, readAudioProperties, result));
+            }
+            return result;
+        }
+#else
+        ScanResult Cache::scan(const std::string &path, const bool readAudioProperties,
+                               const TagLib::AudioProperties::ReadStyle style) const {
+            return scanFile(path, readAudioProperties, style);
+        }
+#endif
+
+        Cache::Cache(Object dir) : directory(rubyPathToString(dir)) {
+#if defined(_WIN32)
+            throw Exception(rb_eNotImpError, "Cache is not available on this platform");
+#else
+            if (::mkdir(directory.c_str(), 0777) != 0 && systemErrno() != EEXIST) {
+                throw Exception(rb_syserr_new(systemErrno(), directory.c_str()));
+            }
+            struct stat st{};
+            if (::stat(directory.c_str(), &st) != 0) {
+                throw Exception(rb_syserr_new(systemErrno(), directory.c_str()));
+            }
+            if (!S_ISDIR(st.st_mode)) {
+                throw Exception(rb_syserr_new(ENOTDIR, directory.c_str()));
+            }
+            if (::access(directory.c_str(), W_OK | X_OK) != 0) {
+                throw Exception(rb_syserr_new(systemErrno(), directory.c_str()));
+            }
+#endif
+        }
+
+        Rice::String Cache::dir() const {
+            return {directory};
+        }
+
+        Object Cache::fetch(Object path, Object options) const {
+            const std::string pathName = rubyPathToString(path);
+            const Object readAudioProperties = rubyOption(options, "audio_properties");
+            const TagLib::AudioProperties::ReadStyle style = rubyObjectToTagLibAudioPropertiesReadStyle(readAudioProperties);
+            const ConversionLimits limits = rubyOptionsToConversionLimits(options);
+
+            ScanResult result;
+            withoutGVL([&]() {
+                result = scan(pathName, readAudioProperties.test(), style);
+            });
+            return scanResultToRuby(pathName, result, limits);
+        }
+    }
+}
+
+void define_taglib_simple_cache(const Module &rb_mParent) {
+    define_class_under<TagLib::Simple::Cache>(rb_mParent, "Cache")
+            .define_constructor(Constructor<TagLib::Simple::Cache, TagLib::FileRef, Object>(), Arg("dir"))
+            .define_method("dir", &TagLib::Simple::Cache::dir)
+            .define_method("fetch", &TagLib::Simple::Cache::fetch, Arg("path"), Arg("options") = Qnil);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "Batch.hpp"
+#include <rice/rice.hpp>
+#include <string>
+
+using namespace Rice;
+
+// @!yard module TagLib
+namespace TagLib {
+ // @!yard module Simple
+ namespace Simple {
+
+  /** @!yard
+   * # Persistent on-disk cache of the tag, audio properties and properties read from files by {Simple.scan} and
+   * # {MediaFile.read}.
+   * #
+   * # Each file has one small binary record under the cache directory, named by the file's device and inode and
+   * # holding the file's modification time and size. A record is only used while all four still match, so a hit
+   * # never opens the media file in TagLib at all. Files TagLib cannot read are cached too.
+   * #
+   * # Records are written to a temporary file and renamed into place so concurrent readers (and writers) never see a
+   * # partial record. Any record that cannot be read is treated as a miss and replaced. Failures to write records are
+   * # ignored, the cache directory itself is checked when the cache is created.
+   * #
+   * # The audio properties read style is not recorded: a record holding audio properties serves any read style.
+   * class Cache
+   */
+  class Cache final {
+   std::string directory;
+
+  public:
+   /** @!yard
+    # @param [String|:to_path] dir the cache directory, created if it does not exist
+    # @raise [SystemCallError] if dir cannot be created or is not a writable directory
+    # @raise [NotImplementedError] on platforms without stable inode numbers (Windows)
+    def initialize(dir); end
+    */
+   explicit Cache(Object dir);
+
+   /** @!yard
+    # @return [String] the cache directory
+    def dir; end
+    */
+   [[nodiscard]] Rice::String dir() const;
+
+   /** @!yard
+    # Read path from the cache, or with TagLib storing the result in the cache. The GVL is released while the record
+    # or file is read.
+    # @param [String|:to_path] path
+    # @param [Symbol<:average,:fast, :accurate>|nil] audio_properties
+    #   :fast, :accurate, :average indicator for reading audio properties. nil/false to skip
+    # @param [Integer|nil] max_value_size as per {Simple.scan}
+    # @param [Integer|nil] max_total_size as per {Simple.scan}
+    # @param [Symbol<:raise,:truncate>] oversize as per {Simple.scan}
+    # @return [Hash|nil] as per an entry of {Simple.scan}, nil if TagLib could not read the file
+    def fetch(path, audio_properties: nil, max_value_size: nil, max_total_size: nil, oversize: :raise); end
+    */
+   Object fetch(Object path, Object options = Qnil) const;
+
+   // As per scanFile, serving path from its record if it is current, otherwise storing a new one.
+   // Must not touch any Ruby objects.
+   ScanResult scan(const std::string &path, bool readAudioProperties,
+                   TagLib::AudioProperties::ReadStyle style) const;
+  };
+ }
+
+ //@!yard end # Simple
+}
+
+//@!yard end # TagLib
+void define_taglib_simple_cache(const Module &rb_mTagLibRuby);
@@ -4,8 +4,18 @@
 
 #include "FileRef.hpp"
 #include "IOStream.hpp"
+#include "Stats.hpp"
+#include "AtomicSave.hpp"
+#include "Probe.hpp"
+#include "XXH64.hpp"
 #include <rice/rice.hpp>
 #include "conversions.h"
+#include "without_gvl.h"
+#include <taglib/tfilestream.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <system_error>
 #include <taglib/tpropertymap.h>
 #include <taglib/tstring.h>
 
@@ -13,53 +23,206 @@ using namespace Rice;
 
 namespace TagLib {
     namespace Simple {
-        FileRef::FileRef(const Object fileOrStream, const Object readAudioProperties) : fileRef(nullptr), stream(nullptr) {
+        // io: option for file names, true if the file should be memory mapped
+        static bool rubyOptionToMMap(const Object &options) {
+            const Object io = rubyOption(options, "io");
+            if (io.is_nil()) {
+                return false;
+            }
+            const std::string ioStr = Symbol(io).str();
+            if (ioStr == "file") {
+                return false;
+            }
+            if (ioStr == "mmap") {
+#if defined(_WIN32)
+                throw Exception(rb_eNotImpError, "io: :mmap is not available on this platform");
+#else
+                return true;
+#endif
+            }
+            throw Exception(rb_eArgError, "Invalid io: %s", ioStr.c_str());
+        }
+
+        enum class SaveStrategy { Rewrite, InPlaceOrFail, Atomic };
+
+        static SaveStrategy rubyOptionToSaveStrategy(const Object &options) {
+            const Object strategy = rubyOption(options, "strategy");
+            if (strategy.is_nil()) {
+                return SaveStrategy::Rewrite;
+            }
+            const std::string strategyStr = Symbol(strategy).str();
+            if (strategyStr == "rewrite") {
+                return SaveStrategy::Rewrite;
+            }
+            if (strategyStr == "in_place_or_fail") {
+                return SaveStrategy::InPlaceOrFail;
+            }
+            if (strategyStr == "atomic") {
+#if defined(_WIN32)
+                throw Exception(rb_eNotImpError, "strategy: :atomic is not available on this platform");
+#else
+                return SaveStrategy::Atomic;
+#endif
+            }
+            throw Exception(rb_eArgError, "Invalid strategy: %s", strategyStr.c_str());
+        }
+
+        FileRef::FileRef(const Object fileOrStream, const Object readAudioProperties, const Object options) {
+            open(fileOrStream, readAudioProperties, options);
+        }
+
+        bool FileRef::reopen(const Object fileOrStream, const Object readAudioProperties, const Object options) {
+            close();
+            open(fileOrStream, readAudioProperties, options);
+            return isValid();
+        }
+
+        void FileRef::open(const Object fileOrStream, const Object readAudioProperties, const Object options) {
+            path.clear();
+            mapped = false;
+            const Object tags = rubyOption(options, "tags");
+            tagScope = tags.is_nil() ? std::nullopt : std::make_optional(rubyObjectToTagFamilies(tags));
+            limits = rubyOptionsToConversionLimits(options);
             TagLib::AudioProperties::ReadStyle style = rubyObjectToTagLibAudioPropertiesReadStyle(readAudioProperties);
+            const bool mmap = rubyOptionToMMap(options);
+            const Object prefetch = rubyOption(options, "prefetch");
 
             if (IOStream::isIO(fileOrStream)) {
+                if (mmap) {
+                    throw Exception(rb_eArgError, "io: :mmap requires a file name, got %s", fileOrStream.class_name().c_str());
+                }
                 // Handle IO object inputObject
-                stream = std::make_unique<IOStream>(fileOrStream);
-                fileRef = std::make_unique<TagLib::FileRef>(stream.get(), readAudioProperties.test(), style);
-                if (fileRef->isNull())
-                    // unable to read the stream.
-                        stream.reset();
+                const Object readAhead = rubyOption(options, "read_ahead");
+                const size_type bufferSize = readAhead.is_nil() ? IOStream::DEFAULT_BUFFER_SIZE : NUM2ULONG(readAhead.value());
+                const Object chunkOption = rubyOption(options, "chunk_size");
+                const size_type chunkSize = chunkOption.is_nil() ? IOStream::DEFAULT_CHUNK_SIZE : NUM2ULONG(chunkOption.value());
+                if (chunkSize == 0) {
+                    throw Exception(rb_eArgError, "chunk_size: must be positive");
+                }
+                const Object cooperativeOption = rubyOption(options, "cooperative");
+                const bool cooperative = cooperativeOption.is_nil() || cooperativeOption.test();
+                const Object headOption = rubyOption(prefetch, "head");
+                const size_type prefetchHead = headOption.is_nil() ? 0 : NUM2ULONG(headOption.value());
+                const Object tailOption = rubyOption(prefetch, "tail");
+                const size_type prefetchTail = tailOption.is_nil() ? 0 : NUM2ULONG(tailOption.value());
+                auto ioStream = std::make_unique<IOStream>(fileOrStream, bufferSize, chunkSize, cooperative);
+                rubyStream = ioStream.get();
+                stream = std::move(ioStream);
+                holdingGVL([&]() {
+                    if (!prefetch.is_nil()) {
+                        rubyStream->prefetch(prefetchHead, prefetchTail, rubyOption(prefetch, "pread"));
+                    }
+                    openStream(readAudioProperties.test(), style);
+                });
             } else {
-                Rice::String pathStr;
-                // PathName
-                if (fileOrStream.respond_to("to_path")) {
-                    pathStr = Rice::String(fileOrStream.call("to_path"));
-                } else if (fileOrStream.is_a(rb_cString)) {
-                    pathStr = Rice::String(fileOrStream);
-                } else {
-                    throw Exception(rb_eTypeError, "expects String, Pathname or IO, got %s", fileOrStream.class_name().c_str());
+                const std::string pathStr = rubyPathToString(fileOrStream, "String, Pathname or IO");
+                if (!prefetch.is_nil()) {
+                    throw Exception(rb_eArgError, "prefetch: requires an IO object, got %s", fileOrStream.class_name().c_str());
                 }
-                if (pathStr.length() > 0) {
-                    TagLib::FileName fn(pathStr.c_str());
-                    fileRef = std::make_unique<TagLib::FileRef>(fn, readAudioProperties.test(), style);
-                } else {
-                    fileRef = std::make_unique<TagLib::FileRef>();
+                if (!pathStr.empty()) {
+                    path = pathStr;
+                    mapped = mmap;
+                    const bool readProperties = readAudioProperties.test();
+                    // Opening and parsing a plain file does not need Ruby, so let other threads run
+                    releasingGVL([&]() {
+#if !defined(_WIN32)
+                        if (mmap) {
+                            stream = std::make_unique<MMapStream>(path);
+                        } else
+#endif
+                        {
+                            stream = std::make_unique<TagLib::FileStream>(path.c_str());
+                        }
+                        openStream(readProperties, style);
+                    });
                 }
             }
         }
 
+        void FileRef::openStream(const bool readAudioProperties, const TagLib::AudioProperties::ReadStyle style) {
+            if (stream->isOpen()) {
+                overlay = std::make_unique<OverlayStream>(stream.get());
+                Stats::Timer timer(Stats::ParseNanos);
+                fileRef = std::make_unique<TagLib::FileRef>(overlay.get(), readAudioProperties, style);
+                if (fileRef->isNull()) {
+                    fileRef.reset();
+                }
+            }
+            if (!fileRef) {
+                // unable to read the stream.
+                overlay.reset();
+                stream.reset();
+                rubyStream = nullptr;
+            }
+        }
+
+        std::unique_ptr<TagLib::IOStream> FileRef::openFileStream(const std::string &name) const {
+            std::unique_ptr<TagLib::IOStream> result;
+#if !defined(_WIN32)
+            if (mapped) {
+                result = std::make_unique<MMapStream>(name);
+            } else
+#endif
+            {
+                result = std::make_unique<TagLib::FileStream>(name.c_str());
+            }
+            if (!result->isOpen()) {
+                throw std::system_error(std::make_error_code(std::errc::io_error), "open " + name);
+            }
+            return result;
+        }
+
         void FileRef::close()
         {
-            if (!fileRef->isNull()) {
-                // delete the TagLib::FileRef, closing streams and release file descriptors held in TagLib C++
-                fileRef = std::make_unique<TagLib::FileRef>();
-                // note we do NOT close the IO object since we did not open it!
-                stream.reset();
+            raiseBusy();
+            // delete the TagLib::FileRef, closing streams and release file descriptors held in TagLib C++
+            fileRef.reset();
+            // note we do NOT close the IO object since we did not open it!
+            overlay.reset();
+            stream.reset();
+            rubyStream = nullptr;
+            modified = false;
+            invalidateProperties();
+        }
+
+        const TagLib::PropertyMap &FileRef::cachedProperties() const {
+            if (!propertyCache) {
+                propertyCache = std::make_unique<TagLib::PropertyMap>(
+                    tagScope ? scopedProperties(scopedTags(fileRef->file(), *tagScope)) : fileRef->file()->properties());
+            }
+            return *propertyCache;
+        }
+
+        const TagLib::Tag *FileRef::scopedTag() const {
+            if (!tagScope) {
+                return fileRef->tag();
             }
+            for (const TagLib::Tag *tag: scopedTags(fileRef->file(), *tagScope)) {
+                if (!tag->isEmpty()) {
+                    return tag;
+                }
+            }
+            return nullptr;
+        }
+
+        void FileRef::raiseScoped() const {
+            if (!tagScope) { return; }
+            throw Exception(tagLibClass(TagLibClass::Error), "Taglib::FileRef opened with tags: is read only");
+        }
+
+        void FileRef::invalidateProperties() const {
+            propertyCache.reset();
+            propertiesHash = Qnil;
         }
 
         bool FileRef::isValid() const {
-            // isNull checks file isValid too
-           return !fileRef->isNull();
+            // nullptr when closed, or TagLib could not read the file. isNull checks file isValid too
+           return fileRef && !fileRef->isNull();
         }
 
         bool FileRef::isReadOnly() const {
             raiseInvalid();
-            return fileRef->file()->readOnly();
+            return tagScope || fileRef->file()->readOnly();
         }
 
         Object FileRef::audioProperties() const {
@@ -70,84 +233,165 @@ namespace TagLib {
                 return {Qnil};
             }
 
-            // Get the Ruby AudioProperties Data class from TagLib module
-            static Object rb_cAudioProperties = Module("TagLib").const_get("AudioProperties");
-
-            // Create new AudioProperties Data instance
-            return rb_cAudioProperties.call("new", props->lengthInMilliseconds(), props->bitrate(), props->sampleRate(), props->channels() );
+            return audioPropertyValuesToRuby(AudioPropertyValues(*props));
         }
 
         Object FileRef::tag() const {
             raiseInvalid();
 
-            const TagLib::Tag* tag = fileRef->tag();
+            const TagLib::Tag* tag = scopedTag();
             if (!tag) {
-                //this never seems to happen but protect anyway
+                // TagLib always has a tag, a scope may not
                 return {Qnil};
             }
 
-            // Get the Ruby AudioTag Data class from TagLib module
-            static Object rb_cAudioTag = Module("TagLib").const_get("AudioTag");
+            ConversionBudget budget(limits);
+            return tagValuesToRubyAudioTag(TagValues(*tag), &budget);
+        }
+
+        // A single AudioTag member from the TagLib tag
+        static Object tagLibTagFieldToRuby(const TagLib::Tag &tag, const std::string &field, ConversionBudget &budget) {
+            if (field == "title") {
+                return tagLibStringToNonEmptyRubyUTF8String(tag.title(), &budget);
+            }
+            if (field == "artist") {
+                return tagLibStringToNonEmptyRubyUTF8String(tag.artist(), &budget);
+            }
+            if (field == "album") {
+                return tagLibStringToNonEmptyRubyUTF8String(tag.album(), &budget);
+            }
+            if (field == "genre") {
+                return tagLibStringToNonEmptyRubyUTF8String(tag.genre(), &budget);
+            }
+            if (field == "year") {
+                return uintToNonZeroRubyInteger(tag.year());
+            }
+            if (field == "track") {
+                return uintToNonZeroRubyInteger(tag.track());
+            }
+            if (field == "comment") {
+                return tagLibStringToNonEmptyRubyUTF8String(tag.comment(), &budget);
+            }
+            throw Exception(rb_eKeyError, "Unknown tag property: %s", field.c_str());
+        }
 
-            //  define :title, :artist, :album, :genre, :year, :track, :comment
-            return rb_cAudioTag.call("new",
-                tagLibStringToNonEmptyRubyUTF8String(tag->title()),
-                tagLibStringToNonEmptyRubyUTF8String(tag-> artist()),
-                tagLibStringToNonEmptyRubyUTF8String(tag->album()),
-                tagLibStringToNonEmptyRubyUTF8String(tag->genre()),
-                uintToNonZeroRubyInteger(tag->year()),
-                uintToNonZeroRubyInteger(tag->track()),
-                tagLibStringToNonEmptyRubyUTF8String(tag->comment())
-            );
+        Hash FileRef::tagFields(Array fields) const {
+            raiseInvalid();
 
+            Hash result;
+            const TagLib::Tag *tag = scopedTag();
+            ConversionBudget budget(limits);
+            for (const auto &item: fields) {
+                const Symbol field(item.value());
+                Object value = tag ? tagLibTagFieldToRuby(*tag, field.str(), budget) : Object(Qnil);
+                if (!value.is_nil()) {
+                    result[field] = value;
+                }
+            }
+            return result;
         }
 
-        void FileRef::mergeTagProperties(Object in_obj) const {
+        bool FileRef::mergeTagProperties(Object in_obj) const {
             raiseInvalid();
+            raiseScoped();
+            TagLib::Tag *tag = fileRef->tag();
+            bool changed = false;
+            // only values that differ are set, so an unchanged tag is never marked as modified
+            auto mergeString = [&changed, tag](const Object &value, TagLib::String (TagLib::Tag::*get)() const,
+                                               void (TagLib::Tag::*set)(const TagLib::String &)) {
+                const TagLib::String updated = rubyStringOrNilToTagLibString(value);
+                if ((tag->*get)() != updated) {
+                    (tag->*set)(updated);
+                    changed = true;
+                }
+            };
+            auto mergeUInt = [&changed, tag](const Object &value, unsigned int (TagLib::Tag::*get)() const,
+                                             void (TagLib::Tag::*set)(unsigned int)) {
+                const unsigned int updated = rubyIntegerOrNilToUInt(value);
+                if ((tag->*get)() != updated) {
+                    (tag->*set)(updated);
+                    changed = true;
+                }
+            };
 
             Hash in = in_obj.call("to_h");
             for (Hash::const_iterator it = in.begin(); it != in.end(); ++it) {
                 auto key = Symbol(it->key).str();
                 const Object value(it->value);
                 if (key == "title") {
-                    fileRef->tag()->setTitle(rubyStringOrNilToTagLibString(value));
+                    mergeString(value, &TagLib::Tag::title, &TagLib::Tag::setTitle);
                 }
                 else if (key == "artist") {
-                    fileRef->tag()->setArtist(rubyStringOrNilToTagLibString(value));
+                    mergeString(value, &TagLib::Tag::artist, &TagLib::Tag::setArtist);
                 }
                 else if (key == "album") {
-                    fileRef->tag()->setAlbum(rubyStringOrNilToTagLibString(value));
+                    mergeString(value, &TagLib::Tag::album, &TagLib::Tag::setAlbum);
                 }
                 else if (key == "comment") {
-                    fileRef->tag()->setComment(rubyStringOrNilToTagLibString(value));
+                    mergeString(value, &TagLib::Tag::comment, &TagLib::Tag::setComment);
                 }
                 else if (key == "genre") {
-                    fileRef->tag()->setGenre(rubyStringOrNilToTagLibString(value));
+                    mergeString(value, &TagLib::Tag::genre, &TagLib::Tag::setGenre);
                 }
                 else if (key == "year") {
-                    fileRef->tag()->setYear(rubyIntegerOrNilToUInt(value));
+                    mergeUInt(value, &TagLib::Tag::year, &TagLib::Tag::setYear);
                 }
                 else if (key == "track") {
-                    fileRef->tag()->setTrack(rubyIntegerOrNilToUInt(value));
+                    mergeUInt(value, &TagLib::Tag::track, &TagLib::Tag::setTrack);
                 } else {
                     throw Exception(rb_eKeyError, "Unknown tag property: ", key);
                 }
+            }
 
+            if (changed) {
+                // tag values are also properties
+                invalidateProperties();
+                modified = true;
             }
+            return changed;
         }
 
 
         Hash FileRef::properties() const {
             raiseInvalid();
-            return tagLibPropertyMapToRubyHash(fileRef->file()->properties());
+            if (propertiesHash.is_nil()) {
+                ConversionBudget budget(limits);
+                propertiesHash = tagLibPropertyMapToRubyHash(cachedProperties(), &budget);
+            }
+            return {propertiesHash};
+        }
+
+        Hash FileRef::fetchProperties(Array keys) const {
+            raiseInvalid();
+
+            const TagLib::PropertyMap &properties = cachedProperties();
+            ConversionBudget budget(limits);
+            Hash result;
+            for (const auto &item: keys) {
+                const auto found = properties.find(rubyStringToTagLibString(Rice::String(item.value())));
+                if (found == properties.end()) {
+                    continue;
+                }
+                const Object key = tagLibNameToRuby(found->first, &budget);
+                if (key.is_nil()) {
+                    continue;
+                }
+                Array values = tagLibStringListToRuby(found->second, &budget);
+                values.freeze();
+                result[key] = values;
+            }
+            result.freeze();
+            return result;
         }
 
-        void FileRef::mergeProperties(Hash in, const bool replace_all) const {
+        bool FileRef::mergeProperties(Hash in, const bool replace_all) const {
             raiseInvalid();
+            raiseScoped();
 
+            const TagLib::PropertyMap &current = cachedProperties();
             TagLib::PropertyMap properties;
             if (!replace_all) {
-                properties = fileRef->file()->properties();
+                properties = current;
             }
 
             for (const auto& pair : in) {
@@ -157,9 +401,22 @@ namespace TagLib {
                     );
             }
             properties.removeEmpty();
+            if (properties == current) {
+                return false;
+            }
 
             // Set the modified properties back to the file
+            invalidateProperties();
             fileRef->file()->setProperties(properties);
+            modified = true;
+            return true;
+        }
+
+        void FileRef::mark() const {
+            rb_gc_mark(propertiesHash.value());
+            if (rubyStream) {
+                rubyStream->mark();
+            }
         }
 
        Rice::String FileRef::toString() const {
@@ -189,15 +446,258 @@ namespace TagLib {
             return {result};
         }
 
-        void FileRef::save() const {
+        bool FileRef::save(const Object options) {
             raiseInvalid();
-            fileRef->save();
+            raiseScoped();
+            const SaveStrategy strategy = rubyOptionToSaveStrategy(options);
+            if (strategy == SaveStrategy::Atomic && rubyStream) {
+                throw Exception(rb_eArgError, "strategy: :atomic requires a file name");
+            }
+            // a previous :in_place_or_fail save may have left TagLib's output pending in the overlay
+            if (!modified && !overlay->pending() && !rubyOption(options, "force").test()) {
+                return false;
+            }
+            // TagLib may normalise properties as it saves them
+            invalidateProperties();
+            Stats::Timer timer(Stats::SaveNanos);
+
+            bool written = false;
+            auto saveOverlay = [this, strategy, &written]() {
+                if (strategy == SaveStrategy::Rewrite && !overlay->pending()) {
+                    // nothing to check first, TagLib writes straight through to the file
+                    fileRef->save();
+                    modified = false;
+                    written = true;
+                    return;
+                }
+                // TagLib saves into the overlay, which we then check and write out
+                overlay->begin();
+                fileRef->save();
+                modified = false;
+                if (strategy == SaveStrategy::InPlaceOrFail && !overlay->inPlace()) {
+                    return;
+                }
+#if !defined(_WIN32)
+                if (strategy == SaveStrategy::Atomic) {
+                    // open the replacement before it is renamed into place, so any failure leaves the original
+                    // file and the pending changes as they were
+                    std::unique_ptr<TagLib::IOStream> replacement;
+                    replaceFile(path, *overlay, [this, &replacement](const std::string &tempPath) {
+                        replacement = openFileStream(tempPath);
+                    });
+                    overlay->rebase(replacement.get(), path);
+                    stream = std::move(replacement);
+                    written = true;
+                    return;
+                }
+#endif
+                overlay->commit();
+                written = true;
+            };
+
+            try {
+                if (rubyStream) {
+                    // IOStream calls back into Ruby so must hold the GVL
+                    holdingGVL(saveOverlay);
+                } else {
+                    releasingGVL(saveOverlay);
+                }
+            } catch (const std::system_error &e) {
+                throw Exception(systemErrorToRuby(e));
+            }
+
+            if (!written) {
+                const std::string name(fileRef->file()->name());
+                throw Exception(tagLibClass(TagLibClass::RewriteRequired), "Saving %s requires moving existing content",
+                                name.c_str());
+            }
+            return true;
+        }
+
+        // Ogg page headers carry sequence numbers and checksums that change when earlier pages are retagged, so only
+        // the page payloads are hashed
+        static void hashOggPayload(TagLib::IOStream &stream, offset_type offset, const offset_type end, XXH64 &hash) {
+            while (offset + 27 <= end) {
+                stream.seek(offset, TagLib::IOStream::Beginning);
+                const ByteVector header = stream.readBlock(27);
+                if (header.size() < 27 || !header.startsWith("OggS")) {
+                    break;
+                }
+                const unsigned int segments = static_cast<unsigned char>(header[26]);
+                const ByteVector table = stream.readBlock(segments);
+                if (table.size() < segments) {
+                    break;
+                }
+                unsigned long payloadSize = 0;
+                for (const char segment: table) {
+                    payloadSize += static_cast<unsigned char>(segment);
+                }
+                const ByteVector payload = stream.readBlock(payloadSize);
+                hash.update(payload.data(), payload.size());
+                if (payload.size() < payloadSize) {
+                    break;
+                }
+                offset += 27 + segments + static_cast<offset_type>(payloadSize);
+            }
+        }
+
+        Rice::String FileRef::audioDigest(const Object options) const {
+            raiseInvalid();
+            const Object algorithm = rubyOption(options, "algorithm");
+            if (!algorithm.is_nil() && Symbol(algorithm).str() != "xxh64") {
+                throw Exception(rb_eArgError, "Unsupported algorithm: %s", algorithm.inspect().c_str());
+            }
+
+            static constexpr offset_type DIGEST_BLOCK_SIZE = 1024 * 1024;
+            bool located = false;
+            uint64_t digest = 0;
+            auto hashAudio = [this, &located, &digest]() {
+                const ProbeResult layout = probeStream(*overlay);
+                if (!layout.format) {
+                    return;
+                }
+                located = true;
+                XXH64 hash;
+                if (std::strncmp(layout.format, "ogg", 3) == 0) {
+                    hashOggPayload(*overlay, layout.audioOffset, layout.audioOffset + layout.audioSize, hash);
+                    digest = hash.digest();
+                    return;
+                }
+                offset_type offset = layout.audioOffset;
+                for (offset_type remaining = layout.audioSize; remaining > 0;) {
+                    overlay->seek(offset, TagLib::IOStream::Beginning);
+                    const ByteVector block = overlay->readBlock(
+                        static_cast<unsigned long>(std::min(remaining, DIGEST_BLOCK_SIZE)));
+                    if (block.isEmpty()) {
+                        break;
+                    }
+                    hash.update(block.data(), block.size());
+                    offset += block.size();
+                    remaining -= block.size();
+                }
+                digest = hash.digest();
+            };
+
+            if (rubyStream) {
+                holdingGVL(hashAudio);
+            } else {
+                releasingGVL(hashAudio);
+            }
+
+            if (!located) {
+                throw Exception(tagLibClass(TagLibClass::Error), "Unable to locate the audio in %s", toString().c_str());
+            }
+            char hex[17];
+            snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(digest));
+            return {hex};
+        }
+
+        template<typename Func_T>
+        void FileRef::releasingGVL(Func_T &&func) const {
+            busy = true;
+            try {
+                withoutGVL(func);
+            } catch (...) {
+                busy = false;
+                throw;
+            }
+            busy = false;
+        }
+
+        template<typename Func_T>
+        void FileRef::holdingGVL(Func_T &&func) const {
+            busy = true;
+            try {
+                func();
+            } catch (...) {
+                busy = false;
+                throw;
+            }
+            busy = false;
+        }
+
+        // TagLib::String holds a wchar_t per UTF-16 code unit
+        static size_t tagLibStringBytes(const TagLib::String &string) {
+            return string.size() * sizeof(wchar_t);
+        }
+
+        static size_t propertyMapBytes(const TagLib::PropertyMap &properties) {
+            size_t bytes = 0;
+            for (const auto &property: properties) {
+                bytes += tagLibStringBytes(property.first);
+                for (const auto &value: property.second) {
+                    bytes += tagLibStringBytes(value);
+                }
+            }
+            return bytes;
+        }
+
+#if (TAGLIB_MAJOR_VERSION >= 2)
+        static size_t variantBytes(const TagLib::Variant &value) {
+            size_t bytes = 0;
+            switch (value.type()) {
+                case TagLib::Variant::String:
+                    return tagLibStringBytes(value.toString());
+                case TagLib::Variant::StringList:
+                    for (const auto &item: value.toStringList()) {
+                        bytes += tagLibStringBytes(item);
+                    }
+                    return bytes;
+                case TagLib::Variant::ByteVector:
+                    return value.toByteVector().size();
+                case TagLib::Variant::ByteVectorList:
+                    for (const auto &item: value.toByteVectorList()) {
+                        bytes += item.size();
+                    }
+                    return bytes;
+                case TagLib::Variant::VariantList:
+                    for (const auto &item: value.toList()) {
+                        bytes += variantBytes(item);
+                    }
+                    return bytes;
+                case TagLib::Variant::VariantMap:
+                    for (const auto &pair: value.toMap()) {
+                        bytes += tagLibStringBytes(pair.first) + variantBytes(pair.second);
+                    }
+                    return bytes;
+                default:
+                    return sizeof(TagLib::Variant);
+            }
+        }
+#endif
+
+        size_t FileRef::memoryUsage() const {
+            raiseBusy();
+            if (!isValid()) {
+                return 0;
+            }
+            size_t bytes = overlay->memoryUsage();
+            if (rubyStream) {
+                bytes += rubyStream->memoryUsage();
+            }
+            // TagLib's strings are implicitly shared, the cached properties (if any) hold the same values
+            bytes += propertyMapBytes(propertyCache ? *propertyCache : fileRef->file()->properties());
+#if (TAGLIB_MAJOR_VERSION >= 2)
+            for (const auto &key: fileRef->complexPropertyKeys()) {
+                for (const auto &value: fileRef->complexProperties(key)) {
+                    for (const auto &pair: value) {
+                        bytes += tagLibStringBytes(pair.first) + variantBytes(pair.second);
+                    }
+                }
+            }
+#endif
+            return bytes;
+        }
+
+        void FileRef::raiseBusy() const {
+            if (!busy) { return; }
+            throw Exception(tagLibClass(TagLibClass::Error), "Taglib::FileRef is in use by another thread or fiber");
         }
 
         void FileRef::raiseInvalid() const {
+            raiseBusy();
             if (isValid()) { return; }
-            static Object rb_eTagLibError = Module("TagLib").const_get("Error");
-            throw Exception(rb_eTagLibError, "Taglib::FileRef is closed or invalid");
+            throw Exception(tagLibClass(TagLibClass::Error), "Taglib::FileRef is closed or invalid");
         }
 
         // Complex properties interface
@@ -212,34 +712,110 @@ namespace TagLib {
 #endif
         }
 
-        Array FileRef::complexProperty(Rice::String key) const {
+        Array FileRef::complexProperty(Rice::String key, Object options) const {
             raiseInvalid();
 #if (TAGLIB_MAJOR_VERSION < 2)
             throw Rice::Exception(rb_eNotImpError, "Complex properties not available in TagLib %d", TAGLIB_MAJOR_VERSION);
 #else
-            return tagLibComplexPropertyToRuby(fileRef->complexProperties(rubyStringToTagLibString(key)));
+            const Object dataOption = rubyOption(options, "data");
+            ConversionBudget budget(limits);
+            return tagLibComplexPropertyToRuby(fileRef->complexProperties(rubyStringToTagLibString(key)),
+                                               dataOption.is_nil() || dataOption.test(), &budget);
 #endif
         }
 
-        void FileRef::mergeComplexProperties(Hash in, const bool replace_all) const {
+        Object FileRef::writeComplexPropertyData(Rice::String key, Object ioOrPath, Object options) const {
             raiseInvalid();
+#if (TAGLIB_MAJOR_VERSION < 2)
+            throw Rice::Exception(rb_eNotImpError, "Complex properties not available in TagLib %d", TAGLIB_MAJOR_VERSION);
+#else
+            const Object indexOption = rubyOption(options, "index");
+            const unsigned int index = indexOption.is_nil() ? 0 : NUM2UINT(indexOption.value());
+            const Object fieldOption = rubyOption(options, "field");
+            const TagLib::String field = fieldOption.is_nil() ? TagLib::String("data") : rubyStringToTagLibString(fieldOption);
+            const Object chunkOption = rubyOption(options, "chunk_size");
+            const size_t chunkSize = chunkOption.is_nil() ? IOStream::DEFAULT_CHUNK_SIZE : NUM2ULONG(chunkOption.value());
+            if (chunkSize == 0) {
+                throw Exception(rb_eArgError, "chunk_size: must be positive");
+            }
+
+            const TagLib::List<TagLib::VariantMap> values = fileRef->complexProperties(rubyStringToTagLibString(key));
+            if (index >= values.size()) {
+                return {Qnil};
+            }
+            const auto found = values[index].find(field);
+            if (found == values[index].end() || found->second.type() != TagLib::Variant::ByteVector) {
+                return {Qnil};
+            }
+            // shares TagLib's buffer rather than copying it
+            const TagLib::ByteVector data = found->second.toByteVector();
+            const size_t size = data.size();
+
+            if (ioOrPath.respond_to("write")) {
+                for (size_t offset = 0; offset < size; offset += chunkSize) {
+                    const size_t length = std::min(chunkSize, size - offset);
+                    ioOrPath.call("write", Rice::String(rb_str_new(data.data() + offset, static_cast<long>(length))));
+                }
+                return {ULL2NUM(size)};
+            }
+
+            const std::string path = rubyPathToString(ioOrPath, "IO, String or Pathname");
+            int error = 0;
+            withoutGVL([&]() {
+                std::FILE *file = std::fopen(path.c_str(), "wb");
+                if (!file) {
+                    error = systemErrno();
+                    return;
+                }
+                if (std::fwrite(data.data(), 1, size, file) != size) {
+                    error = systemErrno();
+                }
+                if (std::fclose(file) != 0 && error == 0) {
+                    error = systemErrno();
+                }
+            });
+            if (error != 0) {
+                throw Exception(rb_syserr_new(error, path.c_str()));
+            }
+            return {ULL2NUM(size)};
+#endif
+        }
+
+        bool FileRef::mergeComplexProperties(Hash in, const bool replace_all) const {
+            raiseInvalid();
+            raiseScoped();
 #if (TAGLIB_MAJOR_VERSION < 2)
             if (in.size() > 0 ) {
                 throw Rice::Exception(rb_eNotImpError, "Complex properties not available in TagLib %d", TAGLIB_MAJOR_VERSION);
             }
+            return false;
 #else
-            if (replace_all) {;
-                for (const auto& item : fileRef->file()->complexPropertyKeys()) {
-                   fileRef->file()->setComplexProperties(item,{});
+            TagLib::File *file = fileRef->file();
+            TagLib::Map<TagLib::String, TagLib::List<TagLib::VariantMap>> updates;
+            for (const auto& pair : in) {
+                updates.insert(rubyStringToTagLibString(pair.key), rubyObjectToTagLibComplexProperty(pair.value));
+            }
+            if (replace_all) {
+                for (const auto& key : file->complexPropertyKeys()) {
+                    if (!updates.contains(key)) {
+                        updates.insert(key, {});
+                    }
                 }
             }
 
-            for (const auto& pair : in) {
-                fileRef->file()->setComplexProperties(
-                    rubyStringToTagLibString(pair.key),
-                    rubyObjectToTagLibComplexProperty(pair.value)
-                );
+            bool changed = false;
+            for (const auto& update : updates) {
+                if (file->complexProperties(update.first) != update.second) {
+                    file->setComplexProperties(update.first, update.second);
+                    changed = true;
+                }
+            }
+            if (changed) {
+                // some formats hold complex and simple properties in the same structures
+                invalidateProperties();
+                modified = true;
             }
+            return changed;
 #endif
         }
 
@@ -250,19 +826,25 @@ namespace TagLib {
 void define_taglib_simple_fileref(const Module& rb_mParent) {
 
     Data_Type<TagLib::Simple::FileRef> rb_cFileRef = define_class_under<TagLib::Simple::FileRef>( { rb_mParent }, "FileRef")
-            .define_constructor(Constructor<TagLib::Simple::FileRef, TagLib::FileRef, Object, Object>(), Arg("file").keepAlive(), Arg("style") = Qnil)
+            .define_constructor(Constructor<TagLib::Simple::FileRef, TagLib::FileRef, Object, Object, Object>(), Arg("file"), Arg("style") = Qnil, Arg("options") = Qnil)
+            .define_method("reopen", &TagLib::Simple::FileRef::reopen, Arg("file"), Arg("style") = Qnil, Arg("options") = Qnil)
             .define_method("valid?", &TagLib::Simple::FileRef::isValid)
             .define_method("read_only?", &TagLib::Simple::FileRef::isReadOnly)
             .define_method("close", &TagLib::Simple::FileRef::close)
             .define_method("audio_properties", &TagLib::Simple::FileRef::audioProperties)
             .define_method("properties", &TagLib::Simple::FileRef::properties)
             .define_method("tag", &TagLib::Simple::FileRef::tag)
+            .define_method("tag_fields", &TagLib::Simple::FileRef::tagFields, Arg("fields"))
+            .define_method("fetch_properties", &TagLib::Simple::FileRef::fetchProperties, Arg("keys"))
             .define_method("merge_properties", &TagLib::Simple::FileRef::mergeProperties,Arg("h"),Arg("r") = false)
             .define_method("merge_tag_properties", &TagLib::Simple::FileRef::mergeTagProperties, Arg("h"))
-            .define_method("save", &TagLib::Simple::FileRef::save)
+            .define_method("save", &TagLib::Simple::FileRef::save, Arg("options") = Qnil)
             .define_method("to_s", &TagLib::Simple::FileRef::toString)
             .define_method("inspect", &TagLib::Simple::FileRef::inspect)
-            .define_method("complex_property", &TagLib::Simple::FileRef::complexProperty, Arg("key"))
+            .define_method("audio_digest", &TagLib::Simple::FileRef::audioDigest, Arg("options") = Qnil)
+            .define_method("memory_usage", &TagLib::Simple::FileRef::memoryUsage)
+            .define_method("complex_property", &TagLib::Simple::FileRef::complexProperty, Arg("key"), Arg("options") = Qnil)
+            .define_method("write_complex_property_data", &TagLib::Simple::FileRef::writeComplexPropertyData, Arg("key"), Arg("io_or_path"), Arg("options") = Qnil)
             .define_method("complex_property_keys", &TagLib::Simple::FileRef::complexPropertyKeys)
             .define_method("merge_complex_properties", &TagLib::Simple::FileRef::mergeComplexProperties, Arg("h"), Arg("r") = false)
     ;
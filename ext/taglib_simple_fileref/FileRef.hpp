@@ -1,8 +1,14 @@
 #pragma once
 
 #include "taglib_wrap.h"
+#include "OverlayStream.hpp"
+#include "conversions.h"
+#include "TagScope.hpp"
 #include <taglib/fileref.h>
+#include <taglib/tpropertymap.h>
 #include <rice/rice.hpp>
+#include <optional>
+#include <vector>
 
 // Specialised constructor template to avoid the Director constructor that matches Object as first argument.
 // The use of TagLib::FileRef here is arbitrary
@@ -21,27 +27,91 @@ using namespace Rice;
 namespace TagLib {
  // @!yard module Simple
  namespace Simple {
+  class IOStream;
+
   /** @!yard
    * # C++ extension wrapping underlying TagLib::FileRef so we can interact with it using Ruby objects
    * class FileRef
    */
   class FileRef final {
+   // the underlying file, IO or memory mapped stream, declared first so it outlives the TagLib file using it
+   std::unique_ptr<TagLib::IOStream> stream;
+   // stream if it is backed by a Ruby IO, which needs the GVL
+   IOStream *rubyStream = nullptr;
+   // the stream TagLib actually uses, holding saved changes in memory until they are committed to stream
+   std::unique_ptr<OverlayStream> overlay;
+   // file name, and whether it is memory mapped, if not opened from an IO object
+   std::string path;
+   bool mapped = false;
+   // tag families to read, in order of preference, if requested at open. Otherwise as TagLib merges them
+   std::optional<std::vector<TagFamily>> tagScope;
+   // bounds on what each call converting values to Ruby may allocate
+   ConversionLimits limits;
+   // nullptr when closed or invalid
    std::unique_ptr<TagLib::FileRef> fileRef;
-   std::unique_ptr<IOStream> stream;
+   // set while TagLib is working on this file with the GVL released
+   mutable bool busy = false;
+   // set when a merge changed what TagLib holds, cleared once TagLib has saved it
+   mutable bool modified = false;
+   // properties read from TagLib, and their Ruby conversion, held until the next merge, save or close
+   mutable std::unique_ptr<TagLib::PropertyMap> propertyCache;
+   mutable Object propertiesHash;
 
   public:
    /** @!yard
     # Create a FileRef from a file or stream
     # @param [String|:to_path|IO] file_or_stream
-    #    A file name or an io like object responding to :read, :seek and :tell
+    #    A file name or an io like object responding to :read, :seek and :tell.
+    #    For file names the GVL is released while TagLib opens and parses the file
     # @param [Symbol<:average,:fast, :accurate>|nil] read_audio_properties
     #   :fast, :accurate, :average indicator for reading audio properties. nil/false to skip
-    def initialize(file_or_stream, read_audio_properties = nil); end
+    # @param [Integer] read_ahead for IO objects, the size in bytes of the read-ahead buffer used to serve TagLib's
+    #   many small reads without calling into Ruby. 0 to disable buffering
+    # @param [Integer] chunk_size for IO objects, the maximum number of bytes held in memory while shifting the
+    #   remainder of the stream when a save changes the size of a tag
+    # @param [Boolean] cooperative for IO objects, yield to the current thread's Fiber scheduler (if any) before each
+    #   read, so other fibers keep running while TagLib parses or saves the stream
+    # @param [Hash] prefetch for IO objects, windows of the stream to fetch up front with a single read each.
+    #   TagLib's reads that fall within a window are served from memory, others fall back to reading the IO
+    #   (counted as :prefetch_misses in {Simple.stats}).
+    # @option prefetch [Integer] :head number of bytes at the start of the stream
+    # @option prefetch [Integer] :tail number of bytes at the end of the stream
+    # @option prefetch [#call] :pread called with (offset, length) to fetch a window, returning a String (or nil).
+    #   Default is to seek and read the IO. With a Fiber scheduler the tail is fetched in a new scheduled fiber while
+    #   the head is fetched, so both requests can be in flight at once.
+    # @param [Array<Symbol>|nil] tags only read {#tag} and {#properties} from these tag families, in order of
+    #   preference: :id3v1, :id3v2, :ape, :xiph, :mp4, :asf, :info. eg [:id3v2] ignores any ID3v1 or APE tag in an
+    #   MP3, where TagLib would otherwise fall back to them. The FileRef is then read only. Complex properties are
+    #   not affected.
+    # @param [Integer|nil] max_value_size most bytes of any single String or binary value converted to Ruby by
+    #   {#tag}, {#tag_fields}, {#properties}, {#fetch_properties} or {#complex_property}. nil for no limit
+    # @param [Integer|nil] max_total_size most bytes of String and binary values, and property names, converted by
+    #   any one of those calls
+    # @param [Symbol<:raise,:truncate>] oversize what to do with a value over either limit, :raise (default) raises
+    #   TagLib::Error before anything is allocated for it, :truncate cuts String values to fit (on a character
+    #   boundary, possibly to empty) and drops binary values and property names that do not fit whole, along with
+    #   their field. Either is counted as :truncated_values in {Simple.stats}
+    # @param [Symbol<:file,:mmap>] io for file names, how TagLib accesses the file.
+    #   :file (default) uses TagLib's own file stream, :mmap memory maps the file. While mapped, another process
+    #   truncating the file makes accessing the lost pages raise SIGBUS, which terminates the process.
+    # @raise [ArgumentError] if io: :mmap is requested for an IO object, prefetch: for a file name, chunk_size is
+    #   not positive, tags: has an unknown family or oversize: is invalid
+    def initialize(file_or_stream, read_audio_properties = nil, read_ahead: 65536, chunk_size: 1048576, cooperative: true, prefetch: nil, tags: nil, max_value_size: nil, max_total_size: nil, oversize: :raise, io: :file); end
    */
-   explicit FileRef(Object fileOrStream, Object readAudioProperties = Qnil);
+   explicit FileRef(Object fileOrStream, Object readAudioProperties = Qnil, Object options = Qnil);
 
    ~FileRef() = default;
 
+   /** @!yard
+    # Close this FileRef and open another file or stream in its place, reusing this object.
+    # @param [String|:to_path|IO] file_or_stream
+    # @param [Symbol<:average,:fast, :accurate>|nil] read_audio_properties
+    # @param [Hash] options as per {#initialize}
+    # @return [Boolean] {#valid?}
+    def reopen(file_or_stream, read_audio_properties = nil, **options); end
+   */
+   bool reopen(Object fileOrStream, Object readAudioProperties = Qnil, Object options = Qnil);
+
    // Prevent copying
    FileRef(const FileRef &) = delete;
 
@@ -63,7 +133,7 @@ namespace TagLib {
    bool isValid() const;
 
    /** @!yard
-    # Is the underlying stream readonly (ie cannot update tags etc...)
+    # Is the underlying stream readonly (ie cannot update tags etc...), or was opened with tags:
     # @return [Boolean]
     def read_only?; end
    */
@@ -85,20 +155,57 @@ namespace TagLib {
    Object tag() const;
 
    /** @!yard
-    # @return [Hash<String, Array<String>>] arbitrary String properties
+    # Retrieve only the requested {AudioTag} members, without building the full {AudioTag}
+    # @param [Array<Symbol>] fields subset of {AudioTag} members
+    # @return [Hash<Symbol, String|Integer>] the requested tag values, excluding entries with nil values
+    # @raise [KeyError] if a field is not an {AudioTag} member
+    def tag_fields(fields); end
+   */
+   Hash tagFields(Array fields) const;
+
+   /** @!yard
+    # @return [Hash<String, Array<String>>] arbitrary String properties (frozen)
+    # @note the result is cached until properties are merged, or the file is saved or closed
     def properties; end
    */
    Hash properties() const;
 
+   /** @!yard
+    # Retrieve only the requested properties, only these entries are converted to Ruby objects
+    # @param [Array<String>] keys property keys
+    # @return [Hash<String, Array<String>>] (frozen) the requested properties that are available
+    def fetch_properties(keys); end
+   */
+   Hash fetchProperties(Array keys) const;
+
    /** @!yard
     # Retrieve a complex property
     # @param [String] key the complex property to retrieve
     # @return [Array<Hash<String>>] a list of complex property values for this key
     #   empty if the property does not exist
+    # @param [Boolean] data false to leave out binary values (eg PICTURE 'data'), only metadata such as 'mimeType'
+    #   and 'description' is converted to Ruby
+    # @since TagLib 2.x
+    def complex_property(key, data: true); end
+   */
+   Array complexProperty(Rice::String key, Object options = Qnil) const;
+
+   /** @!yard
+    # Write a binary complex property value (eg the image of a PICTURE) to an IO or file in chunks, without
+    # creating a Ruby String for the whole value.
+    # @param [String] key the complex property
+    # @param [IO|String|:to_path] io_or_path an object responding to :write, or a file name to create or replace.
+    #   Files are written with the GVL released
+    # @param [Integer] index which of the property's values
+    # @param [String] field the binary entry within the value
+    # @param [Integer] chunk_size maximum bytes passed to each IO#write call
+    # @return [Integer] the number of bytes written
+    # @return [nil] if there is no such value, or the field is not binary
+    # @raise [SystemCallError] if the file cannot be written
     # @since TagLib 2.x
-    def complex_property(key); end
+    def write_complex_property_data(key, io_or_path, index: 0, field: 'data', chunk_size: 1048576); end
    */
-   Array complexProperty(Rice::String key) const;
+   Object writeComplexPropertyData(Rice::String key, Object ioOrPath, Object options = Qnil) const;
 
    /** @!yard
     # @return [Array<String>] list of complex properties available in this stream
@@ -114,18 +221,18 @@ namespace TagLib {
     # @param [Hash<String,Array<String>>] props input properties to merge
     # @param [Boolean] replace_all true will clear all existing properties, otherwise the input Hash
     #   is merged with existing properties
-    # @return [void]
+    # @return [Boolean] true if the properties changed. Nothing is passed to TagLib if the result would be the same
     def merge_properties(props, replace_all = false); end
    */
-   void mergeProperties(Hash props, bool replace_all = false) const;
+   bool mergeProperties(Hash props, bool replace_all = false) const;
 
    /** @!yard
     # @param [Hash<Symbol, String|Integer>|AudioTag] props input tag properties to merge.
     #   keys must be a subset of {AudioTag} members
-    # @return [void]
+    # @return [Boolean] true if any tag value changed, only changed values are passed to TagLib
     def merge_tag_properties(props); end
    */
-   void mergeTagProperties(Object props) const;
+   bool mergeTagProperties(Object props) const;
 
    /** @!yard
     # @!method merge_complex_properties(props, replace_all)
@@ -133,24 +240,101 @@ namespace TagLib {
     #   complex property values
     # @param [Boolean] replace_all true will clear all existing complex properties before merging
     # @since TagLib 2.x
-    # @return [void]
+    # @return [Boolean] true if any complex property changed, only changed properties are passed to TagLib
 
     # @!endgroup
    */
-   void mergeComplexProperties(Hash in, bool replace_all = false) const;
+   bool mergeComplexProperties(Hash in, bool replace_all = false) const;
 
    Rice::String toString() const;
 
+   // mark Ruby objects referenced from native code
+   void mark() const;
+
    Rice::String inspect() const;
 
+   /** @!yard
+    # Hash of the audio payload, excluding all tags, so retagging a file does not change its digest.
+    #
+    # The audio is located with the same structural probe as {Simple.probe}, and read through
+    # the stream TagLib uses, so unsaved changes are not visible but pending saves are.
+    # For Ogg only the packet data of each page is hashed, as retagging renumbers the page headers.
+    # @note for file names (rather than IO objects) the GVL is released while the audio is read
+    # @param [Symbol<:xxh64>] algorithm
+    # @return [String] hex digest
+    # @raise [TagLib::Error] if the audio payload could not be located
+    def audio_digest(algorithm: :xxh64); end
+   */
+   Rice::String audioDigest(Object options = Qnil) const;
+
+   /** @!yard
+    # Estimate of the native memory held for this file.
+    #
+    # Counts TagLib's tag values (String properties and complex properties such as embedded pictures), changes held
+    # in memory by {#save} and, for IO objects, the read-ahead buffer and prefetched windows. TagLib's per object
+    # overhead, Ruby objects already returned and memory mapped pages (io: :mmap) are not counted.
+    # @return [Integer] bytes, 0 if closed or invalid
+    def memory_usage; end
+   */
+   size_t memoryUsage() const;
+
    /** @!yard
     # Save updates back to the underlying file or stream
-    # @return [void]
-    def save; end
+    #
+    # With :rewrite TagLib writes directly to the file. With the other strategies (or when a previous
+    # :in_place_or_fail save left changes pending) TagLib writes into an in-memory overlay of the file first, and the
+    # result is then checked and written to the file.
+    # If no merge has changed anything since the file was opened (or last saved) TagLib is not asked to save at all.
+    # @note for file names (rather than IO objects) the GVL is released while TagLib writes to the file
+    # @param [Symbol<:rewrite,:in_place_or_fail,:atomic>] strategy
+    #   :rewrite (default) writes whatever TagLib produced, shifting the rest of the file if a tag changed size.
+    #   :in_place_or_fail only writes if no existing content would move (eg the tag still fits in its padding).
+    #   :atomic (file names only) writes the whole file sequentially to a temporary file in the same directory,
+    #   syncs it and renames it over the original. Favours throughput on network file systems and crash safety
+    #   over I/O volume. As the result is a new file, other hard links to the original keep the old content, and
+    #   extended attributes and ACLs are not carried over (the mode and, where permitted, the owner are).
+    # @raise [TagLib::RewriteRequired] for :in_place_or_fail if saving would shift the content of the file.
+    #   Nothing is written and the saved changes remain pending, a subsequent save (eg with :rewrite) writes them,
+    #   close discards them.
+    # @raise [SystemCallError] if an :atomic save fails, the original file is unchanged and changes remain pending
+    # @param [Boolean] force save even if nothing has changed, eg to have TagLib rewrite its tags
+    # @raise [ArgumentError] if :atomic is requested for an IO object
+    # @return [Boolean] true if anything was written
+    def save(strategy: :rewrite, force: false); end
    */
-   void save() const;
+   bool save(Object options = Qnil);
 
   private:
+   // run func with the GVL released, other Ruby threads are refused access to this FileRef meanwhile
+   template<typename Func_T>
+   void releasingGVL(Func_T &&func) const;
+
+   // run func holding the GVL (for IO objects), other fibers the stream yields to are refused access meanwhile
+   template<typename Func_T>
+   void holdingGVL(Func_T &&func) const;
+
+   void raiseBusy() const;
+
+   // open a file name or IO object, leaving fileRef as nullptr if TagLib cannot read it
+   void open(Object fileOrStream, Object readAudioProperties, Object options);
+
+   // open TagLib over stream (via the overlay), leaves fileRef as nullptr if stream cannot be read
+   void openStream(bool readAudioProperties, TagLib::AudioProperties::ReadStyle style);
+
+   // open name the way path was opened (eg the replacement file of an atomic save), throws std::system_error
+   std::unique_ptr<TagLib::IOStream> openFileStream(const std::string &name) const;
+
+   // the (cached) TagLib properties of the open file, from the tag scope if set
+   const TagLib::PropertyMap &cachedProperties() const;
+
+   // the TagLib tag, or the first non empty tag of the scope (nullptr if there is none)
+   const TagLib::Tag *scopedTag() const;
+
+   // writes go through TagLib's merged view of the file, which a tag scope deliberately hides
+   void raiseScoped() const;
+
+   void invalidateProperties() const;
+
    void raiseInvalid() const;
   };
 
@@ -161,4 +345,12 @@ namespace TagLib {
 }
 
 //@!yard end # TagLib
+
+namespace Rice {
+ template<>
+ inline void ruby_mark<TagLib::Simple::FileRef>(TagLib::Simple::FileRef *fileRef) {
+  fileRef->mark();
+ }
+}
+
 void define_taglib_simple_fileref(const Module &rb_mTagLibRuby);
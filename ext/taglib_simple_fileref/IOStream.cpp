@@ -1,23 +1,52 @@
 
 #include "IOStream.hpp"
+#include "Stats.hpp"
+#include "without_gvl.h"
 #include <rice/rice.hpp>
 #include <utility>
 #include <taglib/tiostream.h>
 #include <taglib/tbytevector.h>
 #include <ruby/io.h>
+#include <ruby/fiber/scheduler.h>
+#include <algorithm>
+#include <cstring>
+#include <system_error>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using namespace Rice;
 namespace TagLib {
 namespace Simple {
 
-    IOStream::IOStream(Object ruby_io) : io(std::move(ruby_io)) {
+    IOStream::IOStream(Object ruby_io, const size_type bufferSize, const size_type chunkSize, const bool cooperative) :
+        io(std::move(ruby_io)), bufferSize(bufferSize), chunkSize(chunkSize), cooperative(cooperative) {
         // Only things like File that have a writable? method are considered writable
         // There are techniques to use write-nonblock etc to do this, but callers using custom streams
         // will have to work that out themselves
         openReadOnly = ruby_io.respond_to("writable?") && ruby_io.call("writable?").test();
+        position = NUM2LONG(io.call("tell"));
+        Stats::add(Stats::RubyTellCalls);
+
+        // IO#read(length, outbuf) lets us reuse a single String rather than allocate one per read
+        const int readArity = NUM2INT(io.call("method", Symbol("read")).call("arity").value());
+        rb_gc_register_address(&readBuffer);
+        if (readArity < 0 || readArity >= 2) {
+            try {
+                readBuffer = detail::protect(rb_str_buf_new, static_cast<long>(bufferSize));
+            } catch (...) {
+                rb_gc_unregister_address(&readBuffer);
+                throw;
+            }
+        }
     };
 
-    IOStream::~IOStream() = default;
+    IOStream::~IOStream() {
+        rb_gc_unregister_address(&readBuffer);
+    }
 
     bool IOStream::isIO(const Object& io) {
        return io.respond_to("tell") && io.respond_to("seek") && io.respond_to("read");
@@ -28,65 +57,289 @@ namespace Simple {
     }
 
     TagLib::ByteVector IOStream::readBlock(unsigned long length) {
+        Stats::add(Stats::ReadBlockCalls);
+        if (length == 0) {
+            return {};
+        }
+
+        if (prefetched) {
+            ByteVector result;
+            if (readWindow(head, 0, length, result) || readWindow(tail, tailStart, length, result)) {
+                Stats::add(Stats::ReadBlockBytes, result.size());
+                return result;
+            }
+        }
+
+        const offset_type bufferEnd = bufferStart + static_cast<offset_type>(buffer.size());
+        const offset_type end = position + static_cast<offset_type>(length);
+
+        // Serve entirely from the read-ahead buffer if we can
+        if (position >= bufferStart && end <= bufferEnd) {
+            ByteVector result = buffer.mid(static_cast<unsigned int>(position - bufferStart), length);
+            position = end;
+            Stats::add(Stats::ReadBlockBytes, result.size());
+            return result;
+        }
+
+        // Large reads go direct
+        if (length >= bufferSize) {
+            ByteVector result = readDirect(length);
+            Stats::add(Stats::ReadBlockBytes, result.size());
+            return result;
+        }
+
+        // Otherwise refill the buffer from the current position
+        const offset_type start = position;
+        buffer = readDirect(bufferSize);
+        bufferStart = start;
+
+        ByteVector result = buffer.mid(0, length);
+        position = start + static_cast<offset_type>(result.size());
+        Stats::add(Stats::ReadBlockBytes, result.size());
+        return result;
+    }
+
+    bool IOStream::readWindow(const ByteVector &window, const offset_type windowStart, const unsigned long length,
+                              ByteVector &result) {
+        const offset_type windowEnd = windowStart + static_cast<offset_type>(window.size());
+        const offset_type end = position + static_cast<offset_type>(length);
+        // a window that reaches the end of the stream also serves reads that run past it
+        if (window.isEmpty() || position < windowStart || position > windowEnd ||
+            (end > windowEnd && windowEnd < prefetchedLength)) {
+            return false;
+        }
+        result = window.mid(static_cast<unsigned int>(position - windowStart), length);
+        position += static_cast<offset_type>(result.size());
+        return true;
+    }
+
+    namespace {
+        // args for a tail window fetched in a scheduled fiber: [pread, offset, length, queue]
+        VALUE callPread(VALUE args) {
+            return rb_funcall(rb_ary_entry(args, 0), rb_intern("call"), 2, rb_ary_entry(args, 1), rb_ary_entry(args, 2));
+        }
+
+        // Runs in the scheduled fiber, which may outlive the prefetch that started it. The outcome, [true, window]
+        // or [false, exception], is pushed onto the queue so it is only ever held by Ruby objects
+        VALUE fetchInFiber(RB_BLOCK_CALL_FUNC_ARGLIST(yielded, args)) {
+            int state = 0;
+            const VALUE window = rb_protect(callPread, args, &state);
+            VALUE outcome;
+            if (state) {
+                outcome = rb_assoc_new(Qfalse, rb_errinfo());
+                rb_set_errinfo(Qnil);
+            } else {
+                outcome = rb_assoc_new(Qtrue, window);
+            }
+            return rb_funcall(rb_ary_entry(args, 3), rb_intern("push"), 1, outcome);
+        }
+
+        // Converted through to_str with protection, anything else raises TypeError as a C++ exception
+        ByteVector stringToByteVector(const Object &str) {
+            if (str.is_nil()) {
+                return {};
+            }
+            const VALUE value = detail::protect(rb_str_to_str, str.value());
+            return {RSTRING_PTR(value), static_cast<unsigned int>(RSTRING_LEN(value))};
+        }
+    }
+
+    void IOStream::prefetch(const size_type headLength, const size_type tailLength, const Object &pread) {
+        prefetchedLength = length();
+        const offset_type headEnd = std::min(static_cast<offset_type>(headLength), prefetchedLength);
+        tailStart = std::max(prefetchedLength - static_cast<offset_type>(tailLength), headEnd);
+        const auto tailSize = static_cast<size_type>(prefetchedLength - tailStart);
+
+        const Object scheduler(rb_fiber_scheduler_current());
+        if (!pread.is_nil() && headEnd > 0 && tailSize > 0 && !scheduler.is_nil() && scheduler.respond_to("fiber")) {
+            const Object queue = Object(rb_path2class("Thread::Queue")).call("new");
+            Array args;
+            args.push(pread);
+            args.push(Object(LL2NUM(tailStart)));
+            args.push(Object(ULL2NUM(tailSize)));
+            args.push(queue);
+            using BlockCall = VALUE (*)(VALUE, ID, int, const VALUE *, rb_block_call_func_t, VALUE);
+            detail::protect(static_cast<BlockCall>(rb_block_call), scheduler.value(), rb_intern("fiber"), 0,
+                            static_cast<const VALUE *>(nullptr), &fetchInFiber, args.value());
+            head = fetchWindow(0, static_cast<size_type>(headEnd), pread);
+            // blocks this fiber through the scheduler until the tail fiber has pushed its outcome
+            const Object outcome = queue.call("pop");
+            if (!Object(rb_ary_entry(outcome.value(), 0)).test()) {
+                throw Exception(rb_ary_entry(outcome.value(), 1));
+            }
+            Stats::add(Stats::RubyReadCalls);
+            tail = stringToByteVector(Object(rb_ary_entry(outcome.value(), 1)));
+        } else {
+            head = headEnd > 0 ? fetchWindow(0, static_cast<size_type>(headEnd), pread) : ByteVector();
+            tail = tailSize > 0 ? fetchWindow(tailStart, tailSize, pread) : ByteVector();
+        }
+        prefetched = true;
+    }
+
+    TagLib::ByteVector IOStream::fetchWindow(const offset_type offset, const size_type length, const Object &pread) {
+        if (pread.is_nil()) {
+            return stringToByteVector(readChunk(offset, length));
+        }
+        cooperate();
+        Stats::add(Stats::RubyReadCalls);
+        return stringToByteVector(pread.call("call", offset, length));
+    }
+
+    TagLib::ByteVector IOStream::readDirect(const size_type length) {
+        if (prefetched) {
+            Stats::add(Stats::PrefetchMisses);
+        }
+        cooperate();
+        syncPosition();
         // Call read method on Ruby IO object
-        Object result = io.call("read", (long)length);
+        Object result = readIO(length);
+        Stats::add(Stats::RubyReadCalls);
 
         if (result.is_nil()) {
             return {};
         }
 
-        Rice::String str = Rice::String(result);
-        return {str.c_str(), static_cast<unsigned int>(str.length())};
+        // The only copy, straight from the Ruby String's memory
+        const VALUE str = detail::protect(rb_str_to_str, result.value());
+        const long size = RSTRING_LEN(str);
+        position += static_cast<offset_type>(size);
+        return {RSTRING_PTR(str), static_cast<unsigned int>(size)};
     }
 
-
     void IOStream::writeBlock(const TagLib::ByteVector &data) {
-        // Convert ByteVector to Ruby string and write
-        std::string str(data.data(), data.size());
-        io.call("write", Rice::String(str));
+        invalidate();
+        syncPosition();
+        // Copy ByteVector straight into a new binary Ruby String and write
+        io.call("write", Object(rb_str_new(data.data(), static_cast<long>(data.size()))));
+        Stats::add(Stats::RubyWriteCalls);
+        position += static_cast<offset_type>(data.size());
     }
 
      void IOStream::insert(const TagLib::ByteVector &data, v1_unsigned_offset_type start, size_type replace) {
-        seek(start, Beginning);
-        // If replacing content, first read the content after the replace section
-        Rice::String remainder;
-        if (replace > 0) {
-            seek(static_cast<offset_type>(replace), Current);
-            remainder = io.call("read");
-        }
+        invalidate();
+        const offset_type fileLength = length();
+        const offset_type from = std::min(static_cast<offset_type>(start), fileLength);
+        const offset_type tailStart = std::min(from + static_cast<offset_type>(replace), fileLength);
+        const offset_type tailLength = fileLength - tailStart;
+        const offset_type tailTarget = from + static_cast<offset_type>(data.size());
 
-        // Seek back and write new data
-        seek(start, Beginning);
-        writeBlock(data);
+        // shift the tail of the stream to its new position, then write data into the gap
+        moveContent(tailStart, tailTarget, tailLength);
+        if (!data.isEmpty()) {
+            seek(from, Beginning);
+            writeBlock(data);
+        }
 
-        // Write remaining content if any
-        if (!remainder.is_nil()) {
-            // Write the Ruby string directly back to the IO
-            (void)io.call("write", remainder);
+        if (tailTarget < tailStart) {
+            truncate(tailTarget + tailLength);
         }
+        seek(tailTarget, Beginning);
+    }
 
-        size_type new_length = start + data.size();
-        if (!remainder.is_nil()) {
-            new_length += remainder.length();
+     void IOStream::removeBlock(const v1_unsigned_offset_type start, const size_type length) {
+        insert(ByteVector(), start, length);
+    }
+
+    void IOStream::moveContent(const offset_type from, const offset_type to, const offset_type length) {
+        if (from == to || length <= 0) {
+            return;
         }
+        const auto chunk = static_cast<offset_type>(chunkSize);
+        if (to > from) {
+            // growing, copy backwards from the end so we never overwrite content we haven't read yet
+            for (offset_type end = from + length; end > from;) {
+                const offset_type count = std::min(chunk, end - from);
+                const Object data = readChunkFully(end - count, static_cast<size_type>(count));
+                writeChunk(end - count + (to - from), data);
+                end -= count;
+            }
+        } else {
+            // shrinking, copy forwards
+            for (offset_type offset = 0; offset < length;) {
+                const offset_type count = std::min(chunk, length - offset);
+                const Object data = readChunkFully(from + offset, static_cast<size_type>(count));
+                writeChunk(to + offset, data);
+                offset += count;
+            }
+        }
+    }
 
-        truncate(static_cast<offset_type>(new_length));
+    Object IOStream::readChunk(const offset_type offset, const size_type length) {
+        cooperate();
+        position = offset;
+        syncPosition();
+        Object result = readIO(length);
+        Stats::add(Stats::RubyReadCalls);
+        return result;
     }
 
-     void IOStream::removeBlock(const v1_unsigned_offset_type start, const size_type length) {
-        // Read the content after the section to remove
-        seek(static_cast<offset_type>(start + length), Beginning);
-        Rice::String remainder = io.call("read");
+    [[noreturn]] static void raiseShortRead(const offset_type offset, const size_type length) {
+        throw Exception(rb_eIOError, "Unexpected end of stream reading %lu bytes at %lld",
+                        static_cast<unsigned long>(length), static_cast<long long>(offset));
+    }
+
+    Object IOStream::readChunkFully(const offset_type offset, const size_type length) {
+        const Object first = readChunk(offset, length);
+        if (first.is_nil()) {
+            raiseShortRead(offset, length);
+        }
+        Object data(detail::protect(rb_str_to_str, first.value()));
+        auto received = static_cast<size_type>(RSTRING_LEN(data.value()));
+        if (received >= length) {
+            return data;
+        }
+        // IO#read(n) may return fewer bytes (eg pipes, sockets or custom IO objects), the chunk may be the read
+        // buffer so the rest is appended to a copy
+        data = Object(detail::protect(rb_str_dup, data.value()));
+        while (received < length) {
+            const Object more = io.call("read", (long)(length - received));
+            Stats::add(Stats::RubyReadCalls);
+            if (more.is_nil()) {
+                raiseShortRead(offset, length);
+            }
+            const VALUE str = detail::protect(rb_str_to_str, more.value());
+            if (RSTRING_LEN(str) == 0) {
+                raiseShortRead(offset, length);
+            }
+            detail::protect(rb_str_buf_append, data.value(), str);
+            received += static_cast<size_type>(RSTRING_LEN(str));
+        }
+        return data;
+    }
 
-        // Seek back to start position
-        seek(start, Beginning);
+    Object IOStream::readIO(const size_type length) const {
+        return NIL_P(readBuffer) ? io.call("read", (long)length) : io.call("read", (long)length, Object(readBuffer));
+    }
 
-        // Write the remaining content if any
-        if (!remainder.is_nil()) {
-            (void) io.call("write", remainder);
+    void IOStream::cooperate() const {
+        if (!cooperative) {
+            return;
         }
+        // A non-blocking IO already yields inside IO#read while it waits, but a source that is always ready (or a
+        // parse that is mostly CPU) would otherwise hold this thread until TagLib has finished with the stream.
+        // Called through Rice so an exception raised into the fiber while it is suspended unwinds as a C++ exception
+        const Object scheduler(rb_fiber_scheduler_current());
+        if (!scheduler.is_nil()) {
+            (void) scheduler.call("kernel_sleep", 0);
+        }
+    }
 
-        truncate(static_cast<long>(start + remainder.length()));
+    void IOStream::writeChunk(const offset_type offset, const Object &chunk) {
+        position = offset;
+        syncPosition();
+        (void) io.call("write", chunk);
+        Stats::add(Stats::RubyWriteCalls);
+        const long size = RSTRING_LEN(chunk.value());
+        Stats::add(Stats::RewriteBytes, static_cast<uint64_t>(size));
+        position += static_cast<offset_type>(size);
+    }
+
+    void IOStream::mark() const {
+        rb_gc_mark(io.value());
+    }
+
+    size_t IOStream::memoryUsage() const {
+        return buffer.size() + head.size() + tail.size();
     }
 
     bool IOStream::readOnly() const {
@@ -98,40 +351,47 @@ namespace Simple {
     }
 
     void IOStream::seek(offset_type offset, Position p) {
-        int whence;
+        // Only the native position is updated, the Ruby IO is positioned when we next need to read or write
         switch(p) {
-            case Beginning:
-                whence = SEEK_SET;
-                break;
             case Current:
-                whence = SEEK_CUR;
+                position += offset;
                 break;
             case End:
-                whence = SEEK_END;
+                position = length() + offset;
                 break;
+            case Beginning:
             default:
-                whence = SEEK_SET;
+                position = offset;
         }
+    }
 
-        (void) io.call("seek", offset, whence);
+    void IOStream::syncPosition() const {
+        (void) io.call("seek", position, SEEK_SET);
+        Stats::add(Stats::RubySeekCalls);
     }
 
      offset_type IOStream::tell() const {
-        return NUM2LONG(io.call("tell"));
+        return position;
     }
 
      offset_type IOStream::length() {
-        // Store current position
-        const offset_type current = tell();
-
-        // Seek to end to get length
-        seek(0, End);
-        const offset_type file_length = tell();
-
-        // Restore original position
-        seek(current, Beginning);
+        if (cachedLength < 0) {
+            // Seek to end to get length, the Ruby IO is always re-positioned before use
+            (void) io.call("seek", 0, SEEK_END);
+            cachedLength = NUM2LONG(io.call("tell"));
+            Stats::add(Stats::RubySeekCalls);
+            Stats::add(Stats::RubyTellCalls);
+        }
+        return cachedLength;
+    }
 
-        return file_length;
+    void IOStream::invalidate() {
+        buffer.clear();
+        bufferStart = 0;
+        cachedLength = -1;
+        prefetched = false;
+        head.clear();
+        tail.clear();
     }
 
     void IOStream::clear() {
@@ -142,7 +402,198 @@ namespace Simple {
     // TODO: Truncate is defined on file, but not on IO
     // but other kinds of streams are not rewritable like this anyway.
     void IOStream::truncate(offset_type length) {
+       invalidate();
        (void) io.call("truncate", length);
     }
+
+#if !defined(_WIN32)
+
+    MMapStream::MMapStream(std::string path) : path(std::move(path)) {
+        fd = ::open(this->path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            openReadOnly = true;
+            fd = ::open(this->path.c_str(), O_RDONLY | O_CLOEXEC);
+        }
+        if (fd < 0) {
+            return;
+        }
+
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ::close(fd);
+            fd = -1;
+            return;
+        }
+
+        mapLength = static_cast<size_type>(st.st_size);
+        try {
+            mapFile();
+        } catch (const std::system_error &) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    MMapStream::~MMapStream() {
+        unmapFile();
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    void MMapStream::mapFile() {
+        // mmap of a zero length file is an error, an empty file is just an empty map
+        if (mapLength == 0) {
+            map = nullptr;
+            return;
+        }
+        const int prot = openReadOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+        void *addr = mmap(nullptr, mapLength, prot, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            const int error = systemErrno();
+            map = nullptr;
+            mapLength = 0;
+            unmapped = true;
+            throw std::system_error(error, std::generic_category(), "mmap " + path);
+        }
+        map = static_cast<char *>(addr);
+    }
+
+    void MMapStream::requireMapped() const {
+        if (unmapped) {
+            throw std::system_error(std::make_error_code(std::errc::io_error), "mmap " + path);
+        }
+    }
+
+    void MMapStream::unmapFile() {
+        if (map) {
+            munmap(map, mapLength);
+            map = nullptr;
+        }
+    }
+
+    void MMapStream::resize(const size_type newLength) {
+        requireMapped();
+        if (newLength == mapLength) {
+            return;
+        }
+        unmapFile();
+        if (ftruncate(fd, static_cast<off_t>(newLength)) != 0) {
+            const int error = systemErrno();
+            try {
+                mapFile();
+            } catch (const std::system_error &) {
+                // left unmapped, the ftruncate failure is the one to report
+            }
+            throw std::system_error(error, std::generic_category(), "ftruncate " + path);
+        }
+        mapLength = newLength;
+        mapFile();
+    }
+
+    TagLib::FileName MMapStream::name() const {
+        return path.c_str();
+    }
+
+    TagLib::ByteVector MMapStream::readBlock(unsigned long length) {
+        Stats::add(Stats::ReadBlockCalls);
+        requireMapped();
+        if (position < 0 || static_cast<size_type>(position) >= mapLength || length == 0) {
+            return {};
+        }
+        const size_type available = mapLength - static_cast<size_type>(position);
+        const auto count = static_cast<unsigned int>(std::min<size_type>(length, available));
+        ByteVector result(map + position, count);
+        position += count;
+        Stats::add(Stats::ReadBlockBytes, count);
+        return result;
+    }
+
+    void MMapStream::writeBlock(const TagLib::ByteVector &data) {
+        if (openReadOnly || data.isEmpty()) {
+            return;
+        }
+        requireMapped();
+        const size_type end = static_cast<size_type>(position) + data.size();
+        if (end > mapLength) {
+            resize(end);
+        }
+        std::memcpy(map + position, data.data(), data.size());
+        position = static_cast<offset_type>(end);
+    }
+
+    void MMapStream::insert(const TagLib::ByteVector &data, v1_unsigned_offset_type start, size_type replace) {
+        if (openReadOnly) {
+            return;
+        }
+        requireMapped();
+        const auto from = std::min(static_cast<size_type>(start), mapLength);
+        const size_type tailStart = std::min(from + replace, mapLength);
+        const size_type tailLength = mapLength - tailStart;
+        const size_type newLength = from + data.size() + tailLength;
+
+        // shift the tail of the file to its new position, growing before or shrinking after the move
+        if (newLength > mapLength) {
+            resize(newLength);
+        }
+        if (tailLength > 0) {
+            std::memmove(map + from + data.size(), map + tailStart, tailLength);
+            Stats::add(Stats::RewriteBytes, tailLength);
+        }
+        if (newLength < mapLength) {
+            resize(newLength);
+        }
+        if (!data.isEmpty()) {
+            std::memcpy(map + from, data.data(), data.size());
+        }
+        position = static_cast<offset_type>(from + data.size());
+    }
+
+    void MMapStream::removeBlock(const v1_unsigned_offset_type start, const size_type length) {
+        insert(ByteVector(), start, length);
+    }
+
+    void MMapStream::seek(const offset_type offset, const Position p) {
+        requireMapped();
+        switch (p) {
+            case Current:
+                position += offset;
+                break;
+            case End:
+                position = static_cast<offset_type>(mapLength) + offset;
+                break;
+            case Beginning:
+            default:
+                position = offset;
+        }
+    }
+
+    void MMapStream::clear() {
+        // nothing to do, there is no error state
+    }
+
+    offset_type MMapStream::tell() const {
+        return position;
+    }
+
+    offset_type MMapStream::length() {
+        return static_cast<offset_type>(mapLength);
+    }
+
+    void MMapStream::truncate(const offset_type length) {
+        if (openReadOnly) {
+            return;
+        }
+        resize(static_cast<size_type>(length));
+    }
+
+    bool MMapStream::isOpen() const {
+        return fd >= 0 && !unmapped;
+    }
+
+    bool MMapStream::readOnly() const {
+        return openReadOnly;
+    }
+#endif
+}
 }
-}
\ No newline at end of file
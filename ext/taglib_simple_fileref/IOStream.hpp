@@ -3,6 +3,7 @@
 #include "taglib_wrap.h"
 #include <taglib/tiostream.h>
 #include <rice/rice.hpp>
+#include <string>
 
 using namespace Rice;
 
@@ -23,14 +24,111 @@ namespace TagLib {
 
 
         // An TagLib::IOStream from Ruby IO
+        //
+        // The stream position is tracked natively, and small reads are served from a read-ahead buffer,
+        // to avoid dispatching a Ruby method call for every block TagLib reads.
         class IOStream final : public TagLib::IOStream  {
             Object io;
+            // Reusable String for IO#read(length, outbuf), nil if the IO does not take an outbuf.
+            // Registered as a GC root for the life of the stream, which may be on the stack (probe) or not yet
+            // reachable from a Ruby object (while a FileRef is being constructed)
+            VALUE readBuffer = Qnil;
+            // read-ahead block size, 0 to disable
+            size_type bufferSize;
+            // maximum bytes held in memory while shifting file content in insert/removeBlock
+            size_type chunkSize;
+            ByteVector buffer;
+            offset_type bufferStart = 0;
+            offset_type position = 0;
+            // -1 if not yet known
+            offset_type cachedLength = -1;
+            // yield to the Fiber scheduler (if any) before each Ruby read
+            bool cooperative;
+            // windows of the stream fetched up front by prefetch, served before the read-ahead buffer
+            bool prefetched = false;
+            ByteVector head;
+            ByteVector tail;
+            offset_type tailStart = 0;
+            offset_type prefetchedLength = 0;
+
         public:
+            static constexpr size_type DEFAULT_BUFFER_SIZE = 64 * 1024;
+            static constexpr size_type DEFAULT_CHUNK_SIZE = 1024 * 1024;
             static bool isIO(const Object& io);
             bool openReadOnly;
-            explicit IOStream(Object ruby_io);
+            explicit IOStream(Object ruby_io, size_type bufferSize = DEFAULT_BUFFER_SIZE,
+                              size_type chunkSize = DEFAULT_CHUNK_SIZE, bool cooperative = true);
 
             ~IOStream() override;
+
+            IOStream(const IOStream &) = delete;
+            IOStream &operator=(const IOStream &) = delete;
+            FileName name() const override;
+            ByteVector readBlock(unsigned long length) override;
+            void writeBlock(const ByteVector &data) override;
+            void insert(const ByteVector &data, v1_unsigned_offset_type start, size_type replace) override;
+            void removeBlock(v1_unsigned_offset_type start, size_type length) override;
+            void seek(offset_type offset, Position p) override;
+            void clear() override;
+            offset_type tell() const override;
+            offset_type length() override;
+            void truncate(offset_type length) override;
+            bool isOpen() const override;
+            bool readOnly() const override;
+
+            // Fetch the first headLength and last tailLength bytes of the stream with one read each, through
+            // pread.call(offset, length) or if pread is nil a seek and read. With a pread and a Fiber scheduler the
+            // tail is fetched in a scheduled fiber while the head is fetched in this one.
+            void prefetch(size_type headLength, size_type tailLength, const Object &pread);
+
+            // mark Ruby objects held by this stream (called from the owning FileRef's mark function)
+            void mark() const;
+
+            // bytes held in the read-ahead buffer and prefetched windows
+            size_t memoryUsage() const;
+
+        private:
+            // seek the Ruby IO to the current native position
+            void syncPosition() const;
+            // let other fibers run between blocks when the current thread has a Fiber scheduler
+            void cooperate() const;
+            // serve length bytes at the current position from a prefetched window, false unless entirely within it
+            bool readWindow(const ByteVector &window, offset_type windowStart, unsigned long length, ByteVector &result);
+            ByteVector fetchWindow(offset_type offset, size_type length, const Object &pread);
+            // read up to length bytes from the Ruby IO at the current native position, without buffering
+            ByteVector readDirect(size_type length);
+            // copy length bytes at from to to, one chunk at a time in whichever direction is safe for overlaps
+            void moveContent(offset_type from, offset_type to, offset_type length);
+            // read up to length bytes at offset into a Ruby String, nil at end of stream
+            Object readChunk(offset_type offset, size_type length);
+            // read exactly length bytes at offset, repeating short reads. Raises IOError if the stream ends first
+            Object readChunkFully(offset_type offset, size_type length);
+            // IO#read at the Ruby IO's position, into readBuffer if there is one
+            Object readIO(size_type length) const;
+            void writeChunk(offset_type offset, const Object &chunk);
+            void invalidate();
+        };
+
+#if !defined(_WIN32)
+        // A TagLib::IOStream over a memory mapped local file.
+        //
+        // Reads are served straight from the mapping, leaving the page cache to do the I/O. Writes go through the
+        // (shared) mapping, which is re-mapped whenever the file length changes.
+        class MMapStream final : public TagLib::IOStream {
+            std::string path;
+            int fd = -1;
+            bool openReadOnly = false;
+            char *map = nullptr;
+            size_type mapLength = 0;
+            offset_type position = 0;
+            // a remap failed, the file is no longer mapped and every further access throws
+            bool unmapped = false;
+
+        public:
+            explicit MMapStream(std::string path);
+
+            ~MMapStream() override;
+
             FileName name() const override;
             ByteVector readBlock(unsigned long length) override;
             void writeBlock(const ByteVector &data) override;
@@ -43,6 +141,16 @@ namespace TagLib {
             void truncate(offset_type length) override;
             bool isOpen() const override;
             bool readOnly() const override;
+
+        private:
+            // change the file length and map the result
+            void resize(size_type newLength);
+            // map mapLength bytes of the file, on failure leaves the stream unmapped and throws std::system_error
+            void mapFile();
+            // throws std::system_error if a failed remap left the stream unmapped
+            void requireMapped() const;
+            void unmapFile();
         };
+#endif
     } // Ruby
 } // TagLib
\ No newline at end of file
@@ -0,0 +1,292 @@
+#include "OverlayStream.hpp"
+#include <algorithm>
+
+namespace TagLib {
+    namespace Simple {
+
+        OverlayStream::OverlayStream(TagLib::IOStream *base) : base(base) {}
+
+        OverlayStream::~OverlayStream() = default;
+
+        void OverlayStream::begin() {
+            if (journaling) {
+                return;
+            }
+            journaling = true;
+            position = base->tell();
+            baseLength = base->length();
+            journalSize = baseLength;
+            cursorIndex = 0;
+            cursorStart = 0;
+            pieces.clear();
+            if (baseLength > 0) {
+                pieces.push_back(Piece{0, baseLength, ByteVector()});
+            }
+        }
+
+        bool OverlayStream::pending() const {
+            return journaling;
+        }
+
+        size_t OverlayStream::memoryUsage() const {
+            size_t bytes = pieces.capacity() * sizeof(Piece);
+            for (const auto &piece: pieces) {
+                bytes += piece.data.size();
+            }
+            return bytes;
+        }
+
+        bool OverlayStream::inPlace() const {
+            offset_type offset = 0;
+            for (const auto &piece: pieces) {
+                if (piece.baseOffset >= 0 && piece.baseOffset != offset) {
+                    return false;
+                }
+                offset += piece.length;
+            }
+            return true;
+        }
+
+        void OverlayStream::commit() {
+            if (!journaling) {
+                return;
+            }
+            try {
+                commitPieces();
+            } catch (...) {
+                // the journal no longer describes the base stream, it must not be replayed by a later save
+                discard();
+                throw;
+            }
+        }
+
+        void OverlayStream::commitPieces() {
+            // Replace each gap between runs of unchanged content with the new data that fills it, left to right
+            // so earlier edits have already shifted the base stream by `shift` bytes.
+            offset_type shift = 0;
+            offset_type baseCursor = 0;
+            ByteVector data;
+            auto flush = [&](const offset_type gapEnd) {
+                const offset_type gap = gapEnd - baseCursor;
+                if (!data.isEmpty()) {
+                    base->insert(data, baseCursor + shift, static_cast<size_type>(gap));
+                } else if (gap > 0) {
+                    base->removeBlock(baseCursor + shift, static_cast<size_type>(gap));
+                }
+                shift += static_cast<offset_type>(data.size()) - gap;
+                data.clear();
+            };
+
+            for (const auto &piece: pieces) {
+                if (piece.baseOffset < 0) {
+                    data.append(piece.data);
+                    continue;
+                }
+                if (!data.isEmpty() || piece.baseOffset > baseCursor) {
+                    flush(piece.baseOffset);
+                }
+                baseCursor = piece.baseOffset + piece.length;
+            }
+            // Trailing data, or content removed from the end
+            if (!data.isEmpty()) {
+                flush(baseLength);
+            } else if (baseCursor < baseLength) {
+                base->truncate(baseCursor + shift);
+            }
+
+            const offset_type committedPosition = position;
+            discard();
+            base->seek(committedPosition, Beginning);
+        }
+
+        void OverlayStream::discard() {
+            journaling = false;
+            pieces.clear();
+            baseLength = 0;
+            journalSize = 0;
+            cursorIndex = 0;
+            cursorStart = 0;
+        }
+
+        void OverlayStream::rebase(TagLib::IOStream *newBase, const std::string &name) {
+            const offset_type current = tell();
+            discard();
+            base = newBase;
+            baseName = name;
+            base->seek(current, Beginning);
+        }
+
+        FileName OverlayStream::name() const {
+            return baseName.empty() ? base->name() : FileName(baseName.c_str());
+        }
+
+        ByteVector OverlayStream::readBlock(const unsigned long length) {
+            if (!journaling) {
+                return base->readBlock(length);
+            }
+
+            ByteVector result;
+            offset_type remaining = static_cast<offset_type>(length);
+            offset_type offset = 0;
+            for (size_t i = locate(position, offset); i < pieces.size() && remaining > 0; i++) {
+                const Piece &piece = pieces[i];
+                const offset_type inner = position - offset;
+                const offset_type count = std::min(remaining, piece.length - inner);
+                if (piece.baseOffset < 0) {
+                    result.append(piece.data.mid(static_cast<unsigned int>(inner), static_cast<unsigned int>(count)));
+                } else {
+                    base->seek(piece.baseOffset + inner, Beginning);
+                    result.append(base->readBlock(static_cast<unsigned long>(count)));
+                }
+                position += count;
+                remaining -= count;
+                offset += piece.length;
+                cursorIndex = i + 1;
+                cursorStart = offset;
+            }
+            return result;
+        }
+
+        void OverlayStream::writeBlock(const ByteVector &data) {
+            if (!journaling) {
+                base->writeBlock(data);
+                return;
+            }
+            const offset_type size = static_cast<offset_type>(data.size());
+            const offset_type overwrite = std::max<offset_type>(0, std::min(size, journalLength() - position));
+            replace(position, overwrite, data);
+            position += size;
+        }
+
+        void OverlayStream::insert(const ByteVector &data, const v1_unsigned_offset_type start, const size_type replaceLength) {
+            if (!journaling) {
+                base->insert(data, start, replaceLength);
+                return;
+            }
+            replace(static_cast<offset_type>(start), static_cast<offset_type>(replaceLength), data);
+            position = static_cast<offset_type>(start) + static_cast<offset_type>(data.size());
+        }
+
+        void OverlayStream::removeBlock(const v1_unsigned_offset_type start, const size_type length) {
+            if (!journaling) {
+                base->removeBlock(start, length);
+                return;
+            }
+            replace(static_cast<offset_type>(start), static_cast<offset_type>(length), ByteVector());
+        }
+
+        void OverlayStream::seek(const offset_type offset, const Position p) {
+            if (!journaling) {
+                base->seek(offset, p);
+                return;
+            }
+            switch (p) {
+                case Current:
+                    position += offset;
+                    break;
+                case End:
+                    position = journalLength() + offset;
+                    break;
+                case Beginning:
+                default:
+                    position = offset;
+            }
+        }
+
+        void OverlayStream::clear() {
+            base->clear();
+        }
+
+        offset_type OverlayStream::tell() const {
+            return journaling ? position : base->tell();
+        }
+
+        offset_type OverlayStream::length() {
+            return journaling ? journalLength() : base->length();
+        }
+
+        void OverlayStream::truncate(const offset_type length) {
+            if (!journaling) {
+                base->truncate(length);
+                return;
+            }
+            const offset_type current = journalLength();
+            if (length < current) {
+                replace(length, current - length, ByteVector());
+            } else if (length > current) {
+                replace(current, 0, ByteVector(static_cast<unsigned int>(length - current), 0));
+            }
+        }
+
+        bool OverlayStream::isOpen() const {
+            return base->isOpen();
+        }
+
+        bool OverlayStream::readOnly() const {
+            return base->readOnly();
+        }
+
+        offset_type OverlayStream::journalLength() const {
+            return journalSize;
+        }
+
+        size_t OverlayStream::locate(const offset_type offset, offset_type &start) const {
+            size_t i = 0;
+            start = 0;
+            if (cursorIndex <= pieces.size() && cursorStart <= offset) {
+                i = cursorIndex;
+                start = cursorStart;
+            }
+            while (i < pieces.size() && offset >= start + pieces[i].length) {
+                start += pieces[i].length;
+                i++;
+            }
+            cursorIndex = i;
+            cursorStart = start;
+            return i;
+        }
+
+        void OverlayStream::replace(offset_type start, offset_type removeLength, const ByteVector &data) {
+            const offset_type total = journalLength();
+            if (start > total) {
+                // writing past the end, fill the hole with zeroes as a file would
+                pieces.push_back(Piece{-1, start - total, ByteVector(static_cast<unsigned int>(start - total), 0)});
+                journalSize = start;
+            }
+            const offset_type removeEnd = std::min(start + removeLength, std::max(start, total));
+            const size_t first = split(start);
+            const size_t last = split(removeEnd);
+            pieces.erase(pieces.begin() + static_cast<std::ptrdiff_t>(first),
+                         pieces.begin() + static_cast<std::ptrdiff_t>(last));
+            if (!data.isEmpty()) {
+                pieces.insert(pieces.begin() + static_cast<std::ptrdiff_t>(first),
+                              Piece{-1, static_cast<offset_type>(data.size()), data});
+            }
+            journalSize += static_cast<offset_type>(data.size()) - (removeEnd - start);
+            // pieces before first are unchanged, and first starts at start
+            cursorIndex = first;
+            cursorStart = start;
+        }
+
+        size_t OverlayStream::split(const offset_type offset) {
+            offset_type pieceStart = 0;
+            const size_t i = locate(offset, pieceStart);
+            if (i == pieces.size() || offset == pieceStart) {
+                return i;
+            }
+            Piece &piece = pieces[i];
+            const offset_type inner = offset - pieceStart;
+            Piece tail{
+                piece.baseOffset < 0 ? -1 : piece.baseOffset + inner,
+                piece.length - inner,
+                piece.baseOffset < 0 ? piece.data.mid(static_cast<unsigned int>(inner)) : ByteVector()
+            };
+            piece.length = inner;
+            if (piece.baseOffset < 0) {
+                piece.data = piece.data.mid(0, static_cast<unsigned int>(inner));
+            }
+            pieces.insert(pieces.begin() + static_cast<std::ptrdiff_t>(i) + 1, std::move(tail));
+            return i + 1;
+        }
+    }
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "taglib_wrap.h"
+#include "IOStream.hpp"
+#include <taglib/tiostream.h>
+#include <string>
+#include <vector>
+
+namespace TagLib {
+    namespace Simple {
+
+        // A TagLib::IOStream that can hold changes in memory before they are written to an underlying stream.
+        //
+        // Until begin() is called everything passes straight through to the base stream. While journaling the
+        // stream is a piece table: runs of unchanged base content and runs of new data. TagLib reads its own
+        // writes from the table, and nothing touches the base stream until commit().
+        //
+        // Because pieces of base content never move relative to each other, a set of changes can be checked
+        // before commit to see whether it can be written in place (no base content changes position).
+        class OverlayStream final : public TagLib::IOStream {
+            struct Piece {
+                // offset of this run in the base stream, -1 for new data
+                offset_type baseOffset;
+                offset_type length;
+                ByteVector data;
+            };
+
+            TagLib::IOStream *base;
+            // reported instead of the base stream's name, if set by rebase()
+            std::string baseName;
+            bool journaling = false;
+            std::vector<Piece> pieces;
+            // length of the base stream when journaling began
+            offset_type baseLength = 0;
+            // total length of the pieces
+            offset_type journalSize = 0;
+            offset_type position = 0;
+            // a piece index and its start offset, where the last lookup ended. TagLib mostly reads and writes
+            // sequentially so lookups walk forward from here rather than from the first piece
+            mutable size_t cursorIndex = 0;
+            mutable offset_type cursorStart = 0;
+
+        public:
+            explicit OverlayStream(TagLib::IOStream *base);
+
+            ~OverlayStream() override;
+
+            // start holding changes in memory, no-op if changes are already pending
+            void begin();
+
+            // true if there are changes held in memory
+            bool pending() const;
+
+            // bytes of new data held in memory
+            size_t memoryUsage() const;
+
+            // true if the pending changes can be written without moving any existing content of the base stream
+            bool inPlace() const;
+
+            // write pending changes to the base stream and resume passing through to it. If writing fails the
+            // changes are discarded, the base stream may then be partly written
+            void commit();
+
+            // forget pending changes and resume passing through to the base stream
+            void discard();
+
+            // Replay the entire (journalled) content of the stream in order. Runs of unchanged base content are
+            // passed to copyBase(offset, length), new data to writeData(data).
+            template<typename CopyBase_T, typename WriteData_T>
+            void replay(CopyBase_T &&copyBase, WriteData_T &&writeData) {
+                if (!journaling) {
+                    copyBase(offset_type(0), base->length());
+                    return;
+                }
+                for (const auto &piece: pieces) {
+                    if (piece.baseOffset < 0) {
+                        writeData(piece.data);
+                    } else {
+                        copyBase(piece.baseOffset, piece.length);
+                    }
+                }
+            }
+
+            // switch to a new base stream that already holds the journalled content, eg after replay() wrote
+            // it to a new file, and resume passing through to it. name (if not empty) is reported instead of the new
+            // stream's own name, eg when it was opened under a temporary name before being renamed
+            void rebase(TagLib::IOStream *newBase, const std::string &name = std::string());
+
+            FileName name() const override;
+            ByteVector readBlock(unsigned long length) override;
+            void writeBlock(const ByteVector &data) override;
+            void insert(const ByteVector &data, v1_unsigned_offset_type start, size_type replace) override;
+            void removeBlock(v1_unsigned_offset_type start, size_type length) override;
+            void seek(offset_type offset, Position p) override;
+            void clear() override;
+            offset_type tell() const override;
+            offset_type length() override;
+            void truncate(offset_type length) override;
+            bool isOpen() const override;
+            bool readOnly() const override;
+
+        private:
+            void commitPieces();
+            offset_type journalLength() const;
+            // index of the piece holding offset (pieces.size() at or past the end), and sets start to its offset
+            size_t locate(offset_type offset, offset_type &start) const;
+            // replace removeLength bytes at start with data
+            void replace(offset_type start, offset_type removeLength, const ByteVector &data);
+            // index of the piece starting at offset, splitting the piece containing offset if necessary
+            size_t split(offset_type offset);
+        };
+    }
+}
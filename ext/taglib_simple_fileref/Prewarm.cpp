@@ -0,0 +1,53 @@
+#include "Prewarm.hpp"
+#include "conversions.h"
+#include <taglib/fileref.h>
+#include <taglib/id3v2framefactory.h>
+#include <taglib/tbytevectorstream.h>
+#include <string>
+
+using namespace Rice;
+
+namespace TagLib {
+    namespace Simple {
+        namespace {
+            // ID3v2.4 tag with a single UTF-8 TIT2 frame, followed by two MPEG-1 Layer III frames (128kbps, 44.1kHz)
+            TagLib::ByteVector prewarmMPEG() {
+                static constexpr char title[] = "prewarm";
+                static constexpr unsigned frameLength = 417;
+                const unsigned textLength = sizeof(title); // encoding byte plus text
+                const unsigned tagLength = 10 + textLength;
+
+                std::string data("ID3\x04\x00\x00", 6);
+                data += {0, 0, 0, static_cast<char>(tagLength)};
+                data += "TIT2";
+                data += {0, 0, 0, static_cast<char>(textLength), 0, 0, 3};
+                data.append(title, textLength - 1);
+                for (int i = 0; i < 2; i++) {
+                    std::string frame(frameLength, '\0');
+                    frame.replace(0, 4, "\xFF\xFB\x90\x64", 4);
+                    data += frame;
+                }
+                return {data.data(), static_cast<unsigned int>(data.size())};
+            }
+        }
+
+        void prewarm() {
+            resolveTagLibClasses();
+
+            TagLib::ID3v2::FrameFactory::instance();
+            TagLib::FileRef::defaultFileExtensions();
+
+            // content detection runs every registered file type, then the MPEG parse and string conversion warm the
+            // factory and this thread's scratch bytes
+            TagLib::ByteVectorStream stream(prewarmMPEG());
+            const TagLib::FileRef fileRef(&stream, true, TagLib::AudioProperties::Average);
+            if (!fileRef.isNull() && fileRef.tag()) {
+                tagLibStringToUTF8(fileRef.tag()->title());
+            }
+        }
+    }
+}
+
+void define_taglib_simple_prewarm(const Module &rb_mParent) {
+    Module(rb_mParent).define_module_function("prewarm!", &TagLib::Simple::prewarm);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <rice/rice.hpp>
+
+using namespace Rice;
+
+// @!yard module TagLib
+namespace TagLib {
+ // @!yard module Simple
+ namespace Simple {
+
+  /** @!yard
+   # Resolve everything the extension otherwise sets up lazily on first use.
+   #
+   # Looks up the Ruby classes raised and returned by the extension, and has TagLib build its frame factory, file
+   # type detection and string conversion state by parsing a small in-memory MPEG file.
+   #
+   # Called when the extension is loaded, and safe to call again. Call it explicitly before forking workers (after
+   # any TagLib customisation) so that this state is shared copy-on-write and the first file read by each worker costs
+   # the same as every other. No threads are started, so it is always safe before fork.
+   # @return [nil]
+   def self.prewarm!; end
+   */
+  void prewarm();
+ }
+
+ //@!yard end # Simple
+}
+
+//@!yard end # TagLib
+void define_taglib_simple_prewarm(const Module &rb_mTagLibRuby);
@@ -0,0 +1,462 @@
+#include "Probe.hpp"
+#include "conversions.h"
+#include "without_gvl.h"
+#include <taglib/tfilestream.h>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+using namespace Rice;
+
+namespace TagLib {
+    namespace Simple {
+        namespace {
+            // enough to skip to the audio after an ID3v2 tag when there is junk or padding in between
+            constexpr offset_type MPEG_SYNC_SCAN = 4096;
+            // guards against looping forever over corrupt structures
+            constexpr int MAX_ENTRIES = 100000;
+            constexpr size_type IO_READ_AHEAD = 4096;
+
+            ByteVector readAt(TagLib::IOStream &stream, const offset_type offset, const unsigned long length) {
+                stream.seek(offset, TagLib::IOStream::Beginning);
+                return stream.readBlock(length);
+            }
+
+            const unsigned char *bytes(const ByteVector &data) {
+                return reinterpret_cast<const unsigned char *>(data.data());
+            }
+
+            uint32_t bigEndian32(const ByteVector &data, const unsigned int offset) {
+                const unsigned char *b = bytes(data) + offset;
+                return static_cast<uint32_t>(b[0]) << 24 | static_cast<uint32_t>(b[1]) << 16 |
+                       static_cast<uint32_t>(b[2]) << 8 | b[3];
+            }
+
+            uint64_t bigEndian64(const ByteVector &data, const unsigned int offset) {
+                return static_cast<uint64_t>(bigEndian32(data, offset)) << 32 | bigEndian32(data, offset + 4);
+            }
+
+            uint32_t littleEndian32(const ByteVector &data, const unsigned int offset) {
+                const unsigned char *b = bytes(data) + offset;
+                return static_cast<uint32_t>(b[3]) << 24 | static_cast<uint32_t>(b[2]) << 16 |
+                       static_cast<uint32_t>(b[1]) << 8 | b[0];
+            }
+
+            bool matches(const ByteVector &data, const unsigned int offset, const char *id) {
+                const size_t length = std::strlen(id);
+                return data.size() >= offset + length && std::memcmp(data.data() + offset, id, length) == 0;
+            }
+
+            // ID3v2 tags at offset, returns the offset after them
+            offset_type probeID3v2(TagLib::IOStream &stream, offset_type offset, ProbeResult &result) {
+                for (int i = 0; i < MAX_ENTRIES; i++) {
+                    const ByteVector header = readAt(stream, offset, 10);
+                    if (header.size() < 10 || !matches(header, 0, "ID3")) {
+                        break;
+                    }
+                    const unsigned char *b = bytes(header);
+                    offset_type size = 10 + (static_cast<offset_type>(b[6] & 0x7f) << 21 |
+                                             static_cast<offset_type>(b[7] & 0x7f) << 14 |
+                                             static_cast<offset_type>(b[8] & 0x7f) << 7 |
+                                             static_cast<offset_type>(b[9] & 0x7f));
+                    if (b[5] & 0x10) {
+                        size += 10; // footer
+                    }
+                    result.tags.push_back({"id3v2", offset, size});
+                    offset += size;
+                }
+                return offset;
+            }
+
+            // Tail tags of formats that allow them, returns the offset where they start
+            offset_type probeTrailingTags(TagLib::IOStream &stream, offset_type end, ProbeResult &result) {
+                if (end >= 128 && matches(readAt(stream, end - 128, 3), 0, "TAG")) {
+                    end -= 128;
+                    result.tags.push_back({"id3v1", end, 128});
+                }
+                if (end >= 32) {
+                    const ByteVector footer = readAt(stream, end - 32, 32);
+                    if (footer.size() == 32 && matches(footer, 0, "APETAGEX")) {
+                        // size includes the footer but not the optional header
+                        offset_type size = littleEndian32(footer, 12);
+                        if (littleEndian32(footer, 20) & 0x80000000U) {
+                            size += 32;
+                        }
+                        if (size <= end) {
+                            end -= size;
+                            result.tags.push_back({"ape", end, size});
+                        }
+                    }
+                }
+                return end;
+            }
+
+            bool probeFLAC(TagLib::IOStream &stream, const offset_type start, ProbeResult &result) {
+                offset_type offset = start + 4;
+                for (int i = 0; i < MAX_ENTRIES; i++) {
+                    const ByteVector header = readAt(stream, offset, 4);
+                    if (header.size() < 4) {
+                        return false;
+                    }
+                    const unsigned char *b = bytes(header);
+                    const offset_type size = 4 + (static_cast<offset_type>(b[1]) << 16 |
+                                                  static_cast<offset_type>(b[2]) << 8 | b[3]);
+                    const int type = b[0] & 0x7f;
+                    if (type == 4) {
+                        result.tags.push_back({"xiph_comment", offset, size});
+                    } else if (type == 6) {
+                        result.tags.push_back({"flac_picture", offset, size});
+                    }
+                    offset += size;
+                    if (b[0] & 0x80) {
+                        break;
+                    }
+                }
+                result.format = "flac";
+                result.audioOffset = offset;
+                return true;
+            }
+
+            // Ogg pages up to the first page that carries audio, the comment header sits in the header pages
+            // after the first one
+            bool probeOgg(TagLib::IOStream &stream, const offset_type start, const offset_type length,
+                          ProbeResult &result) {
+                offset_type offset = start;
+                offset_type commentStart = -1;
+                for (int page = 0; page < MAX_ENTRIES && offset < length; page++) {
+                    const ByteVector header = readAt(stream, offset, 27);
+                    if (header.size() < 27 || !matches(header, 0, "OggS")) {
+                        break;
+                    }
+                    const uint64_t granule = static_cast<uint64_t>(littleEndian32(header, 10)) << 32 |
+                                             littleEndian32(header, 6);
+                    const unsigned int segments = bytes(header)[26];
+                    const ByteVector table = readAt(stream, offset + 27, segments);
+                    offset_type size = 27 + segments;
+                    for (const char segment: table) {
+                        size += static_cast<unsigned char>(segment);
+                    }
+
+                    if (page == 0) {
+                        const ByteVector packet = readAt(stream, offset + 27 + segments, 8);
+                        if (matches(packet, 0, "\x01vorbis")) {
+                            result.format = "ogg_vorbis";
+                        } else if (matches(packet, 0, "OpusHead")) {
+                            result.format = "ogg_opus";
+                        } else if (matches(packet, 0, "\x7f" "FLAC")) {
+                            result.format = "ogg_flac";
+                        } else if (matches(packet, 0, "Speex   ")) {
+                            result.format = "ogg_speex";
+                        } else {
+                            result.format = "ogg";
+                        }
+                    } else if (granule != 0 && granule != UINT64_MAX) {
+                        // first audio page
+                        break;
+                    } else if (commentStart < 0) {
+                        commentStart = offset;
+                    }
+                    offset += size;
+                }
+                if (!result.format) {
+                    return false;
+                }
+                if (commentStart >= 0) {
+                    result.tags.push_back({"xiph_comment", commentStart, offset - commentStart});
+                }
+                result.audioOffset = offset;
+                return true;
+            }
+
+            struct Atom {
+                offset_type offset = -1;
+                offset_type headerSize = 0;
+                offset_type size = 0;
+            };
+
+            // first atom named type between start and end
+            Atom findAtom(TagLib::IOStream &stream, offset_type start, const offset_type end, const char *type) {
+                for (int i = 0; i < MAX_ENTRIES && start + 8 <= end; i++) {
+                    const ByteVector header = readAt(stream, start, 16);
+                    if (header.size() < 8) {
+                        break;
+                    }
+                    Atom atom{start, 8, bigEndian32(header, 0)};
+                    if (atom.size == 1 && header.size() == 16) {
+                        atom.headerSize = 16;
+                        atom.size = static_cast<offset_type>(bigEndian64(header, 8));
+                    } else if (atom.size == 0) {
+                        atom.size = end - start;
+                    }
+                    if (atom.size < atom.headerSize) {
+                        break;
+                    }
+                    if (matches(header, 4, type)) {
+                        return atom;
+                    }
+                    start += atom.size;
+                }
+                return {};
+            }
+
+            bool probeMP4(TagLib::IOStream &stream, const offset_type length, ProbeResult &result) {
+                result.format = "mp4";
+                const Atom mdat = findAtom(stream, 0, length, "mdat");
+                if (mdat.offset >= 0) {
+                    result.audioOffset = mdat.offset + mdat.headerSize;
+                    result.audioSize = mdat.size - mdat.headerSize;
+                }
+                const Atom moov = findAtom(stream, 0, length, "moov");
+                if (moov.offset < 0) {
+                    return true;
+                }
+                const Atom udta = findAtom(stream, moov.offset + moov.headerSize, moov.offset + moov.size, "udta");
+                if (udta.offset < 0) {
+                    return true;
+                }
+                const Atom meta = findAtom(stream, udta.offset + udta.headerSize, udta.offset + udta.size, "meta");
+                if (meta.offset < 0) {
+                    return true;
+                }
+                // meta is a full box, version and flags precede its children
+                const Atom ilst = findAtom(stream, meta.offset + meta.headerSize + 4, meta.offset + meta.size, "ilst");
+                if (ilst.offset >= 0) {
+                    result.tags.push_back({"mp4", ilst.offset, ilst.size});
+                }
+                return true;
+            }
+
+            // RIFF (little endian) and IFF/AIFF (big endian) chunks
+            bool probeChunks(TagLib::IOStream &stream, const offset_type length, const bool bigEndian,
+                             ProbeResult &result) {
+                result.format = bigEndian ? "aiff" : "wav";
+                offset_type offset = 12;
+                for (int i = 0; i < MAX_ENTRIES && offset + 8 <= length; i++) {
+                    const ByteVector header = readAt(stream, offset, 12);
+                    if (header.size() < 8) {
+                        break;
+                    }
+                    const offset_type size = bigEndian ? bigEndian32(header, 4) : littleEndian32(header, 4);
+                    if (matches(header, 0, bigEndian ? "SSND" : "data")) {
+                        result.audioOffset = offset + 8;
+                        result.audioSize = std::min(size, length - offset - 8);
+                    } else if (matches(header, 0, "ID3 ") || matches(header, 0, "id3 ")) {
+                        result.tags.push_back({"id3v2", offset + 8, size});
+                    } else if (!bigEndian && matches(header, 0, "LIST") && matches(header, 8, "INFO")) {
+                        result.tags.push_back({"riff_info", offset, size + 8});
+                    }
+                    // chunks are padded to an even length
+                    offset += 8 + size + (size & 1);
+                }
+                return true;
+            }
+
+            struct FrameHeader {
+                const char *format = nullptr;
+                offset_type length = 0;
+            };
+
+            // kbps by [MPEG-1 or not][layer I, II, III][bitrate index - 1]
+            constexpr uint16_t MPEG_BITRATES[2][3][14] = {
+                {
+                    {32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+                    {32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+                    {32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320}
+                },
+                {
+                    {32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+                    {8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+                    {8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}
+                }
+            };
+            // MPEG-1 rates, halved for MPEG-2 and quartered for MPEG-2.5
+            constexpr unsigned int MPEG_SAMPLE_RATES[3] = {44100, 48000, 32000};
+
+            // MPEG audio or ADTS AAC frame header at b, no format if it is not a valid header. Free format MPEG
+            // (bitrate index 0) is rejected as its frame length cannot be computed from the header.
+            FrameHeader parseFrameHeader(const unsigned char *b, const size_t available) {
+                FrameHeader header;
+                if (available < 4 || b[0] != 0xff || (b[1] & 0xe0) != 0xe0) {
+                    return header;
+                }
+                const unsigned int layer = (b[1] >> 1) & 0x03;
+                if ((b[1] & 0xf6) == 0xf0) {
+                    // ADTS, the length includes the header
+                    if (available < 6 || ((b[2] >> 2) & 0x0f) > 12) {
+                        return header;
+                    }
+                    const offset_type length = static_cast<offset_type>(b[3] & 0x03) << 11 |
+                                               static_cast<offset_type>(b[4]) << 3 | b[5] >> 5;
+                    if (length < 7) {
+                        return header;
+                    }
+                    header.format = "aac";
+                    header.length = length;
+                    return header;
+                }
+                // version 0 is MPEG-2.5, 1 is reserved, 2 is MPEG-2, 3 is MPEG-1
+                const unsigned int version = (b[1] >> 3) & 0x03;
+                const unsigned int bitrateIndex = b[2] >> 4;
+                const unsigned int sampleRateIndex = (b[2] >> 2) & 0x03;
+                if (layer == 0 || version == 1 || bitrateIndex == 0 || bitrateIndex == 15 || sampleRateIndex == 3) {
+                    return header;
+                }
+                const bool mpeg1 = version == 3;
+                const unsigned int layerIndex = 3 - layer;
+                const offset_type bitrate =
+                        static_cast<offset_type>(MPEG_BITRATES[mpeg1 ? 0 : 1][layerIndex][bitrateIndex - 1]) * 1000;
+                const offset_type sampleRate = MPEG_SAMPLE_RATES[sampleRateIndex] >> (mpeg1 ? 0 : version == 2 ? 1 : 2);
+                const offset_type padding = (b[2] >> 1) & 0x01;
+                if (layerIndex == 0) {
+                    header.length = (12 * bitrate / sampleRate + padding) * 4;
+                } else if (layerIndex == 2 && !mpeg1) {
+                    header.length = 72 * bitrate / sampleRate + padding;
+                } else {
+                    header.length = 144 * bitrate / sampleRate + padding;
+                }
+                header.format = "mpeg";
+                return header;
+            }
+
+            // MPEG audio or ADTS AAC frame sync at or shortly after offset, confirmed by the next frame's header (or
+            // the end of the stream) following it
+            bool probeMPEG(TagLib::IOStream &stream, const offset_type start, ProbeResult &result) {
+                const ByteVector data = readAt(stream, start, static_cast<unsigned long>(MPEG_SYNC_SCAN));
+                const unsigned char *b = bytes(data);
+                for (unsigned int i = 0; i + 1 < data.size(); i++) {
+                    const FrameHeader header = parseFrameHeader(b + i, data.size() - i);
+                    if (!header.format) {
+                        continue;
+                    }
+                    const offset_type next = start + i + header.length;
+                    if (next > result.size) {
+                        continue;
+                    }
+                    if (next < result.size) {
+                        const offset_type inBuffer = i + header.length;
+                        FrameHeader following;
+                        if (inBuffer + 6 <= static_cast<offset_type>(data.size())) {
+                            following = parseFrameHeader(b + inBuffer, 6);
+                        } else {
+                            const ByteVector nextData = readAt(stream, next, 6);
+                            following = parseFrameHeader(bytes(nextData), nextData.size());
+                        }
+                        if (following.format != header.format) {
+                            continue;
+                        }
+                    }
+                    result.format = header.format;
+                    result.audioOffset = start + i;
+                    return true;
+                }
+                return false;
+            }
+        }
+
+        ProbeResult probeStream(TagLib::IOStream &stream) {
+            ProbeResult result;
+            result.size = stream.length();
+            const offset_type start = probeID3v2(stream, 0, result);
+            const ByteVector signature = readAt(stream, start, 12);
+
+            bool trailingTags = false;
+            if (matches(signature, 0, "fLaC")) {
+                trailingTags = probeFLAC(stream, start, result);
+            } else if (matches(signature, 0, "OggS")) {
+                probeOgg(stream, start, result.size, result);
+            } else if (matches(signature, 4, "ftyp")) {
+                probeMP4(stream, result.size, result);
+            } else if (matches(signature, 0, "RIFF") && matches(signature, 8, "WAVE")) {
+                probeChunks(stream, result.size, false, result);
+            } else if (matches(signature, 0, "FORM") && (matches(signature, 8, "AIFF") || matches(signature, 8, "AIFC"))) {
+                probeChunks(stream, result.size, true, result);
+            } else if (matches(signature, 0, "MAC ")) {
+                result.format = "ape";
+                result.audioOffset = start;
+                trailingTags = true;
+            } else if (matches(signature, 0, "wvpk")) {
+                result.format = "wavpack";
+                result.audioOffset = start;
+                trailingTags = true;
+            } else if (matches(signature, 0, "MPCK") || matches(signature, 0, "MP+")) {
+                result.format = "mpc";
+                result.audioOffset = start;
+                trailingTags = true;
+            } else {
+                trailingTags = probeMPEG(stream, start, result);
+            }
+
+            if (trailingTags) {
+                const offset_type end = probeTrailingTags(stream, result.size, result);
+                result.audioSize = std::max<offset_type>(0, end - result.audioOffset);
+            } else if (result.format && result.audioSize == 0) {
+                result.audioSize = std::max<offset_type>(0, result.size - result.audioOffset);
+            }
+
+            std::sort(result.tags.begin(), result.tags.end(), [](const ProbeTag &a, const ProbeTag &b) {
+                return a.offset < b.offset;
+            });
+            return result;
+        }
+
+        static Object probeResultToRuby(const ProbeResult &result) {
+            if (!result.format) {
+                return {Qnil};
+            }
+            Array tags;
+            for (const auto &tag: result.tags) {
+                Hash hash;
+                hash[Symbol("type")] = Symbol(tag.type);
+                hash[Symbol("offset")] = Object(LL2NUM(tag.offset));
+                hash[Symbol("size")] = Object(LL2NUM(tag.size));
+                hash.freeze();
+                tags.push(hash);
+            }
+            tags.freeze();
+
+            Hash hash;
+            hash[Symbol("format")] = Symbol(result.format);
+            hash[Symbol("size")] = Object(LL2NUM(result.size));
+            hash[Symbol("tags")] = tags;
+            hash[Symbol("audio_offset")] = Object(LL2NUM(result.audioOffset));
+            hash[Symbol("audio_size")] = Object(LL2NUM(result.audioSize));
+            hash.freeze();
+            return hash;
+        }
+
+        Object probe(Object fileOrStream) {
+            ProbeResult result;
+            if (IOStream::isIO(fileOrStream)) {
+                const offset_type position = NUM2LL(fileOrStream.call("tell").value());
+                try {
+                    IOStream stream(fileOrStream, IO_READ_AHEAD);
+                    result = probeStream(stream);
+                } catch (...) {
+                    // restore the position as ensure would, the original error is the one worth raising
+                    try {
+                        (void) fileOrStream.call("seek", position, SEEK_SET);
+                    } catch (...) {
+                    }
+                    throw;
+                }
+                (void) fileOrStream.call("seek", position, SEEK_SET);
+                return probeResultToRuby(result);
+            }
+
+            const std::string path = rubyPathToString(fileOrStream, "String, Pathname or IO");
+            bool opened = false;
+            withoutGVL([&]() {
+                TagLib::FileStream stream(path.c_str(), true);
+                if (stream.isOpen()) {
+                    opened = true;
+                    result = probeStream(stream);
+                }
+            });
+            return opened ? probeResultToRuby(result) : Object(Qnil);
+        }
+    }
+}
+
+void define_taglib_simple_probe(const Module &rb_mParent) {
+    Module(rb_mParent).define_module_function("probe", &TagLib::Simple::probe, Arg("file_or_stream"));
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "taglib_wrap.h"
+#include "IOStream.hpp"
+#include <taglib/tiostream.h>
+#include <rice/rice.hpp>
+#include <vector>
+
+using namespace Rice;
+
+// @!yard module TagLib
+namespace TagLib {
+ // @!yard module Simple
+ namespace Simple {
+
+  // A tag found by probeStream, type is a static string naming the tag format
+  struct ProbeTag {
+   const char *type;
+   offset_type offset;
+   offset_type size;
+  };
+
+  // Container and tag layout of a stream, format is nullptr if it was not recognised
+  struct ProbeResult {
+   const char *format = nullptr;
+   std::vector<ProbeTag> tags;
+   offset_type audioOffset = 0;
+   offset_type audioSize = 0;
+   offset_type size = 0;
+  };
+
+  // Find the container format and the byte ranges of tags and audio by reading headers, trailers and the
+  // container's structure (atoms, chunks, pages, blocks) only. Never parses tag contents.
+  // Must not touch Ruby objects unless the stream does.
+  ProbeResult probeStream(TagLib::IOStream &stream);
+
+  /** @!yard
+   # @!group Probing
+
+   # Identify the container format and the location of tags and audio without parsing any tags.
+   #
+   # Only headers and trailers are read (eg the ID3v2 header, MP4 atom headers, Ogg page headers, FLAC metadata block
+   # headers, the last 128 bytes for ID3v1), which is much cheaper than {FileRef#initialize}.
+   # MPEG and ADTS audio is only recognised where a valid frame header is followed by another at its frame length.
+   # For file names the GVL is released while the file is read. IO objects are returned to their original position,
+   # even if probing raises.
+   # @param [String|:to_path|IO] file_or_stream
+   # @return [Hash|nil] nil if the format was not recognised, otherwise a frozen Hash of
+   #   * :format [Symbol] :mpeg, :aac, :flac, :mp4, :ogg_vorbis, :ogg_opus, :ogg_flac, :ogg_speex, :ogg,
+   #     :wav, :aiff, :ape, :wavpack or :mpc
+   #   * :size [Integer] the size of the file in bytes
+   #   * :tags [Array<Hash>] with :type (:id3v2, :id3v1, :ape, :xiph_comment, :flac_picture, :mp4, :riff_info),
+   #     :offset and :size of each tag in file order
+   #   * :audio_offset, :audio_size [Integer] the byte range of the audio payload
+   def self.probe(file_or_stream); end
+
+   # @!endgroup
+   */
+  Object probe(Object fileOrStream);
+ }
+
+ //@!yard end # Simple
+}
+
+//@!yard end # TagLib
+void define_taglib_simple_probe(const Module &rb_mTagLibRuby);
@@ -0,0 +1,40 @@
+#include "Stats.hpp"
+
+using namespace Rice;
+
+namespace TagLib {
+    namespace Simple {
+
+        Hash stats() {
+            Hash result;
+#if !defined(TAGLIB_SIMPLE_DISABLE_STATS)
+            static const char *names[Stats::CounterCount] = {
+                "read_block_calls", "read_block_bytes",
+                "ruby_read_calls", "ruby_write_calls", "ruby_seek_calls", "ruby_tell_calls",
+                "rewrite_bytes",
+                "parse_ns", "convert_ns", "save_ns",
+                "cache_hits", "cache_misses",
+                "prefetch_misses", "truncated_values"
+            };
+            for (unsigned i = 0; i < Stats::CounterCount; i++) {
+                result[Symbol(names[i])] = Object(ULL2NUM(Stats::counters[i].load(std::memory_order_relaxed)));
+            }
+#endif
+            return result;
+        }
+
+        void resetStats() {
+#if !defined(TAGLIB_SIMPLE_DISABLE_STATS)
+            for (auto &counter: Stats::counters) {
+                counter.store(0, std::memory_order_relaxed);
+            }
+#endif
+        }
+    }
+}
+
+void define_taglib_simple_stats(const Module &rb_mParent) {
+    Module(rb_mParent)
+            .define_module_function("stats", &TagLib::Simple::stats)
+            .define_module_function("reset_stats", &TagLib::Simple::resetStats);
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <rice/rice.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+using namespace Rice;
+
+// @!yard module TagLib
+namespace TagLib {
+ // @!yard module Simple
+ namespace Simple {
+
+  // Process wide hot path counters, relaxed atomics so they are safe (and cheap) from worker threads.
+  // Compiled out entirely with -DTAGLIB_SIMPLE_DISABLE_STATS (extconf --disable-stats)
+  namespace Stats {
+   enum Counter : unsigned {
+    ReadBlockCalls,
+    ReadBlockBytes,
+    RubyReadCalls,
+    RubyWriteCalls,
+    RubySeekCalls,
+    RubyTellCalls,
+    RewriteBytes,
+    ParseNanos,
+    ConvertNanos,
+    SaveNanos,
+    CacheHits,
+    CacheMisses,
+    PrefetchMisses,
+    TruncatedValues,
+    CounterCount
+   };
+
+#if defined(TAGLIB_SIMPLE_DISABLE_STATS)
+   constexpr bool enabled = false;
+
+   inline void add(Counter, uint64_t = 1) {}
+
+   class Timer {
+   public:
+    explicit Timer(Counter) {}
+   };
+#else
+   constexpr bool enabled = true;
+
+   inline std::atomic<uint64_t> counters[CounterCount];
+
+   inline void add(const Counter counter, const uint64_t amount = 1) {
+    counters[counter].fetch_add(amount, std::memory_order_relaxed);
+   }
+
+   // Adds the nanoseconds elapsed over its lifetime to a counter
+   class Timer {
+   public:
+    explicit Timer(const Counter counter) : counter(counter), start(std::chrono::steady_clock::now()) {}
+
+    ~Timer() {
+     add(counter, std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - start).count());
+    }
+
+    Timer(const Timer &) = delete;
+    Timer &operator=(const Timer &) = delete;
+
+   private:
+    Counter counter;
+    std::chrono::steady_clock::time_point start;
+   };
+#endif
+  }
+
+  /** @!yard
+   # @!group Instrumentation
+
+   # Snapshot of the extension's hot path counters since load (or {reset_stats}).
+   #
+   # * :read_block_calls, :read_block_bytes - reads from IO and mmap streams (TagLib's own file stream is not counted)
+   # * :ruby_read_calls, :ruby_write_calls, :ruby_seek_calls, :ruby_tell_calls - method calls on Ruby IO objects
+   # * :rewrite_bytes - bytes moved by stream insert/remove when a tag changes size, or written by atomic saves
+   # * :parse_ns - time opening and parsing files in TagLib
+   # * :convert_ns - time converting tags and properties to Ruby objects
+   # * :save_ns - time saving files in TagLib
+   # * :cache_hits, :cache_misses - lookups in a {Cache}
+   # * :prefetch_misses - reads from IO objects that fell outside the windows given with {FileRef#initialize} prefetch:
+   # * :truncated_values - values cut short or dropped by {FileRef#initialize} max_value_size: or max_total_size:
+   #
+   # Counters are process wide and include work on other threads.
+   # @return [Hash<Symbol,Integer>] empty if the extension was built with --disable-stats
+   def self.stats; end
+
+   # Reset all counters to zero
+   # @return [void]
+   def self.reset_stats; end
+
+   # @!endgroup
+   */
+  Hash stats();
+
+  void resetStats();
+ }
+
+ //@!yard end # Simple
+}
+
+//@!yard end # TagLib
+void define_taglib_simple_stats(const Module &rb_mTagLibRuby);
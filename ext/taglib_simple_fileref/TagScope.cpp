@@ -0,0 +1,137 @@
+#include "TagScope.hpp"
+#include <taglib/apefile.h>
+#include <taglib/apetag.h>
+#include <taglib/asftag.h>
+#include <taglib/flacfile.h>
+#include <taglib/id3v1tag.h>
+#include <taglib/id3v2tag.h>
+#include <taglib/infotag.h>
+#include <taglib/mp4tag.h>
+#include <taglib/mpcfile.h>
+#include <taglib/mpegfile.h>
+#include <taglib/trueaudiofile.h>
+#include <taglib/wavfile.h>
+#include <taglib/wavpackfile.h>
+#include <taglib/xiphcomment.h>
+#include <algorithm>
+#include <string>
+
+using namespace Rice;
+
+namespace TagLib {
+    namespace Simple {
+
+        std::vector<TagFamily> rubyObjectToTagFamilies(const Object &tags) {
+            static const std::pair<const char *, TagFamily> names[] = {
+                {"id3v1", TagFamily::ID3v1}, {"id3v2", TagFamily::ID3v2}, {"ape", TagFamily::APE},
+                {"xiph", TagFamily::Xiph}, {"mp4", TagFamily::MP4}, {"asf", TagFamily::ASF}, {"info", TagFamily::Info}
+            };
+            std::vector<TagFamily> result;
+            for (const auto &item: Array(tags)) {
+                const Object value(item.value());
+                if (!value.is_a(rb_cSymbol)) {
+                    throw Exception(rb_eArgError, "Unknown tag family: %s", value.inspect().c_str());
+                }
+                const std::string name = Symbol(value).str();
+                const auto found = std::find_if(std::begin(names), std::end(names),
+                                                [&name](const auto &entry) { return name == entry.first; });
+                if (found == std::end(names)) {
+                    throw Exception(rb_eArgError, "Unknown tag family: %s", value.inspect().c_str());
+                }
+                result.push_back(found->second);
+            }
+            return result;
+        }
+
+        // The family's tag in a file that can hold more than one family, nullptr if not present.
+        // Files that hold a single family are matched on the type of their tag.
+        static TagLib::Tag *familyTag(TagLib::File *file, const TagFamily family) {
+            if (auto *mpeg = dynamic_cast<TagLib::MPEG::File *>(file)) {
+                switch (family) {
+                    case TagFamily::ID3v1: return mpeg->ID3v1Tag();
+                    case TagFamily::ID3v2: return mpeg->ID3v2Tag();
+                    case TagFamily::APE: return mpeg->APETag();
+                    default: return nullptr;
+                }
+            }
+            if (auto *flac = dynamic_cast<TagLib::FLAC::File *>(file)) {
+                switch (family) {
+                    case TagFamily::Xiph: return flac->xiphComment();
+                    case TagFamily::ID3v1: return flac->ID3v1Tag();
+                    case TagFamily::ID3v2: return flac->ID3v2Tag();
+                    default: return nullptr;
+                }
+            }
+            if (auto *wav = dynamic_cast<TagLib::RIFF::WAV::File *>(file)) {
+                switch (family) {
+                    case TagFamily::ID3v2: return wav->ID3v2Tag();
+                    case TagFamily::Info: return wav->InfoTag();
+                    default: return nullptr;
+                }
+            }
+            if (auto *ape = dynamic_cast<TagLib::APE::File *>(file)) {
+                switch (family) {
+                    case TagFamily::APE: return ape->APETag();
+                    case TagFamily::ID3v1: return ape->ID3v1Tag();
+                    default: return nullptr;
+                }
+            }
+            if (auto *wavPack = dynamic_cast<TagLib::WavPack::File *>(file)) {
+                switch (family) {
+                    case TagFamily::APE: return wavPack->APETag();
+                    case TagFamily::ID3v1: return wavPack->ID3v1Tag();
+                    default: return nullptr;
+                }
+            }
+            if (auto *mpc = dynamic_cast<TagLib::MPC::File *>(file)) {
+                switch (family) {
+                    case TagFamily::APE: return mpc->APETag();
+                    case TagFamily::ID3v1: return mpc->ID3v1Tag();
+                    default: return nullptr;
+                }
+            }
+            if (auto *trueAudio = dynamic_cast<TagLib::TrueAudio::File *>(file)) {
+                switch (family) {
+                    case TagFamily::ID3v2: return trueAudio->ID3v2Tag();
+                    case TagFamily::ID3v1: return trueAudio->ID3v1Tag();
+                    default: return nullptr;
+                }
+            }
+
+            TagLib::Tag *tag = file->tag();
+            switch (family) {
+                case TagFamily::ID3v1: return dynamic_cast<TagLib::ID3v1::Tag *>(tag);
+                case TagFamily::ID3v2: return dynamic_cast<TagLib::ID3v2::Tag *>(tag);
+                case TagFamily::APE: return dynamic_cast<TagLib::APE::Tag *>(tag);
+                case TagFamily::Xiph: return dynamic_cast<TagLib::Ogg::XiphComment *>(tag);
+                case TagFamily::MP4: return dynamic_cast<TagLib::MP4::Tag *>(tag);
+                case TagFamily::ASF: return dynamic_cast<TagLib::ASF::Tag *>(tag);
+                case TagFamily::Info: return dynamic_cast<TagLib::RIFF::Info::Tag *>(tag);
+            }
+            return nullptr;
+        }
+
+        std::vector<TagLib::Tag *> scopedTags(TagLib::File *file, const std::vector<TagFamily> &families) {
+            std::vector<TagLib::Tag *> result;
+            for (const TagFamily family: families) {
+                TagLib::Tag *tag = familyTag(file, family);
+                if (tag && std::find(result.begin(), result.end(), tag) == result.end()) {
+                    result.push_back(tag);
+                }
+            }
+            return result;
+        }
+
+        TagLib::PropertyMap scopedProperties(const std::vector<TagLib::Tag *> &tags) {
+            TagLib::PropertyMap result;
+            for (const TagLib::Tag *tag: tags) {
+                for (const auto &property: tag->properties()) {
+                    if (!result.contains(property.first)) {
+                        result.insert(property.first, property.second);
+                    }
+                }
+            }
+            return result;
+        }
+    }
+}
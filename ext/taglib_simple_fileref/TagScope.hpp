@@ -0,0 +1,29 @@
+#pragma once
+
+#include "taglib_wrap.h"
+#include <taglib/tfile.h>
+#include <taglib/tag.h>
+#include <taglib/tpropertymap.h>
+#include <rice/rice.hpp>
+#include <vector>
+
+using namespace Rice;
+
+namespace TagLib {
+    namespace Simple {
+
+        // The families of tag a file may hold, several of which can be present in one file (eg ID3v1, ID3v2 and APE
+        // in an MP3)
+        enum class TagFamily { ID3v1, ID3v2, APE, Xiph, MP4, ASF, Info };
+
+        // Tag families in order of preference from an Array of Symbols (:id3v1, :id3v2, :ape, :xiph, :mp4, :asf, :info)
+        // raises ArgumentError for anything else
+        std::vector<TagFamily> rubyObjectToTagFamilies(const Object &tags);
+
+        // The tags of the requested families present in file, in the order requested
+        std::vector<TagLib::Tag *> scopedTags(TagLib::File *file, const std::vector<TagFamily> &families);
+
+        // Properties of the tags, where a key is in more than one tag the first wins
+        TagLib::PropertyMap scopedProperties(const std::vector<TagLib::Tag *> &tags);
+    }
+}
@@ -0,0 +1,326 @@
+#include "Walker.hpp"
+#include "Batch.hpp"
+#include "without_gvl.h"
+#include <taglib/fileref.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <limits>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+using namespace Rice;
+
+namespace TagLib {
+    namespace Simple {
+        namespace {
+            // results handed to Ruby per wait
+            constexpr size_t BATCH_SIZE = 64;
+            // paths queued ahead of each worker
+            constexpr size_t PATHS_PER_WORKER = 64;
+
+            // A blocking queue holding at most capacity items
+            template<typename T>
+            class BoundedQueue {
+                std::mutex mutex;
+                std::condition_variable notEmpty;
+                std::condition_variable notFull;
+                std::deque<T> items;
+                const size_t capacity;
+                bool closed = false;
+                bool woken = false;
+
+            public:
+                explicit BoundedQueue(const size_t capacity) : capacity(capacity) {}
+
+                // false if the queue was closed before there was room
+                bool push(T item) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    notFull.wait(lock, [this]() { return closed || items.size() < capacity; });
+                    if (closed) {
+                        return false;
+                    }
+                    items.push_back(std::move(item));
+                    notEmpty.notify_one();
+                    return true;
+                }
+
+                // false once the queue is closed and empty
+                bool pop(T &item) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    notEmpty.wait(lock, [this]() { return closed || !items.empty(); });
+                    if (items.empty()) {
+                        return false;
+                    }
+                    item = std::move(items.front());
+                    items.pop_front();
+                    notFull.notify_one();
+                    return true;
+                }
+
+                // Wait for an item (or close or wake) then take up to max items, false once closed and empty
+                bool popBatch(std::vector<T> &batch, const size_t max) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    notEmpty.wait(lock, [this]() { return closed || woken || !items.empty(); });
+                    woken = false;
+                    while (!items.empty() && batch.size() < max) {
+                        batch.push_back(std::move(items.front()));
+                        items.pop_front();
+                    }
+                    notFull.notify_all();
+                    return !batch.empty() || !closed;
+                }
+
+                // Discard waiting pushes, pops drain what is left
+                void close() {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    closed = true;
+                    notEmpty.notify_all();
+                    notFull.notify_all();
+                }
+
+                // Return a waiting popBatch empty handed
+                void wake() {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    woken = true;
+                    notEmpty.notify_all();
+                }
+            };
+
+            struct WalkEntry {
+                std::string path;
+                ScanResult result;
+            };
+
+            // walk -> paths -> workers (open, parse) -> results -> Ruby
+            // Only the Ruby thread touches Ruby objects, the walker and worker threads are joined on destruction.
+            class Walker {
+                const std::filesystem::path root;
+                const std::unordered_set<std::string> extensions;
+                const bool readAudioProperties;
+                const TagLib::AudioProperties::ReadStyle style;
+                BoundedQueue<std::string> paths;
+                BoundedQueue<WalkEntry> results;
+                std::atomic<bool> cancelled{false};
+                std::atomic<unsigned> running;
+                std::exception_ptr error;
+                std::mutex errorMutex;
+                std::vector<std::thread> threads;
+
+            public:
+                Walker(std::filesystem::path root, std::unordered_set<std::string> extensions,
+                       const bool readAudioProperties, const TagLib::AudioProperties::ReadStyle style,
+                       const unsigned workers) :
+                    root(std::move(root)), extensions(std::move(extensions)), readAudioProperties(readAudioProperties),
+                    style(style), paths(workers * PATHS_PER_WORKER), results(BATCH_SIZE * 2), running(workers) {
+                    try {
+                        threads.emplace_back([this]() { walk(); });
+                        for (unsigned i = 0; i < workers; i++) {
+                            threads.emplace_back([this]() { work(); });
+                        }
+                    } catch (...) {
+                        finish();
+                        throw;
+                    }
+                }
+
+                ~Walker() {
+                    finish();
+                }
+
+                Walker(const Walker &) = delete;
+                Walker &operator=(const Walker &) = delete;
+
+                // Wait for the next results, false once there are no more
+                bool next(std::vector<WalkEntry> &batch) {
+                    return results.popBatch(batch, BATCH_SIZE);
+                }
+
+                // Unblock function for next
+                static void wake(void *walker) {
+                    static_cast<Walker *>(walker)->results.wake();
+                }
+
+                // Rethrow the first error from the walker or worker threads
+                void raiseError() {
+                    finish();
+                    if (error) {
+                        std::rethrow_exception(error);
+                    }
+                }
+
+            private:
+                void cancel() {
+                    cancelled = true;
+                    paths.close();
+                    results.close();
+                }
+
+                void finish() {
+                    cancel();
+                    for (auto &thread: threads) {
+                        if (thread.joinable()) {
+                            thread.join();
+                        }
+                    }
+                }
+
+                void fail() {
+                    {
+                        std::lock_guard<std::mutex> lock(errorMutex);
+                        if (!error) {
+                            error = std::current_exception();
+                        }
+                    }
+                    cancel();
+                }
+
+                bool matches(const std::filesystem::path &path) const {
+                    std::string extension = path.extension().string();
+                    if (extension.size() < 2) {
+                        return false;
+                    }
+                    extension.erase(0, 1);
+                    std::transform(extension.begin(), extension.end(), extension.begin(),
+                                   [](const unsigned char c) { return static_cast<char>(std::tolower(c)); });
+                    return extensions.count(extension) > 0;
+                }
+
+                // Depth first over an explicit stack of directories rather than recursive_directory_iterator, which
+                // ends the whole walk on the first error. A directory that cannot be opened or read (eg removed or
+                // replaced while walking) is skipped, only failing to open the root is an error.
+                void walk() {
+                    try {
+                        using std::filesystem::directory_options;
+                        std::vector<std::filesystem::path> directories{root};
+                        while (!directories.empty() && !cancelled.load(std::memory_order_relaxed)) {
+                            const std::filesystem::path directory = std::move(directories.back());
+                            directories.pop_back();
+                            std::error_code ec;
+                            std::filesystem::directory_iterator it(directory, directory_options::skip_permission_denied, ec);
+                            if (ec && directory == root) {
+                                throw std::system_error(ec, root.string());
+                            }
+                            for (; !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+                                if (cancelled.load(std::memory_order_relaxed)) {
+                                    break;
+                                }
+                                // the directory entry mostly knows its type already, so these are only a stat when
+                                // it does not. Symbolic links to directories are not followed
+                                std::error_code typeError;
+                                if (it->is_directory(typeError) && !it->is_symlink(typeError)) {
+                                    directories.push_back(it->path());
+                                } else if (it->is_regular_file(typeError) && matches(it->path()) &&
+                                           !paths.push(it->path().string())) {
+                                    directories.clear();
+                                    break;
+                                }
+                            }
+                        }
+                    } catch (...) {
+                        fail();
+                    }
+                    paths.close();
+                }
+
+                void work() {
+                    try {
+                        std::string path;
+                        while (!cancelled.load(std::memory_order_relaxed) && paths.pop(path)) {
+                            WalkEntry entry{path, scanFile(path, readAudioProperties, style)};
+                            if (entry.result.valid && !results.push(std::move(entry))) {
+                                break;
+                            }
+                        }
+                    } catch (...) {
+                        fail();
+                    }
+                    // the last worker out closes the results
+                    if (running.fetch_sub(1) == 1) {
+                        results.close();
+                    }
+                }
+            };
+
+            std::unordered_set<std::string> rubyObjectToExtensions(const Object &extensions) {
+                std::unordered_set<std::string> result;
+                auto add = [&result](std::string extension) {
+                    if (!extension.empty() && extension[0] == '.') {
+                        extension.erase(0, 1);
+                    }
+                    std::transform(extension.begin(), extension.end(), extension.begin(),
+                                   [](const unsigned char c) { return static_cast<char>(std::tolower(c)); });
+                    result.insert(extension);
+                };
+                if (extensions.is_nil()) {
+                    for (const auto &extension: TagLib::FileRef::defaultFileExtensions()) {
+                        add(extension.to8Bit(true));
+                    }
+                } else {
+                    for (const auto &extension: Array(extensions)) {
+                        add(Rice::String(extension.value()).str());
+                    }
+                }
+                return result;
+            }
+        }
+
+        Object eachFile(Object root, Object options) {
+            if (!rb_block_given_p()) {
+                return Module("TagLib").const_get("Simple").call("enum_for", Symbol("each_file"), root, options);
+            }
+
+            const std::string rootPath = rubyPathToString(root);
+            std::error_code ec;
+            const std::filesystem::file_status status = std::filesystem::status(rootPath, ec);
+            if (ec) {
+                throw Exception(rb_syserr_new(ec.value(), rootPath.c_str()));
+            }
+            if (!std::filesystem::is_directory(status)) {
+                throw Exception(rb_syserr_new(ENOTDIR, rootPath.c_str()));
+            }
+
+            const unsigned threads = rubyOptionToThreads(options);
+            const Object readAudioProperties = rubyOption(options, "audio_properties");
+            const TagLib::AudioProperties::ReadStyle style = rubyObjectToTagLibAudioPropertiesReadStyle(readAudioProperties);
+
+            const ConversionLimits limits = rubyOptionsToConversionLimits(options);
+
+            Walker walker(rootPath, rubyObjectToExtensions(rubyOption(options, "extensions")),
+                          readAudioProperties.test(), style,
+                          workerCount(threads, std::numeric_limits<size_t>::max()));
+
+            // a raise or break from the block unwinds as a C++ exception, the walker joins its threads on the way out
+            std::vector<WalkEntry> batch;
+            batch.reserve(BATCH_SIZE);
+            bool more = true;
+            while (more) {
+                batch.clear();
+                withoutGVL([&]() { more = walker.next(batch); }, &Walker::wake, &walker);
+                // raise Interrupt etc... if that is why we were woken
+                detail::protect(rb_thread_check_ints);
+                for (const WalkEntry &entry: batch) {
+                    detail::protect(rb_yield, scanResultToRuby(entry.path, entry.result, limits).value());
+                }
+            }
+
+            try {
+                walker.raiseError();
+            } catch (const std::system_error &e) {
+                throw Exception(systemErrorToRuby(e));
+            }
+            return {Qnil};
+        }
+    }
+}
+
+void define_taglib_simple_walker(const Module &rb_mParent) {
+    Module(rb_mParent)
+            .define_module_function("each_file", &TagLib::Simple::eachFile, Arg("root"), Arg("options") = Qnil);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <rice/rice.hpp>
+
+using namespace Rice;
+
+// @!yard module TagLib
+namespace TagLib {
+ // @!yard module Simple
+ namespace Simple {
+
+  /** @!yard
+   # @!group Batch Processing
+
+   # Walk a directory tree reading tags from every file with a supported extension.
+   #
+   # A native thread walks the tree while worker threads open and parse the files it finds, all with the GVL
+   # released. Results are handed back through a bounded queue and yielded in batches, so memory use does not depend
+   # on the number of files. Files TagLib cannot read are skipped. Results are yielded in no particular order.
+   #
+   # Symbolic links to directories are not followed. Directories that cannot be read, including those removed or
+   # replaced during the walk, are skipped; only failing to read the root directory raises an error.
+   # @param [String|:to_path] root directory to walk
+   # @param [Array<String>|nil] extensions file extensions to read (case insensitive, with or without a leading '.'),
+   #   default is every extension TagLib supports
+   # @param [Integer] threads number of worker threads, 0 to use one per processor. Negative values raise ArgumentError
+   # @param [Symbol<:average,:fast, :accurate>|nil] audio_properties
+   #   :fast, :accurate, :average indicator for reading audio properties. nil/false to skip
+   # @param [Integer|nil] max_value_size as per {Simple.scan}
+   # @param [Integer|nil] max_total_size as per {Simple.scan}
+   # @param [Symbol<:raise,:truncate>] oversize as per {Simple.scan}
+   # @yieldparam [Hash] entry as per an entry of {Simple.scan}
+   # @return [nil]
+   # @return [Enumerator] if no block is given
+   # @raise [SystemCallError] if root is not a directory, or walking the tree fails
+   def self.each_file(root, extensions: nil, threads: 0, audio_properties: nil, max_value_size: nil, max_total_size: nil, oversize: :raise); end
+
+   # @!endgroup
+   */
+  Object eachFile(Object root, Object options);
+ }
+
+ //@!yard end # Simple
+}
+
+//@!yard end # TagLib
+void define_taglib_simple_walker(const Module &rb_mTagLibRuby);
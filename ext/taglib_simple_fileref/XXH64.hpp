@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace TagLib {
+    namespace Simple {
+
+        // Streaming XXH64 (https://github.com/Cyan4973/xxHash) - a fast non-cryptographic 64 bit hash
+        class XXH64 {
+            static constexpr uint64_t PRIME1 = 11400714785074694791ULL;
+            static constexpr uint64_t PRIME2 = 14029467366897019727ULL;
+            static constexpr uint64_t PRIME3 = 1609587929392839161ULL;
+            static constexpr uint64_t PRIME4 = 9650029242287828579ULL;
+            static constexpr uint64_t PRIME5 = 2870177450012600261ULL;
+
+            uint64_t seed;
+            uint64_t total = 0;
+            uint64_t v[4];
+            unsigned char buffer[32];
+            size_t buffered = 0;
+
+            static uint64_t rotl(const uint64_t x, const int r) {
+                return (x << r) | (x >> (64 - r));
+            }
+
+            static uint64_t read64(const unsigned char *p) {
+                uint64_t value = 0;
+                for (int i = 7; i >= 0; i--) {
+                    value = (value << 8) | p[i];
+                }
+                return value;
+            }
+
+            static uint32_t read32(const unsigned char *p) {
+                return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+                       static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24;
+            }
+
+            static uint64_t round(uint64_t acc, const uint64_t input) {
+                acc += input * PRIME2;
+                acc = rotl(acc, 31);
+                return acc * PRIME1;
+            }
+
+            static uint64_t mergeRound(uint64_t acc, const uint64_t value) {
+                acc ^= round(0, value);
+                return acc * PRIME1 + PRIME4;
+            }
+
+            void consume(const unsigned char *p) {
+                for (int i = 0; i < 4; i++) {
+                    v[i] = round(v[i], read64(p + i * 8));
+                }
+            }
+
+        public:
+            explicit XXH64(const uint64_t seed = 0) : seed(seed),
+                                                      v{seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1} {}
+
+            void update(const char *data, size_t length) {
+                auto p = reinterpret_cast<const unsigned char *>(data);
+                total += length;
+                if (buffered + length < 32) {
+                    std::memcpy(buffer + buffered, p, length);
+                    buffered += length;
+                    return;
+                }
+                if (buffered > 0) {
+                    const size_t fill = 32 - buffered;
+                    std::memcpy(buffer + buffered, p, fill);
+                    consume(buffer);
+                    p += fill;
+                    length -= fill;
+                    buffered = 0;
+                }
+                for (; length >= 32; p += 32, length -= 32) {
+                    consume(p);
+                }
+                std::memcpy(buffer, p, length);
+                buffered = length;
+            }
+
+            uint64_t digest() const {
+                uint64_t h;
+                if (total >= 32) {
+                    h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+                    for (const uint64_t lane: v) {
+                        h = mergeRound(h, lane);
+                    }
+                } else {
+                    h = seed + PRIME5;
+                }
+                h += total;
+
+                const unsigned char *p = buffer;
+                size_t remaining = buffered;
+                for (; remaining >= 8; p += 8, remaining -= 8) {
+                    h ^= round(0, read64(p));
+                    h = rotl(h, 27) * PRIME1 + PRIME4;
+                }
+                if (remaining >= 4) {
+                    h ^= static_cast<uint64_t>(read32(p)) * PRIME1;
+                    h = rotl(h, 23) * PRIME2 + PRIME3;
+                    p += 4;
+                    remaining -= 4;
+                }
+                for (; remaining > 0; p++, remaining--) {
+                    h ^= *p * PRIME5;
+                    h = rotl(h, 11) * PRIME1;
+                }
+
+                h ^= h >> 33;
+                h *= PRIME2;
+                h ^= h >> 29;
+                h *= PRIME3;
+                h ^= h >> 32;
+                return h;
+            }
+        };
+    }
+}
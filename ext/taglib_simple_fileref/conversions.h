@@ -5,33 +5,151 @@
 #include <rice/rice.hpp>
 #include <ruby/encoding.h>
 #include <taglib/audioproperties.h>
+#include <taglib/tag.h>
 #include <taglib/tstringlist.h>
 #if (TAGLIB_MAJOR_VERSION >=2)
 #include <taglib/tvariant.h>
 #endif
 
 #include <taglib/tpropertymap.h>
+#include <string>
+#include <string_view>
 
 using namespace Rice;
 
 namespace TagLib {
    namespace Simple {
+      // Native copy of the TagLib::Tag values, can be held after the file is closed and built without the GVL
+      struct TagValues {
+         TagLib::String title;
+         TagLib::String artist;
+         TagLib::String album;
+         TagLib::String genre;
+         unsigned int year = 0;
+         unsigned int track = 0;
+         TagLib::String comment;
+
+         TagValues() = default;
+         explicit TagValues(const TagLib::Tag& tag);
+      };
+
+      // Native copy of the TagLib::AudioProperties values
+      struct AudioPropertyValues {
+         int lengthInMilliseconds = 0;
+         int bitrate = 0;
+         int sampleRate = 0;
+         int channels = 0;
+
+         AudioPropertyValues() = default;
+         explicit AudioPropertyValues(const TagLib::AudioProperties& props);
+      };
+
+      // Per-thread scratch buffers for conversion temporaries. They are reused by every conversion on the thread, so
+      // once grown to the largest value seen converting allocates only the final objects. Contents are valid until
+      // the next conversion on the same thread. Buffers grown past SCRATCH_RETAIN_LIMIT are released when next used
+      // for something smaller.
+      constexpr size_t SCRATCH_RETAIN_LIMIT = 1024 * 1024;
+
+      template<typename String_T>
+      String_T& scratchBuffer(String_T& buffer, const size_t size) {
+         if (buffer.capacity() * sizeof(typename String_T::value_type) > SCRATCH_RETAIN_LIMIT &&
+             size * sizeof(typename String_T::value_type) <= SCRATCH_RETAIN_LIMIT) {
+            String_T().swap(buffer);
+         }
+         buffer.clear();
+         buffer.reserve(size);
+         return buffer;
+      }
+
+      // bytes, eg UTF-8 encoded text
+      inline std::string& scratchBytes(const size_t size) {
+         thread_local std::string buffer;
+         return scratchBuffer(buffer, size);
+      }
+
+      // UTF-16 code units, as held by TagLib::String
+      inline std::wstring& scratchUnits(const size_t size) {
+         thread_local std::wstring buffer;
+         return scratchBuffer(buffer, size);
+      }
+
+      // Bounds on the String and binary bytes a single conversion to Ruby may allocate, 0 for no bound
+      struct ConversionLimits {
+         size_t maxValueSize = 0;
+         size_t maxTotalSize = 0;
+         // cut values that do not fit rather than raise TagLib::Error
+         bool truncate = false;
+      };
+
+      // threads: option for batch functions, 0 (one per processor) if not given. Raises ArgumentError if negative
+      unsigned rubyOptionToThreads(const Rice::Object& options);
+
+      // max_value_size:, max_total_size: and oversize: (:raise or :truncate) options
+      ConversionLimits rubyOptionsToConversionLimits(const Rice::Object& options);
+
+      // The bytes used so far by one conversion
+      class ConversionBudget {
+         const ConversionLimits limits;
+         size_t used = 0;
+
+         size_t allowance(size_t length, bool name) const;
+         [[noreturn]] void raiseOversize(size_t length, bool name) const;
+
+      public:
+         explicit ConversionBudget(const ConversionLimits& limits) : limits(limits) {}
+
+         // How many of a value's length bytes may be converted. Raises TagLib::Error if that is fewer, unless
+         // truncating.
+         size_t take(size_t length);
+
+         // Whether a value that cannot be cut, binary data or (with name) a property name, fits whole. Names only
+         // count towards maxTotalSize. Raises TagLib::Error if it does not fit, unless truncating when the value
+         // is to be dropped.
+         bool takeWhole(size_t length, bool name = false);
+
+         // Whether length bytes of a value would be converted without truncating, takes nothing
+         bool fits(const size_t length) const { return allowance(length, false) == length; }
+      };
+
+      // Classes defined by lib/taglib_simple in the TagLib module
+      enum class TagLibClass { Error, RewriteRequired, AudioTag, AudioProperties };
+
+      // Looked up once, then held as a GC root so it is marked, and pinned, through compaction
+      VALUE tagLibClass(TagLibClass klass);
+
+      // Look up each class that is already defined, so later calls (and forked children) skip the constant lookup
+      void resolveTagLibClasses();
+
       // taglib to ruby
-      Rice::Object tagLibStringToNonEmptyRubyUTF8String(TagLib::String string);
+      Rice::Object tagValuesToRubyAudioTag(const TagValues& tag, ConversionBudget* budget = nullptr);
+      Rice::Object audioPropertyValuesToRuby(const AudioPropertyValues& props);
+      Rice::Object tagLibStringToNonEmptyRubyUTF8String(const TagLib::String& string,
+                                                         ConversionBudget* budget = nullptr);
       Rice::Object uintToNonZeroRubyInteger(unsigned integer);
-      Rice::Hash tagLibPropertyMapToRubyHash(const TagLib::PropertyMap& properties);
-      Array tagLibStringListToRuby(const TagLib::StringList& list);
-      Rice::String tagLibStringToRubyUTF8String(const TagLib::String& str);
+      Rice::Hash tagLibPropertyMapToRubyHash(const TagLib::PropertyMap& properties, ConversionBudget* budget = nullptr);
+      Array tagLibStringListToRuby(const TagLib::StringList& list, ConversionBudget* budget = nullptr);
+      Rice::String tagLibStringToRubyUTF8String(const TagLib::String& str, ConversionBudget* budget = nullptr);
+      Rice::String tagLibStringToInternedRubyUTF8String(const TagLib::String& str);
+      // Interned as above, a property name taken whole from budget. nil if it is to be dropped
+      Rice::Object tagLibNameToRuby(const TagLib::String& name, ConversionBudget* budget);
+      // UTF-8 in the thread's scratch bytes
+      std::string_view tagLibStringToUTF8(const TagLib::String& str);
 
       // ruby to taglib
+      Rice::Object rubyOption(const Rice::Object& options, const char* name);
       TagLib::String rubyStringOrNilToTagLibString(Object value);
       unsigned int rubyIntegerOrNilToUInt(Object value);
       TagLib::String rubyStringToTagLibString(const Rice::String& str);
+      // decoded through the thread's scratch units, invalid sequences become U+FFFD
+      TagLib::String utf8ToTagLibString(const char* data, size_t length);
       TagLib::AudioProperties::ReadStyle rubyObjectToTagLibAudioPropertiesReadStyle(const Rice::Object& readStyle);
       TagLib::StringList rubyObjectToTagLibStringList(const Rice::Object& obj);
+      // String or :to_path, otherwise TypeError naming the expected types
+      std::string rubyPathToString(Rice::Object path, const char* expected = "String or Pathname");
 
 #if (TAGLIB_MAJOR_VERSION >= 2)
-      Rice::Array tagLibComplexPropertyToRuby(const TagLib::List<TagLib::VariantMap>& list);
+      Rice::Array tagLibComplexPropertyToRuby(const TagLib::List<TagLib::VariantMap>& list, bool includeData = true,
+                                              ConversionBudget* budget = nullptr);
       TagLib::List<TagLib::VariantMap> rubyObjectToTagLibComplexProperty(const Rice::Object& obj);
 #endif
    }
@@ -1,4 +1,5 @@
 #include "conversions.h"
+#include <cstdint>
 
 using namespace Rice;
 
@@ -22,6 +23,47 @@ namespace TagLib {
         throw Rice::Exception(rb_eArgError, "Invalid read style: %s", readStyleSym.str());
     }
 
+    // Lookup a Symbol keyed option from an optional Hash (eg trailing keyword arguments), nil if not set
+    Object rubyOption(const Object& options, const char* name) {
+      if (!options.test()) {
+        return {Qnil};
+      }
+      if (!options.is_a(rb_cHash)) {
+        throw Rice::Exception(rb_eTypeError, "expected options Hash, got %s", options.class_name().c_str());
+      }
+      return { rb_hash_lookup2(options.value(), ID2SYM(rb_intern(name)), Qnil) };
+    }
+
+    unsigned rubyOptionToThreads(const Object& options) {
+      const Object threads = rubyOption(options, "threads");
+      if (threads.is_nil()) {
+        return 0;
+      }
+      const int count = NUM2INT(threads.value());
+      if (count < 0) {
+        throw Rice::Exception(rb_eArgError, "threads: must not be negative, got %d", count);
+      }
+      return static_cast<unsigned>(count);
+    }
+
+    ConversionLimits rubyOptionsToConversionLimits(const Object& options) {
+      ConversionLimits limits;
+      const Object maxValueSize = rubyOption(options, "max_value_size");
+      limits.maxValueSize = maxValueSize.is_nil() ? 0 : NUM2ULONG(maxValueSize.value());
+      const Object maxTotalSize = rubyOption(options, "max_total_size");
+      limits.maxTotalSize = maxTotalSize.is_nil() ? 0 : NUM2ULONG(maxTotalSize.value());
+      const Object oversize = rubyOption(options, "oversize");
+      if (!oversize.is_nil()) {
+        const std::string oversizeStr = Symbol(oversize).str();
+        if (oversizeStr == "truncate") {
+          limits.truncate = true;
+        } else if (oversizeStr != "raise") {
+          throw Rice::Exception(rb_eArgError, "Invalid oversize: %s", oversizeStr.c_str());
+        }
+      }
+      return limits;
+    }
+
     String rubyStringOrNilToTagLibString(Object value) {
         if (value.is_nil()) {
             return { "", String::UTF8 };
@@ -43,23 +85,79 @@ namespace TagLib {
       static const rb_encoding* const LATIN1_ENCODING = rb_enc_find("ISO-8859-1");
 
 
+      // Append c as one or two (surrogate pair) UTF-16 code units
+      static void appendCodePoint(std::wstring& units, const uint32_t c) {
+          if (c < 0x10000) {
+              units.push_back(static_cast<wchar_t>(c));
+          } else {
+              units.push_back(static_cast<wchar_t>(0xD800 + ((c - 0x10000) >> 10)));
+              units.push_back(static_cast<wchar_t>(0xDC00 + ((c - 0x10000) & 0x3FF)));
+          }
+      }
+
+      TagLib::String utf8ToTagLibString(const char* data, const size_t length) {
+          const auto* bytes = reinterpret_cast<const unsigned char*>(data);
+          std::wstring& units = scratchUnits(length);
+          for (size_t i = 0; i < length;) {
+              const uint32_t lead = bytes[i];
+              const size_t size = lead < 0x80 ? 1 : (lead >> 5) == 0x6 ? 2 : (lead >> 4) == 0xE ? 3 : (lead >> 3) == 0x1E ? 4 : 0;
+              bool valid = size > 0 && i + size <= length;
+              uint32_t c = size == 1 ? lead : size == 2 ? lead & 0x1F : size == 3 ? lead & 0x0F : lead & 0x07;
+              for (size_t k = 1; valid && k < size; k++) {
+                  valid = (bytes[i + k] & 0xC0) == 0x80;
+                  c = (c << 6) | (bytes[i + k] & 0x3F);
+              }
+              // overlong forms, surrogates and values past U+10FFFF are invalid too
+              static constexpr uint32_t minimum[] = {0, 0, 0x80, 0x800, 0x10000};
+              valid = valid && c >= minimum[size] && c <= 0x10FFFF && (c < 0xD800 || c > 0xDFFF);
+              if (!valid) {
+                  units.push_back(static_cast<wchar_t>(0xFFFD));
+                  i++;
+                  continue;
+              }
+              appendCodePoint(units, c);
+              i += size;
+          }
+          return { units };
+      }
+
+      // Latin1 (and so ASCII) bytes are code points
+      static TagLib::String latin1ToTagLibString(const char* data, const size_t length) {
+          std::wstring& units = scratchUnits(length);
+          for (size_t i = 0; i < length; i++) {
+              units.push_back(static_cast<wchar_t>(static_cast<unsigned char>(data[i])));
+          }
+          return { units };
+      }
+
+      // Decodes the String's bytes according to its Ruby encoding, embedded NULs and UTF-16 included.
+      // UTF-8 and Latin1 are decoded through the thread's scratch units so the only allocation is the TagLib::String.
+      // ASCII only content (Ruby caches this in the code range) skips UTF-8 decoding altogether
       TagLib::String rubyStringToTagLibString(const Rice::String& str) {
-          rb_encoding* enc = rb_enc_get(str);
-          if (enc == rb_utf8_encoding()) {
-              return { str.c_str(), TagLib::String::UTF8 };
-          } else if (enc == rb_ascii8bit_encoding() || enc == rb_usascii_encoding()) {
-              return { str.c_str(), TagLib::String::UTF8 };
-          } else if (enc == LATIN1_ENCODING) {
-              return { str.c_str(), TagLib::String::Latin1 };
-          } else if (enc == UTF16LE_ENCODING) {
-              return { str.c_str(), TagLib::String::UTF16LE };
+          VALUE value = str.value();
+          rb_encoding* enc = rb_enc_get(value);
+          TagLib::String::Type type;
+          if (enc == rb_utf8_encoding() || enc == rb_ascii8bit_encoding() || enc == rb_usascii_encoding()) {
+              if (rb_enc_str_asciionly_p(value)) {
+                  return latin1ToTagLibString(RSTRING_PTR(value), RSTRING_LEN(value));
+              }
+              return utf8ToTagLibString(RSTRING_PTR(value), RSTRING_LEN(value));
+          }
+          if (enc == LATIN1_ENCODING) {
+              return latin1ToTagLibString(RSTRING_PTR(value), RSTRING_LEN(value));
+          }
+          if (enc == UTF16LE_ENCODING) {
+              type = TagLib::String::UTF16LE;
           } else if (enc == UTF16BE_ENCODING) {
-              return { str.c_str(), TagLib::String::UTF16BE };
+              type = TagLib::String::UTF16BE;
+          } else if (enc == UTF16_ENCODING) {
+              type = TagLib::String::UTF16;
           } else {
               // For any other encoding, convert to UTF-8 first
-              Rice::String utf8_str = rb_str_export_to_enc(str, rb_utf8_encoding());
-              return { utf8_str.c_str(), TagLib::String::UTF8 };
+              value = rb_str_export_to_enc(value, rb_utf8_encoding());
+              return utf8ToTagLibString(RSTRING_PTR(value), RSTRING_LEN(value));
           }
+          return { TagLib::ByteVector(RSTRING_PTR(value), static_cast<unsigned int>(RSTRING_LEN(value))), type };
       }
 
     TagLib::StringList rubyObjectToTagLibStringList(const Object& obj) {
@@ -67,19 +165,25 @@ namespace TagLib {
 
       // Handle both String and Array values
       if (TYPE(obj) == T_ARRAY) {
-        Array val_array(obj);
-        if (val_array.size() > 0) {
-          for (auto it = val_array.begin(); it != val_array.end(); ++it) {
-            Rice::String item(it->value());
-            string_list.append(TagLib::String(item.c_str()));
-          }
+        for (const auto& item : Array(obj)) {
+          string_list.append(rubyStringToTagLibString(Rice::String(item.value())));
         }
       } else {
-        string_list.append(Rice::String(obj).c_str());
+        string_list.append(rubyStringToTagLibString(Rice::String(obj)));
       }
       return string_list;
     }
 
+    // A file name from a String or Pathname (anything responding to :to_path)
+    std::string rubyPathToString(Object path, const char* expected) {
+      if (path.respond_to("to_path")) {
+        path = path.call("to_path");
+      } else if (!path.is_a(rb_cString)) {
+        throw Rice::Exception(rb_eTypeError, "expects %s, got %s", expected, path.class_name().c_str());
+      }
+      return Rice::String(path).str();
+    }
+
     bool isBinaryEncoding(const Rice::String& str) {
       return rb_enc_get(str) ==  rb_ascii8bit_encoding();
     }
@@ -87,8 +191,7 @@ namespace TagLib {
     TagLib::StringList rubyArrayToTagLibStringList(Array arr) {
       TagLib::StringList stringList;
       for (const auto& item : arr) {
-        Rice::String str = {item.value() };
-        stringList.append(TagLib::String(str.c_str(), TagLib::String::UTF8));
+        stringList.append(rubyStringToTagLibString(Rice::String(item.value())));
       }
       return stringList;
     }
@@ -135,8 +238,7 @@ namespace TagLib {
             // Binary string - convert to ByteVector
             return { TagLib::ByteVector(str.c_str(), str.length()) };
         } else {
-            // Assume UTF-8 for all other encodings
-            return { TagLib::String(str.c_str(), TagLib::String::UTF8) };
+            return { rubyStringToTagLibString(str) };
         }
     }
 
@@ -144,7 +246,7 @@ namespace TagLib {
         TagLib::VariantMap result;
 
         for (auto it = hash.begin(); it != hash.end(); ++it) {
-            TagLib::String key(Rice::String(it->first).c_str());
+            TagLib::String key = rubyStringToTagLibString(Rice::String(it->first));
             Rice::Object obj(it->second);
             result.insert(key, rubyObjectToTagLibVariant(obj));
         }
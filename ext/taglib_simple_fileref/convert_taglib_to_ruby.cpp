@@ -1,16 +1,134 @@
 #include "conversions.h"
+#include "Stats.hpp"
 #include <ruby/encoding.h>
+#include <algorithm>
+#include <cstdint>
+#include <initializer_list>
+#include <optional>
+#include <string>
 
 using namespace Rice;
 
 namespace TagLib {
     namespace Simple {
 
-    Object tagLibStringToNonEmptyRubyUTF8String(TagLib::String string) {
+    TagValues::TagValues(const TagLib::Tag& tag) :
+        title(tag.title()), artist(tag.artist()), album(tag.album()), genre(tag.genre()),
+        year(tag.year()), track(tag.track()), comment(tag.comment()) {
+    }
+
+    AudioPropertyValues::AudioPropertyValues(const TagLib::AudioProperties& props) :
+        lengthInMilliseconds(props.lengthInMilliseconds()), bitrate(props.bitrate()),
+        sampleRate(props.sampleRate()), channels(props.channels()) {
+    }
+
+    static const char* const TAGLIB_CLASS_NAMES[] = {"Error", "RewriteRequired", "AudioTag", "AudioProperties"};
+
+    VALUE tagLibClass(const TagLibClass klass) {
+        static VALUE classes[] = {Qnil, Qnil, Qnil, Qnil};
+        VALUE& cache = classes[static_cast<size_t>(klass)];
+        if (NIL_P(cache)) {
+            rb_gc_register_address(&cache);
+            cache = rb_const_get(rb_path2class("TagLib"), rb_intern(TAGLIB_CLASS_NAMES[static_cast<size_t>(klass)]));
+        }
+        return cache;
+    }
+
+    void resolveTagLibClasses() {
+        const VALUE rb_mTagLib = rb_path2class("TagLib");
+        for (const auto klass : {TagLibClass::Error, TagLibClass::RewriteRequired, TagLibClass::AudioTag,
+                                 TagLibClass::AudioProperties}) {
+            if (rb_const_defined_at(rb_mTagLib, rb_intern(TAGLIB_CLASS_NAMES[static_cast<size_t>(klass)]))) {
+                tagLibClass(klass);
+            }
+        }
+    }
+
+    size_t ConversionBudget::allowance(const size_t length, const bool name) const {
+        size_t allowed = length;
+        if (!name && limits.maxValueSize) {
+            allowed = std::min(allowed, limits.maxValueSize);
+        }
+        if (limits.maxTotalSize) {
+            allowed = std::min(allowed, limits.maxTotalSize - used);
+        }
+        return allowed;
+    }
+
+    void ConversionBudget::raiseOversize(const size_t length, const bool name) const {
+        if (!name && limits.maxValueSize && length > limits.maxValueSize) {
+            throw Exception(tagLibClass(TagLibClass::Error), "Value of %zu bytes exceeds max_value_size: %zu",
+                            length, limits.maxValueSize);
+        }
+        throw Exception(tagLibClass(TagLibClass::Error), "Converting %zu more bytes exceeds max_total_size: %zu",
+                        length, limits.maxTotalSize);
+    }
+
+    size_t ConversionBudget::take(const size_t length) {
+        const size_t allowed = allowance(length, false);
+        if (allowed < length) {
+            if (!limits.truncate) {
+                raiseOversize(length, false);
+            }
+            Stats::add(Stats::TruncatedValues);
+        }
+        used += allowed;
+        return allowed;
+    }
+
+    bool ConversionBudget::takeWhole(const size_t length, const bool name) {
+        if (allowance(length, name) < length) {
+            if (!limits.truncate) {
+                raiseOversize(length, name);
+            }
+            Stats::add(Stats::TruncatedValues);
+            return false;
+        }
+        used += length;
+        return true;
+    }
+
+    // Allocate and fill a frozen Data instance directly, skipping Data.new's argument handling and #initialize.
+    // values must be in member order
+    static VALUE newData(const VALUE klass, const std::initializer_list<VALUE> values) {
+        const VALUE data = rb_struct_alloc_noinit(klass);
+        long index = 0;
+        for (const VALUE value : values) {
+            RSTRUCT_SET(data, index++, value);
+        }
+        return rb_obj_freeze(data);
+    }
+
+    Object tagValuesToRubyAudioTag(const TagValues& tag, ConversionBudget* budget) {
+        Stats::Timer timer(Stats::ConvertNanos);
+
+        //  :title, :artist, :album, :genre, :year, :track, :comment
+        return { newData(tagLibClass(TagLibClass::AudioTag), {
+            tagLibStringToNonEmptyRubyUTF8String(tag.title, budget).value(),
+            tagLibStringToNonEmptyRubyUTF8String(tag.artist, budget).value(),
+            tagLibStringToNonEmptyRubyUTF8String(tag.album, budget).value(),
+            tagLibStringToNonEmptyRubyUTF8String(tag.genre, budget).value(),
+            uintToNonZeroRubyInteger(tag.year).value(),
+            uintToNonZeroRubyInteger(tag.track).value(),
+            tagLibStringToNonEmptyRubyUTF8String(tag.comment, budget).value()
+        }) };
+    }
+
+    Object audioPropertyValuesToRuby(const AudioPropertyValues& props) {
+        Stats::Timer timer(Stats::ConvertNanos);
+
+        // :audio_length, :bitrate, :sample_rate, :channels
+        return { newData(tagLibClass(TagLibClass::AudioProperties), {
+            INT2NUM(props.lengthInMilliseconds), INT2NUM(props.bitrate), INT2NUM(props.sampleRate),
+            INT2NUM(props.channels)
+        }) };
+    }
+
+    Object tagLibStringToNonEmptyRubyUTF8String(const TagLib::String& string, ConversionBudget* budget) {
         if (string.length() == 0) {
             return {Qnil};
         }
-        return { tagLibStringToRubyUTF8String(string) };
+        return { tagLibStringToRubyUTF8String(string, budget) };
     }
 
     Object uintToNonZeroRubyInteger(unsigned integer) {
@@ -20,46 +138,179 @@ namespace TagLib {
         return { UINT2NUM(integer) };
     }
 
-    Rice::String tagLibStringToRubyUTF8String(const TagLib::String& str) {
-        Rice::String rb_str(str.to8Bit(true));  // true ensures UTF-8
-        rb_enc_associate(rb_str.value(), rb_utf8_encoding());
-        return rb_str;
+    // TagLib::String holds UTF-16 code units, one per wchar_t.
+    // True if every unit is ASCII, written without branches so the compiler can vectorise the loop
+    static bool isASCII(const wchar_t* units, const size_t length) {
+        uint32_t bits = 0;
+        for (size_t i = 0; i < length; i++) {
+            bits |= static_cast<uint32_t>(units[i]);
+        }
+        return (bits & ~0x7FU) == 0;
+    }
+
+    static bool isHighSurrogate(const uint32_t unit) { return unit >= 0xD800 && unit <= 0xDBFF; }
+    static bool isLowSurrogate(const uint32_t unit) { return unit >= 0xDC00 && unit <= 0xDFFF; }
+
+    // Visit each code point, unpaired surrogates become U+FFFD
+    template<typename Func_T>
+    static void eachCodePoint(const wchar_t* units, const size_t length, Func_T&& func) {
+        for (size_t i = 0; i < length; i++) {
+            uint32_t c = static_cast<uint32_t>(units[i]);
+            if (isHighSurrogate(c) && i + 1 < length && isLowSurrogate(static_cast<uint32_t>(units[i + 1]))) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (static_cast<uint32_t>(units[++i]) - 0xDC00);
+            } else if ((c >= 0xD800 && c <= 0xDFFF) || c > 0x10FFFF) {
+                c = 0xFFFD;
+            }
+            func(c);
+        }
+    }
+
+    static size_t codePointUTF8Length(const uint32_t c) {
+        return c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
     }
 
-    Array tagLibStringListToRuby(const TagLib::StringList& list) {
+    static size_t utf8Length(const wchar_t* units, const size_t length) {
+        size_t bytes = 0;
+        eachCodePoint(units, length, [&bytes](const uint32_t c) {
+            bytes += codePointUTF8Length(c);
+        });
+        return bytes;
+    }
+
+    // Encode the code points that fit in capacity bytes (stopping at the first that does not), returns bytes written
+    static size_t encodeUTF8(const wchar_t* units, const size_t length, char* out, size_t capacity) {
+        char* const start = out;
+        eachCodePoint(units, length, [&out, &capacity, start](const uint32_t c) {
+            const size_t written = static_cast<size_t>(out - start);
+            if (written + codePointUTF8Length(c) > capacity) {
+                capacity = written;
+                return;
+            }
+            if (c < 0x80) {
+                *out++ = static_cast<char>(c);
+            } else if (c < 0x800) {
+                *out++ = static_cast<char>(0xC0 | (c >> 6));
+                *out++ = static_cast<char>(0x80 | (c & 0x3F));
+            } else if (c < 0x10000) {
+                *out++ = static_cast<char>(0xE0 | (c >> 12));
+                *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+                *out++ = static_cast<char>(0x80 | (c & 0x3F));
+            } else {
+                *out++ = static_cast<char>(0xF0 | (c >> 18));
+                *out++ = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+                *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+                *out++ = static_cast<char>(0x80 | (c & 0x3F));
+            }
+        });
+        return static_cast<size_t>(out - start);
+    }
+
+    // Encodes straight into the Ruby String's buffer, no intermediate std::string.
+    // Pure ASCII values (most tags) are narrowed without transcoding. The code range is set so Ruby need not scan it,
+    // unless the value was truncated.
+    // The length is checked against the budget before anything is allocated, a truncated value ends on a whole
+    // code point
+    Rice::String tagLibStringToRubyUTF8String(const TagLib::String& str, ConversionBudget* budget) {
+        const wchar_t* units = str.toCWString();
+        const size_t length = str.size();
+        const bool ascii = isASCII(units, length);
+        const size_t bytes = ascii ? length : utf8Length(units, length);
+        const size_t allowed = budget ? budget->take(bytes) : bytes;
+
+        VALUE rb_str = rb_utf8_str_new(nullptr, static_cast<long>(allowed));
+        char* out = RSTRING_PTR(rb_str);
+        if (ascii) {
+            for (size_t i = 0; i < allowed; i++) {
+                out[i] = static_cast<char>(units[i]);
+            }
+        } else {
+            const size_t written = encodeUTF8(units, length, out, allowed);
+            if (written < allowed) {
+                rb_str_set_len(rb_str, static_cast<long>(written));
+            }
+        }
+        if (ascii) {
+            ENC_CODERANGE_SET(rb_str, ENC_CODERANGE_7BIT);
+        } else if (allowed < bytes) {
+            // a truncated prefix may be ASCII only, leave Ruby to scan it when needed
+            ENC_CODERANGE_CLEAR(rb_str);
+        } else {
+            ENC_CODERANGE_SET(rb_str, ENC_CODERANGE_VALID);
+        }
+        return { rb_str };
+    }
+
+    std::string_view tagLibStringToUTF8(const TagLib::String& str) {
+        const wchar_t* units = str.toCWString();
+        const size_t length = str.size();
+        const size_t bytes = isASCII(units, length) ? length : utf8Length(units, length);
+
+        std::string& out = scratchBytes(bytes);
+        out.resize(bytes);
+        encodeUTF8(units, length, out.data(), bytes);
+        return out;
+    }
+
+    // Deduplicated, frozen String from Ruby's fstring table. Used for keys that repeat across files
+    // eg property names. Encoded in the thread's scratch bytes, so only an unseen key allocates
+    Rice::String tagLibStringToInternedRubyUTF8String(const TagLib::String& str) {
+        const std::string_view utf8 = tagLibStringToUTF8(str);
+        return { rb_enc_interned_str(utf8.data(), static_cast<long>(utf8.size()), rb_utf8_encoding()) };
+    }
+
+    Object tagLibNameToRuby(const TagLib::String& name, ConversionBudget* budget) {
+        const std::string_view utf8 = tagLibStringToUTF8(name);
+        if (budget && !budget->takeWhole(utf8.size(), true)) {
+            return {Qnil};
+        }
+        return { rb_enc_interned_str(utf8.data(), static_cast<long>(utf8.size()), rb_utf8_encoding()) };
+    }
+
+    Array tagLibStringListToRuby(const TagLib::StringList& list, ConversionBudget* budget) {
         Array result;
         for (const auto& str : list) {
-            result.push(tagLibStringToRubyUTF8String(str));
+            result.push(tagLibStringToRubyUTF8String(str, budget));
         }
         return result;
     }
 
-    Rice::String tagLibByteVectorToRuby(const TagLib::ByteVector& byteVector) {
-        // Convert ByteVector to Ruby String with binary encoding
-        Rice::String rb_str(std::string(byteVector.data(), byteVector.size()));
-        rb_enc_associate(rb_str.value(), rb_ascii8bit_encoding());
-        return rb_str;
+    // Binary data is never truncated (a cut picture is just corrupt), it is converted whole or not at all
+    static std::optional<Object> tagLibByteVectorToRuby(const TagLib::ByteVector& byteVector, ConversionBudget* budget) {
+        if (budget && !budget->takeWhole(byteVector.size())) {
+            return std::nullopt;
+        }
+        // Copy ByteVector data directly into a Ruby String with binary encoding
+        return Object(rb_enc_str_new(byteVector.data(), static_cast<long>(byteVector.size()), rb_ascii8bit_encoding()));
     }
 
-    Array tagLibByteVectorListToRuby(const TagLib::ByteVectorList& list) {
+    static std::optional<Object> tagLibByteVectorListToRuby(const TagLib::ByteVectorList& list,
+                                                            ConversionBudget* budget) {
         Array result;
         for (const auto& byteVector : list) {
-            result.push(tagLibByteVectorToRuby((byteVector)));
+            const std::optional<Object> value = tagLibByteVectorToRuby(byteVector, budget);
+            if (!value) {
+                return std::nullopt;
+            }
+            result.push(*value);
         }
-        return result;
+        return Object(result);
     }
 
-    Hash tagLibPropertyMapToRubyHash(const TagLib::PropertyMap& properties) {
+    Hash tagLibPropertyMapToRubyHash(const TagLib::PropertyMap& properties, ConversionBudget* budget) {
+         Stats::Timer timer(Stats::ConvertNanos);
          Hash result;
          // Iterate through the PropertyMap
          for(auto & property : properties) {
 
-             Rice::String key = tagLibStringToRubyUTF8String(property.first);
+             const Object key = tagLibNameToRuby(property.first, budget);
+             if (key.is_nil()) {
+                 continue;
+             }
 
              // Convert the StringList to Ruby Array
              Array values;
              for(const auto& item : property.second) {
-               values.push(tagLibStringToRubyUTF8String(item));
+               values.push(tagLibStringToRubyUTF8String(item, budget));
              }
              // Add to result hash
              values.freeze();
@@ -70,60 +321,93 @@ namespace TagLib {
          return result;
      }
 #if (TAGLIB_MAJOR_VERSION >= 2)
-    Object taglibVariantToRuby(const TagLib::Variant &value);
+    // nullopt if the value was dropped to fit the budget
+    static std::optional<Object> taglibVariantToRuby(const TagLib::Variant &value, ConversionBudget* budget);
 
-    Hash taglibVariantMapToRuby(const TagLib::Map<TagLib::String, TagLib::Variant> & map) {
+    // entries whose name or value was dropped to fit the budget are left out
+    static Hash taglibVariantMapToRuby(const TagLib::Map<TagLib::String, TagLib::Variant> & map,
+                                       ConversionBudget* budget) {
         Hash result;
         for (const auto& pair : map) {
-            Rice::String key(pair.first.toCString());
-            const TagLib::Variant& value = pair.second;
-            result[key] = taglibVariantToRuby(value);
+            const Object key = tagLibNameToRuby(pair.first, budget);
+            if (key.is_nil()) {
+                continue;
+            }
+            if (const std::optional<Object> value = taglibVariantToRuby(pair.second, budget)) {
+                result[key] = *value;
+            }
         }
         return result;
     }
 
-    Array taglibVariantListToRuby(const TagLib::List<TagLib::Variant> & list) {
+    static Array taglibVariantListToRuby(const TagLib::List<TagLib::Variant> & list, ConversionBudget* budget) {
         Array result;
         for (const auto& item : list) {
-            result.push(taglibVariantToRuby(item));
+            if (const std::optional<Object> value = taglibVariantToRuby(item, budget)) {
+                result.push(*value);
+            }
         }
         return result;
     }
 
-    Object taglibVariantToRuby(const TagLib::Variant &value) {
+    static std::optional<Object> taglibVariantToRuby(const TagLib::Variant &value, ConversionBudget* budget) {
         switch (value.type()) {
             case TagLib::Variant::Bool:
-                return value.toBool() ? Qtrue : Qfalse;
+                return Object(value.toBool() ? Qtrue : Qfalse);
             case TagLib::Variant::Int:
-                return INT2NUM(value.toInt());
+                return Object(INT2NUM(value.toInt()));
             case TagLib::Variant::UInt:
-                return UINT2NUM(value.toUInt());
+                return Object(UINT2NUM(value.toUInt()));
             case TagLib::Variant::LongLong:
-                return LL2NUM(value.toLongLong());
+                return Object(LL2NUM(value.toLongLong()));
             case TagLib::Variant::ULongLong:
-                return ULL2NUM(value.toULongLong());
+                return Object(ULL2NUM(value.toULongLong()));
             case TagLib::Variant::String:
-                return { tagLibStringToRubyUTF8String(value.toString()) };
+                return Object(tagLibStringToRubyUTF8String(value.toString(), budget));
             case TagLib::Variant::StringList:
-                return { tagLibStringListToRuby(value.toStringList()) };
+                return Object(tagLibStringListToRuby(value.toStringList(), budget));
             case TagLib::Variant::ByteVector:
-                return { tagLibByteVectorToRuby(value.toByteVector()) };
+                return tagLibByteVectorToRuby(value.toByteVector(), budget);
             case TagLib::Variant::ByteVectorList:
-                return { tagLibByteVectorListToRuby(value.toByteVectorList()) };
+                return tagLibByteVectorListToRuby(value.toByteVectorList(), budget);
             case TagLib::Variant::VariantList:
-                return { taglibVariantListToRuby(value.toList()) };
+                return Object(taglibVariantListToRuby(value.toList(), budget));
             case TagLib::Variant::VariantMap:
-                return { taglibVariantMapToRuby(value.toMap()) };
+                return Object(taglibVariantMapToRuby(value.toMap(), budget));
             default:
-               return Qnil;
+               return Object(Qnil);
         }
     }
 
-    Array tagLibComplexPropertyToRuby(const TagLib::List<TagLib::VariantMap>& list) {
+    static bool isBinaryVariant(const TagLib::Variant& value) {
+        return value.type() == TagLib::Variant::ByteVector || value.type() == TagLib::Variant::ByteVectorList;
+    }
+
+    Array tagLibComplexPropertyToRuby(const TagLib::List<TagLib::VariantMap>& list, const bool includeData,
+                                      ConversionBudget* budget) {
+        Stats::Timer timer(Stats::ConvertNanos);
         Array result;
 
         for (const auto& variantMap : list) {
-            result.push(taglibVariantMapToRuby(variantMap));
+            if (includeData) {
+                result.push(taglibVariantMapToRuby(variantMap, budget));
+                continue;
+            }
+            // metadata only, binary values (eg picture data) are never copied into Ruby
+            Hash values;
+            for (const auto& pair : variantMap) {
+                if (isBinaryVariant(pair.second)) {
+                    continue;
+                }
+                const Object key = tagLibNameToRuby(pair.first, budget);
+                if (key.is_nil()) {
+                    continue;
+                }
+                if (const std::optional<Object> value = taglibVariantToRuby(pair.second, budget)) {
+                    values[key] = *value;
+                }
+            }
+            result.push(values);
         }
 
         return result;
@@ -18,6 +18,9 @@ have_library('tag') || abort('TagLib is required')
 
 append_cppflags('-g,-DDEBUG') if enable_config('debug')
 
+# --disable-stats compiles out the TagLib::Simple.stats counters
+append_cppflags('-DTAGLIB_SIMPLE_DISABLE_STATS') unless enable_config('stats', true)
+
 # Add to existing flags
 append_ldflags('-Wl,--no-undefined')
 create_makefile('taglib_simple_fileref')
@@ -1,5 +1,11 @@
 
 #include "FileRef.hpp"
+#include "Batch.hpp"
+#include "Cache.hpp"
+#include "Prewarm.hpp"
+#include "Probe.hpp"
+#include "Stats.hpp"
+#include "Walker.hpp"
 #if TAGLIB_MAJOR_VERSION > 1
 #include <taglib/tversionnumber.h>
 #endif
@@ -10,6 +16,12 @@ void Init_taglib_simple_fileref() {
     Module rb_mTagLibExt = define_module_under({rb_mTagLib},"Simple");
 
     define_taglib_simple_fileref(rb_mTagLibExt);
+    define_taglib_simple_batch(rb_mTagLibExt);
+    define_taglib_simple_cache(rb_mTagLibExt);
+    define_taglib_simple_prewarm(rb_mTagLibExt);
+    define_taglib_simple_probe(rb_mTagLibExt);
+    define_taglib_simple_stats(rb_mTagLibExt);
+    define_taglib_simple_walker(rb_mTagLibExt);
 
     uint major;
     uint minor;
@@ -54,4 +66,8 @@ void Init_taglib_simple_fileref() {
     rb_mTagLib.const_set("PATCH_VERSION", UINT2NUM(patch));
     rb_mTagLib.const_set("LIBRARY_VERSION", {version});
 
+    // lib/taglib_simple defines its classes before loading the extension, so the parent process of any fork has
+    // already resolved them
+    TagLib::Simple::prewarm();
+
 }
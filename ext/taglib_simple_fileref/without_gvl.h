@@ -0,0 +1,129 @@
+// Helpers for running TagLib work with Ruby's Global VM Lock released
+#pragma once
+
+#include <ruby/ruby.h>
+#include <ruby/thread.h>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace TagLib {
+    namespace Simple {
+
+        // The C library's errno. Ruby redefines errno to go via the current Ruby thread, which is not safe without
+        // the GVL or on native worker threads.
+        inline int systemErrno() {
+            return *rb_orig_errno_ptr();
+        }
+
+        // The matching SystemCallError (Errno::*) for e. what() ends with the error's own message, as does the
+        // SystemCallError's, so only the context before it (eg "write /path") is passed on
+        inline VALUE systemErrorToRuby(const std::system_error &e) {
+            std::string context(e.what());
+            const std::string message = e.code().message();
+            const std::string suffix = ": " + message;
+            if (context == message) {
+                return rb_syserr_new(e.code().value(), nullptr);
+            }
+            if (context.size() >= suffix.size() &&
+                context.compare(context.size() - suffix.size(), suffix.size(), suffix) == 0) {
+                context.resize(context.size() - suffix.size());
+            }
+            return rb_syserr_new(e.code().value(), context.c_str());
+        }
+
+        // Run func with the GVL released.
+        // func must not touch any Ruby objects or call the Ruby API
+        // A C++ exception thrown by func is rethrown once the GVL has been re-acquired.
+        template<typename Func_T>
+        void withoutGVL(Func_T &&func, rb_unblock_function_t *ubf = RUBY_UBF_IO, void *ubfData = nullptr) {
+            struct Call {
+                Func_T &func;
+                std::exception_ptr error;
+            } call{func, nullptr};
+
+            rb_thread_call_without_gvl([](void *data) -> void * {
+                auto *c = static_cast<Call *>(data);
+                try {
+                    c->func();
+                } catch (...) {
+                    c->error = std::current_exception();
+                }
+                return nullptr;
+            }, &call, ubf, ubfData);
+
+            if (call.error) {
+                std::rethrow_exception(call.error);
+            }
+        }
+
+        // Number of worker threads to use for a batch of count items, 0 means one per core
+        inline unsigned workerCount(unsigned threads, size_t count) {
+            if (threads == 0) {
+                threads = std::max(1U, std::thread::hardware_concurrency());
+            }
+            return static_cast<unsigned>(std::min<size_t>(threads, std::max<size_t>(count, 1)));
+        }
+
+        // Call func(index) for each index in [0, count) across a set of worker threads.
+        // Not started items are skipped once cancelled is set (eg by an unblock function)
+        // The first exception thrown by func cancels remaining work and is rethrown after all workers have finished.
+        template<typename Func_T>
+        void parallelFor(const size_t count, const unsigned threads, std::atomic<bool> &cancelled, Func_T &&func) {
+            std::atomic<size_t> next{0};
+            std::exception_ptr error;
+            std::mutex errorMutex;
+
+            auto worker = [&]() {
+                size_t index;
+                while (!cancelled.load(std::memory_order_relaxed) && (index = next.fetch_add(1)) < count) {
+                    try {
+                        func(index);
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(errorMutex);
+                        if (!error) {
+                            error = std::current_exception();
+                        }
+                        cancelled = true;
+                    }
+                }
+            };
+
+            const unsigned workers = workerCount(threads, count);
+            std::vector<std::thread> pool;
+            try {
+                pool.reserve(workers - 1);
+                for (unsigned i = 1; i < workers; i++) {
+                    pool.emplace_back(worker);
+                }
+            } catch (...) {
+                // could not start a thread, stop and join those already running before unwinding
+                cancelled = true;
+                for (auto &t: pool) {
+                    t.join();
+                }
+                throw;
+            }
+            // current thread does its share
+            worker();
+
+            for (auto &t: pool) {
+                t.join();
+            }
+
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        // Unblock function that asks parallelFor to stop picking up new items
+        inline void cancelParallelFor(void *cancelled) {
+            static_cast<std::atomic<bool> *>(cancelled)->store(true);
+        }
+    }
+}
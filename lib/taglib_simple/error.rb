@@ -2,4 +2,7 @@
 
 module TagLib
   class Error < StandardError; end
+
+  # Raised by {Simple::FileRef#save} with strategy: :in_place_or_fail when the updated tags no longer fit in place
+  class RewriteRequired < Error; end
 end
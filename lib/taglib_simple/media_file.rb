@@ -81,12 +81,60 @@ module TagLib
       # @param [String, Pathname, IO] filename
       # @param [Hash<Symbol>] init see {#initialize}.
       #   defaults to retrieving only {#properties} and #{tag}
+      # @param [Simple::Cache|nil] cache for file names, serve {#tag}, {#properties} and {#audio_properties} from
+      #   this cache (reading and storing them on a miss) rather than opening the file in TagLib.
+      #   Not used if complex properties or tags are requested.
       # @return [MediaFile] a {#closed?} media file
       # @see AudioTag.read
       # @see AudioProperties.read
-      def read(filename, properties: true, tag: true, **init)
+      def read(filename, properties: true, tag: true, cache: nil, **init)
+        filename = cached(cache, filename, **init) if cache
         self.open(filename, properties:, tag:, **init, &:itself)
       end
+
+      private
+
+      def cached(cache, filename, all: false, audio_properties: all && :average, complex_property_keys: nil, tags: nil,
+                 limits: nil, **)
+        return filename if all || complex_property_keys || tags || filename.respond_to?(:read)
+
+        entry = cache.fetch(filename, audio_properties:, **limits.to_h)
+        raise Error, "TagLib could not open #{filename}" unless entry
+
+        CachedFileRef.new(entry)
+      end
+    end
+
+    # Read only stand in for a {Simple::FileRef} serving an entry from {Simple::Cache#fetch}
+    # @!visibility private
+    class CachedFileRef
+      attr_reader :tag, :audio_properties, :properties
+
+      def initialize(entry)
+        @tag, @audio_properties, @properties = entry.values_at(:tag, :audio_properties, :properties)
+        @valid = true
+      end
+
+      def valid?
+        @valid
+      end
+
+      def close
+        @valid = false
+        nil
+      end
+
+      def read_only?
+        true
+      end
+
+      def fetch_properties(keys)
+        @properties.slice(*keys).freeze
+      end
+
+      def complex_property_keys
+        []
+      end
     end
 
     include Enumerable
@@ -96,11 +144,15 @@ module TagLib
     #   either the name of a file, an open File or an IO stream
     # @param [Symbol<:fast,:average,:accurate>] audio_properties
     #   if not set no {AudioProperties} will be read otherwise :fast, :average or :accurate
+    # @param [Array<Symbol>|nil] tags only read {#tag} and {#properties} from these tag families, in order of
+    #   preference. The file is then read only. See {Simple::FileRef#initialize}
+    # @param [Hash|nil] limits max_value_size:, max_total_size: and oversize: bounds on the values converted from
+    #   TagLib. See {Simple::FileRef#initialize}
     # @param [Hash] retrieve property types to retrieve on initial load. The default is to pre-fetch nothing.
     #   See {#retrieve}.
     # @raise [Error] if TagLib cannot open or process the file
-    def initialize(file, all: false, audio_properties: all && :average, **retrieve)
-      @fr = file.respond_to?(:valid?) ? file : Simple::FileRef.new(file, audio_properties)
+    def initialize(file, all: false, audio_properties: all && :average, tags: nil, limits: nil, **retrieve)
+      @fr = file.respond_to?(:valid?) ? file : Simple::FileRef.new(file, audio_properties, tags:, **limits.to_h)
       raise Error, "TagLib could not open #{file}" unless @fr.valid?
 
       @audio_properties = (audio_properties && @fr.audio_properties) || nil
@@ -116,7 +168,9 @@ module TagLib
     #
     # @param [Boolean] all default for other properties
     # @param [Boolean] tag if true forces retrieve of {tag}
-    # @param [Boolean] properties if true forces retrieve of {properties}
+    # @param [Boolean|Array<String>] properties if true forces retrieve of {properties}.
+    #   Given an Array only those property keys are retrieved (eg for {.read}), and {#properties} will not lazily
+    #   fetch any others.
     # @param [Array<String>|Boolean|Symbol<:lazy,:all>|nil] complex_property_keys
     #   list of properties to specifically treat as _complex_
     #
@@ -129,9 +183,13 @@ module TagLib
     #
     #   While the file is open, a specific complex property can be retrieved using {#complex_properties}[] regardless of
     #   what is set here.
+    # @param [Boolean|nil] complex_property_data false to retrieve complex properties without their binary values
+    #   (eg the PICTURE 'data'), see {Simple::FileRef#complex_property}. nil does not change the previous setting
     # @return [self]
-    def retrieve(all: false, tag: all, properties: all, complex_property_keys: (all && :all) || nil)
-      self.properties if properties
+    def retrieve(all: false, tag: all, properties: all, complex_property_keys: (all && :all) || nil,
+                 complex_property_data: nil)
+      @complex_property_data = complex_property_data unless complex_property_data.nil?
+      retrieve_properties(properties) if properties
       self.tag if tag
 
       retrieve_complex_property_keys(complex_property_keys) && fill_complex_properties
@@ -265,6 +323,13 @@ module TagLib
       @complex_properties.keys | ((lazy && (@complex_property_keys ||= @fr.complex_property_keys)) || [])
     end
 
+    # @!method write_complex_property_data(key, io_or_path, index: 0, field: 'data', chunk_size: 1048576)
+    # Write a binary complex property value, eg a PICTURE image, to an IO or file without holding it in a Ruby String
+    # @return [Integer, nil] bytes written, nil if there is no such value
+    # @raise [Error] if the file is closed
+    # @see Simple::FileRef#write_complex_property_data
+    def_delegators :@fr, :write_complex_property_data
+
     # @!endgroup
 
     # @!group Hash Semantics
@@ -495,15 +560,18 @@ module TagLib
 
     # Save accumulated property changes back to the file.
     # @param [Boolean] replace_all if set the accumulated property changes will replace all previous properties
+    # @param [Hash] save_options passed to {Simple::FileRef#save}, eg strategy: :in_place_or_fail
     # @return [self]
     # @raise [IOError] if the file is not {#writable?}
+    # @raise [RewriteRequired] if strategy: :in_place_or_fail was requested and the changes do not fit in place
     # @note all cached data is reset after saving. See {#retrieve}
-    def save!(replace_all: false)
+    # @note the file is not written at all if the accumulated changes match the values already in the file
+    def save!(replace_all: false, **save_options)
       # raise error even if nothing written - you shouldn't be making this call
       raise IOError, 'cannot save, stream not writable' unless writable?
 
       update(replace_all)
-      @fr.save
+      @fr.save(**save_options)
       reset
       self
     end
@@ -537,6 +605,13 @@ module TagLib
       @mutated[key] = values
     end
 
+    # for #retrieve
+    def retrieve_properties(keys)
+      return properties unless keys.is_a?(Array)
+
+      @properties = @fr.fetch_properties(keys)
+    end
+
     # for #retrieve
     def retrieve_complex_property_keys(keys)
       @complex_property_keys, fetch =
@@ -555,6 +630,10 @@ module TagLib
       fetch
     end
 
+    def fetch_complex_property(key)
+      @complex_property_data == false ? @fr.complex_property(key, data: false) : @fr.complex_property(key)
+    end
+
     def fill_complex_properties
       @complex_property_keys&.each { |k| @complex_properties[k] }
     end
@@ -587,7 +666,7 @@ module TagLib
 
     def reset
       (@mutated ||= {}).clear
-      (@complex_properties ||= Hash.new { |h, k| h[k] = @fr.complex_property(k) unless closed? }).clear
+      (@complex_properties ||= Hash.new { |h, k| h[k] = fetch_complex_property(k) unless closed? }).clear
       @complex_property_keys = nil
       @tag = nil
       @properties = nil
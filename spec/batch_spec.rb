@@ -0,0 +1,149 @@
+# frozen_string_literal: true
+
+require_relative 'spec_helper'
+
+describe 'TagLib::Simple batch functions' do
+  let(:fixture_m4a) { fixture_path('has-tags.m4a') }
+  let(:fixture_mp3) { fixture_path('itunes10.mp3') }
+
+  describe '.scan' do
+    it 'returns results in the order of the input paths' do
+      results = TagLib::Simple.scan([fixture_mp3, fixture_m4a], threads: 2)
+      _(results.size).must_equal 2
+      _(results.map { |r| r[:path] }).must_equal [fixture_mp3, fixture_m4a]
+    end
+
+    it 'reads tags and properties' do
+      result = TagLib::Simple.scan([fixture_mp3]).first
+      _(result[:tag]).must_be_instance_of TagLib::AudioTag
+      _(result[:tag].title).must_equal 'iTunes10MP3'
+      _(result[:properties]['ARTIST']).must_equal ['Artist']
+      _(result[:properties].frozen?).must_equal true
+      _(result[:audio_properties]).must_be_nil
+    end
+
+    it 'reads audio properties if requested' do
+      result = TagLib::Simple.scan([fixture_m4a], audio_properties: :average).first
+      _(result[:audio_properties]).must_be_instance_of TagLib::AudioProperties
+      _(result[:audio_properties].sample_rate).must_equal 44_100
+    end
+
+    it 'returns nil for files TagLib cannot read' do
+      _(TagLib::Simple.scan(['/does/not/exist', fixture_path('empty.file')])).must_equal [nil, nil]
+    end
+
+    it 'accepts Pathname' do
+      _(TagLib::Simple.scan([Pathname(fixture_mp3)]).first[:path]).must_equal fixture_mp3
+    end
+
+    it 'raises TypeError for IO inputs' do
+      File.open(fixture_mp3, 'rb') do |io|
+        _(-> { TagLib::Simple.scan([io]) }).must_raise TypeError
+      end
+    end
+
+    it 'rejects a negative number of threads' do
+      _ { TagLib::Simple.scan([fixture_mp3], threads: -1) }.must_raise ArgumentError
+      _ { TagLib::Simple.apply([[fixture_mp3, nil]], threads: -1) }.must_raise ArgumentError
+    end
+
+    it 'handles more paths than threads' do
+      paths = [fixture_mp3] * 10
+      _(TagLib::Simple.scan(paths, threads: 3).map { |r| r[:tag].title }.uniq).must_equal ['iTunes10MP3']
+    end
+
+    it 'returns columns if requested' do
+      paths = [fixture_mp3, '/does/not/exist', fixture_mp3, fixture_m4a]
+      columns = TagLib::Simple.scan(paths, columns: true, audio_properties: :fast)
+      rows = TagLib::Simple.scan(paths, audio_properties: :fast)
+
+      _(columns[:path]).must_equal paths
+      _(columns[:valid]).must_equal [true, false, true, true]
+      _(columns[:title]).must_equal(rows.map { |r| r&.dig(:tag)&.title })
+      _(columns[:sample_rate]).must_equal(rows.map { |r| r&.dig(:audio_properties)&.sample_rate })
+      _(columns[:properties]['ARTIST']).must_equal(rows.map { |r| r&.dig(:properties, 'ARTIST') })
+      _(columns[:artist][0]).must_be_same_as columns[:artist][2]
+    end
+
+    it 'applies conversion limits to each file' do
+      _ { TagLib::Simple.scan([fixture_mp3], max_value_size: 4) }.must_raise TagLib::Error
+      _ { TagLib::Simple.scan([fixture_mp3], columns: true, max_value_size: 4) }.must_raise TagLib::Error
+
+      rows = TagLib::Simple.scan([fixture_mp3, fixture_mp3], max_value_size: 4, oversize: :truncate)
+      _(rows.map { |r| r[:tag].title }).must_equal %w[iTun iTun]
+      _(rows.first[:properties]['ALBUM']).must_equal ['Albu']
+
+      columns = TagLib::Simple.scan([fixture_mp3, fixture_mp3], columns: true, max_total_size: 10, oversize: :truncate)
+      _(columns[:title]).must_equal %w[iTunes10MP iTunes10MP]
+      _(columns[:properties]).must_be_empty
+    end
+
+    it 'omits audio property columns unless requested' do
+      _(TagLib::Simple.scan([fixture_mp3], columns: true).keys).wont_include :bitrate
+    end
+  end
+
+  describe '.apply' do
+    it 'merges and saves updates, reporting status per file' do
+      with_named_filecopy(fixture_mp3) do |mp3|
+        with_named_filecopy(fixture_m4a) do |m4a|
+          updates = [
+            [mp3, { 'LANGUAGE' => ['English'], 'COMMENT' => nil }, { title: 'New Title', track: 5 }],
+            [Pathname.new(m4a), nil, nil],
+            ['/does/not/exist', { 'TITLE' => 'x' }, nil]
+          ]
+          _(TagLib::Simple.apply(updates, threads: 2)).must_equal %i[saved unchanged invalid]
+
+          result = TagLib::Simple.scan([mp3]).first
+          _(result[:tag].title).must_equal 'New Title'
+          _(result[:tag].track).must_equal 5
+          _(result[:properties]['LANGUAGE']).must_equal ['English']
+          _(result[:properties]).wont_include 'COMMENT'
+          _(result[:properties]['ARTIST']).must_equal ['Artist']
+        end
+      end
+    end
+
+    it 'does not write files the update would not change' do
+      with_named_filecopy(fixture_mp3) do |path|
+        before = File.binread(path)
+        _(TagLib::Simple.apply([[path, { 'ARTIST' => 'Artist' }, { title: 'iTunes10MP3' }]])).must_equal [:unchanged]
+        _(File.binread(path)).must_equal before
+      end
+    end
+
+    it 'replaces all properties if requested' do
+      with_named_filecopy(fixture_mp3) do |path|
+        _(TagLib::Simple.apply([[path, { 'TITLE' => 'Only' }]], replace_all: true)).must_equal [:saved]
+        _(TagLib::Simple.scan([path]).first[:properties]).must_equal({ 'TITLE' => ['Only'] })
+      end
+    end
+
+    it 'validates all updates before touching any file' do
+      with_named_filecopy(fixture_mp3) do |path|
+        before = File.binread(path)
+        _ { TagLib::Simple.apply([[path, { 'TITLE' => 'x' }], [path, nil, { colour: 'red' }]]) }.must_raise KeyError
+        _ { TagLib::Simple.apply([[path, { 'TITLE' => 1 }]]) }.must_raise TypeError
+        _ { TagLib::Simple.apply([path]) }.must_raise TypeError
+        _(File.binread(path)).must_equal before
+      end
+    end
+
+    it 'rejects more than one update for the same file' do
+      with_named_filecopy(fixture_mp3) do |path|
+        before = File.binread(path)
+        link = "#{path}.link"
+        File.link(path, link)
+        begin
+          aliases = [path, link, File.join(File.dirname(path), '.', File.basename(path))]
+          aliases.drop(1).each do |other|
+            _ { TagLib::Simple.apply([[path, { 'TITLE' => 'a' }], [other, { 'TITLE' => 'b' }]]) }.must_raise ArgumentError
+          end
+          _(File.binread(path)).must_equal before
+        ensure
+          File.unlink(link)
+        end
+      end
+    end
+  end
+end
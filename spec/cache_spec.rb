@@ -0,0 +1,99 @@
+# frozen_string_literal: true
+
+require_relative 'spec_helper'
+require 'tmpdir'
+
+describe 'TagLib::Simple::Cache' do
+  before do
+    @tmpdir = Dir.mktmpdir('taglib_cache')
+    @dir = File.join(@tmpdir, 'cache')
+  end
+
+  after do
+    FileUtils.remove_entry(@tmpdir)
+  end
+
+  let(:cache) { TagLib::Simple::Cache.new(@dir) }
+
+  def cache_stats
+    TagLib::Simple.stats.slice(:cache_hits, :cache_misses)
+  end
+
+  it 'creates the cache directory' do
+    _(cache.dir).must_equal @dir
+    _(File.directory?(@dir)).must_equal true
+  end
+
+  it 'raises if the cache directory cannot be created' do
+    _ { TagLib::Simple::Cache.new(fixture_path('itunes10.mp3')) }.must_raise SystemCallError
+  end
+
+  it 'serves unchanged files from the cache' do
+    with_named_filecopy(fixture_path('itunes10.mp3')) do |path|
+      TagLib::Simple.reset_stats
+      first = cache.fetch(path)
+      second = TagLib::Simple::Cache.new(@dir).fetch(path)
+      _(second).must_equal first
+      _(second[:tag].title).must_equal 'iTunes10MP3'
+      _(second[:properties]['ARTIST']).must_equal ['Artist']
+      _(cache_stats).must_equal({ cache_hits: 1, cache_misses: 1 }) unless TagLib::Simple.stats.empty?
+    end
+  end
+
+  it 'applies conversion limits to cached entries' do
+    path = fixture_path('itunes10.mp3')
+    cache.fetch(path)
+    _(cache.fetch(path, max_value_size: 4, oversize: :truncate)[:tag].title).must_equal 'iTun'
+    _ { cache.fetch(path, max_value_size: 4) }.must_raise TagLib::Error
+    _(cache.fetch(path)[:tag].title).must_equal 'iTunes10MP3'
+  end
+
+  it 'rereads files that have changed' do
+    with_named_filecopy(fixture_path('itunes10.mp3')) do |path|
+      cache.fetch(path)
+      ref = TagLib::Simple::FileRef.new(path)
+      ref.merge_tag_properties({ title: 'Changed Title' })
+      ref.save
+      ref.close
+      _(cache.fetch(path)[:tag].title).must_equal 'Changed Title'
+    end
+  end
+
+  it 'rereads files cached without audio properties when they are requested' do
+    path = fixture_path('has-tags.m4a')
+    _(cache.fetch(path)[:audio_properties]).must_be_nil
+    _(cache.fetch(path, audio_properties: :average)[:audio_properties].sample_rate).must_equal 44_100
+    _(cache.fetch(path)[:audio_properties]).must_be_nil
+  end
+
+  it 'caches files TagLib cannot read' do
+    _(cache.fetch(fixture_path('empty.file'))).must_be_nil
+    _(cache.fetch(fixture_path('empty.file'))).must_be_nil
+  end
+
+  it 'replaces unreadable records' do
+    path = fixture_path('test.ogg')
+    expected = cache.fetch(path)
+    Dir.glob(File.join(@dir, '*', '*')).each { |record| File.write(record, 'garbage') }
+    _(cache.fetch(path)).must_equal expected
+    _(cache.fetch(path)).must_equal expected
+  end
+
+  it 'is used by scan' do
+    paths = [fixture_path('itunes10.mp3'), fixture_path('has-tags.m4a')]
+    expected = TagLib::Simple.scan(paths)
+    _(TagLib::Simple.scan(paths, cache:)).must_equal expected
+    _(TagLib::Simple.scan(paths, cache:, columns: true)).must_equal TagLib::Simple.scan(paths, columns: true)
+  end
+
+  it 'is used by MediaFile.read' do
+    path = fixture_path('has-tags.m4a')
+    expected = TagLib::MediaFile.read(path, audio_properties: :average)
+    TagLib::MediaFile.read(path, audio_properties: :average, cache:)
+    media_file = TagLib::MediaFile.read(path, audio_properties: :average, cache:)
+    _(media_file).must_be :closed?
+    _(media_file.tag).must_equal expected.tag
+    _(media_file.properties).must_equal expected.properties
+    _(media_file.audio_properties).must_equal expected.audio_properties
+  end
+end
@@ -1,6 +1,10 @@
 # frozen_string_literal: true
 
 require_relative 'spec_helper'
+require 'delegate'
+require 'stringio'
+require 'fileutils'
+require 'tmpdir'
 
 
 # Here we are testing the wrapped FileRef
@@ -90,12 +94,333 @@ describe TagLib::Simple::FileRef do
       assert_valid(fr)
     end
 
+    it 'buffers reads from IO objects' do
+      counting_io = Class.new(SimpleDelegator) do
+        attr_reader :reads
+
+        def read(*args)
+          @reads = (@reads || 0) + 1
+          __getobj__.read(*args)
+        end
+      end
+
+      File.open(fixture_mp3, 'rb') do |io|
+        unbuffered = counting_io.new(io)
+        expected = TagLib::Simple::FileRef.new(unbuffered, nil, read_ahead: 0).properties
+        io.rewind
+        buffered = counting_io.new(io)
+        _(TagLib::Simple::FileRef.new(buffered, nil).properties).must_equal expected
+        _(buffered.reads).must_be :<, unbuffered.reads
+      end
+    end
+
+    it 'keeps its read buffer alive through GC while parsing IO objects' do
+      File.open(fixture_mp3, 'rb') do |io|
+        GC.stress = true
+        ref = TagLib::Simple::FileRef.new(io, nil, read_ahead: 512)
+        GC.stress = false
+        _(ref.properties).must_equal(mp3_properties)
+        io.rewind
+        GC.stress = true
+        _(TagLib::Simple.probe(io)[:format]).must_equal :mpeg
+      ensure
+        GC.stress = false
+      end
+    end
+
+    it 'raises TypeError if IO#read does not return a String' do
+      bad_io = Class.new(SimpleDelegator) { def read(*) = 42 }.new(File.open(fixture_mp3, 'rb'))
+      _ { TagLib::Simple::FileRef.new(bad_io, nil) }.must_raise TypeError
+    ensure
+      bad_io&.close
+    end
+
+    it 'shifts stream content in small chunks when a tag grows or shrinks' do
+      edit = lambda do |tf, props|
+        ref = TagLib::Simple::FileRef.new(tf, nil, chunk_size: 7)
+        ref.merge_properties(props)
+        ref.save
+        tf.rewind
+        tf.read
+      end
+      # TagLib's own FileStream is the oracle
+      saved = lambda do |*edits|
+        with_named_filecopy(fixture_mp3) do |path|
+          edits.each do |props|
+            ref = TagLib::Simple::FileRef.new(path, nil)
+            ref.merge_properties(props)
+            ref.save
+            ref.close
+          end
+          File.binread(path)
+        end
+      end
+      grow = { 'LYRICS' => ['x' * 10_000] }
+      shrink = { 'LYRICS' => [] }
+      with_filecopy(fixture_mp3) do |chunked|
+        _(edit.call(chunked, grow)).must_equal saved.call(grow)
+        _(edit.call(chunked, shrink)).must_equal saved.call(grow, shrink)
+      end
+    end
+
+    it 'completes short reads while shifting stream content' do
+      short_io = Class.new(SimpleDelegator) do
+        attr_accessor :short
+
+        def read(length = nil, outbuf = nil)
+          return super unless short && length
+
+          __getobj__.read([length, 7].min, outbuf)
+        end
+      end
+      props = { 'LYRICS' => ['x' * 10_000] }
+      expected = with_named_filecopy(fixture_mp3) do |path|
+        ref = TagLib::Simple::FileRef.new(path, nil)
+        ref.merge_properties(props)
+        ref.save
+        ref.close
+        File.binread(path)
+      end
+      with_filecopy(fixture_mp3) do |tf|
+        io = short_io.new(tf)
+        ref = TagLib::Simple::FileRef.new(io, nil, chunk_size: 1000)
+        ref.merge_properties(props)
+        io.short = true
+        ref.save
+        ref.close
+        tf.rewind
+        _(tf.read).must_equal expected
+      end
+    end
+
+    it 'memory maps files if requested' do
+      ref = TagLib::Simple::FileRef.new(fixture_mp3, :average, io: :mmap)
+      _(ref.properties).must_equal(mp3_properties)
+      assert_valid(ref)
+    end
+
+    it 'saves memory mapped files' do
+      with_named_filecopy(fixture_mp3) do |path|
+        ref = TagLib::Simple::FileRef.new(path, nil, io: :mmap)
+        ref.merge_properties({ 'TITLE' => ['A much longer title that will not fit in the existing tag padding' * 20] })
+        ref.save
+        ref.close
+        ref = TagLib::Simple::FileRef.new(path, :average)
+        _(ref.properties['TITLE'].first).must_match(/^A much longer title/)
+        _(ref.properties['ARTIST']).must_equal ['Artist']
+        assert_valid(ref)
+      end
+    end
+
+    it 'handles non existent files with io: :mmap' do
+      assert_invalid(TagLib::Simple::FileRef.new('/does/not/exist', :average, io: :mmap))
+    end
+
+    it 'raises ArgumentError for io: :mmap with an IO object' do
+      File.open(fixture_mp3, 'rb') do |io|
+        _(-> { TagLib::Simple::FileRef.new(io, nil, io: :mmap) }).must_raise ArgumentError
+      end
+    end
+
     it 'handles invalid stream' do
       File.open(fixture_path('empty.file')) do |io|
         fr = TagLib::Simple::FileRef.new(io, :average)
         assert_invalid(fr)
       end
     end
+
+    it 'yields to the fiber scheduler while parsing IO objects' do
+      order = []
+      scheduler = with_yielding_scheduler do
+        Fiber.schedule do
+          ref = TagLib::Simple::FileRef.new(File.open(fixture_mp3, 'rb'), nil, read_ahead: 1024)
+          order << ref.tag.title
+        end
+        Fiber.schedule { order << :other }
+      end
+      _(order).must_equal [:other, 'iTunes10MP3']
+      _(scheduler.yields).must_be :>, 0
+    end
+
+    it 'does not yield to the fiber scheduler with cooperative: false' do
+      order = []
+      scheduler = with_yielding_scheduler do
+        Fiber.schedule do
+          ref = TagLib::Simple::FileRef.new(File.open(fixture_mp3, 'rb'), nil, cooperative: false)
+          order << ref.tag.title
+        end
+        Fiber.schedule { order << :other }
+      end
+      _(order).must_equal ['iTunes10MP3', :other]
+      _(scheduler.yields).must_equal 0
+    end
+
+    it 'serves reads from prefetched windows' do
+      File.open(fixture_mp3, 'rb') do |io|
+        counting = Class.new(SimpleDelegator) do
+          attr_reader :reads
+
+          def read(*args)
+            @reads = (@reads || 0) + 1
+            __getobj__.read(*args)
+          end
+        end.new(io)
+        preads = []
+        pread = ->(offset, length) { preads << [offset, length]; io.pread(length, offset) }
+        ref = TagLib::Simple::FileRef.new(counting, nil, prefetch: { head: 8192, tail: 8192, pread: pread })
+        _(ref.properties).must_equal(mp3_properties)
+        _(preads).must_equal [[0, 8192], [8192, 4120]]
+        _(counting.reads).must_be_nil
+      end
+    end
+
+    it 'falls back to reading the IO outside prefetched windows' do
+      TagLib::Simple.reset_stats
+      File.open(fixture_mp3, 'rb') do |io|
+        ref = TagLib::Simple::FileRef.new(io, nil, prefetch: { head: 16, tail: 128 })
+        _(ref.properties).must_equal(mp3_properties)
+      end
+      _(TagLib::Simple.stats[:prefetch_misses]).must_be :>, 0 unless TagLib::Simple.stats.empty?
+    end
+
+    it 'fetches the prefetch tail in a scheduled fiber' do
+      events = []
+      File.open(fixture_mp3, 'rb') do |io|
+        pread = lambda do |offset, length|
+          events << [:start, offset]
+          sleep(0)
+          io.pread(length, offset).tap { events << [:end, offset] }
+        end
+        with_yielding_scheduler do
+          Fiber.schedule do
+            ref = TagLib::Simple::FileRef.new(io, nil, prefetch: { head: 4096, tail: 4096, pread: pread })
+            _(ref.tag.title).must_equal 'iTunes10MP3'
+          end
+        end
+      end
+      _(events.first(2).map(&:first)).must_equal %i[start start]
+    end
+
+    it 'raises errors from the scheduled tail fetch' do
+      error = nil
+      File.open(fixture_mp3, 'rb') do |io|
+        pread = ->(offset, length) { offset.zero? ? io.pread(length, offset) : raise(IOError, 'tail failed') }
+        with_yielding_scheduler do
+          Fiber.schedule do
+            TagLib::Simple::FileRef.new(io, nil, prefetch: { head: 4096, tail: 4096, pread: pread })
+          rescue IOError => e
+            error = e
+          end
+        end
+      end
+      _(error.message).must_equal 'tail failed'
+    end
+
+    it 'raises TypeError if pread does not return a String' do
+      File.open(fixture_mp3, 'rb') do |io|
+        ref = TagLib::Simple::FileRef.new(fixture_m4a, nil)
+        _ { ref.reopen(io, nil, prefetch: { head: 4096, pread: ->(_offset, _length) { 42 } }) }.must_raise TypeError
+        _(ref.reopen(fixture_mp3, nil)).must_equal true
+      end
+    end
+
+    it 'raises ArgumentError for prefetch: with a file name' do
+      _(-> { TagLib::Simple::FileRef.new(fixture_mp3, nil, prefetch: { head: 1024 }) }).must_raise ArgumentError
+    end
+
+    it 'reads only the requested tag families' do
+      ref = TagLib::Simple::FileRef.new(fixture_mp3, nil, tags: %i[id3v1 id3v2])
+      _(ref.properties).must_equal(mp3_properties)
+      _(ref.tag.title).must_equal 'iTunes10MP3'
+      _(ref.tag_fields([:artist])).must_equal({ artist: 'Artist' })
+
+      ref = TagLib::Simple::FileRef.new(fixture_mp3, nil, tags: %i[id3v1 ape])
+      _(ref.properties).must_equal({})
+      _(ref.tag).must_be_nil
+      _(ref.valid?).must_equal true
+    end
+
+    it 'matches the tag family of single family formats' do
+      expected = TagLib::Simple::FileRef.new(fixture_path('test.ogg'), nil).properties
+      _(TagLib::Simple::FileRef.new(fixture_path('test.ogg'), nil, tags: [:xiph]).properties).must_equal expected
+      _(TagLib::Simple::FileRef.new(fixture_path('test.ogg'), nil, tags: [:mp4]).properties).must_equal({})
+    end
+
+    it 'is read only with tags:' do
+      with_filecopy(fixture_mp3) do |tf|
+        ref = TagLib::Simple::FileRef.new(tf, nil, tags: [:id3v2])
+        _(ref.read_only?).must_equal true
+        _ { ref.merge_properties({ 'TITLE' => ['New'] }) }.must_raise TagLib::Error
+        _ { ref.save(force: true) }.must_raise TagLib::Error
+      end
+    end
+
+    it 'raises ArgumentError for unknown tag families' do
+      _ { TagLib::Simple::FileRef.new(fixture_mp3, nil, tags: [:vorbis]) }.must_raise ArgumentError
+    end
+
+    it 'raises TagLib::Error for values over max_value_size' do
+      ref = TagLib::Simple::FileRef.new(fixture_mp3, nil, max_value_size: 4)
+      _ { ref.tag }.must_raise TagLib::Error
+      _ { ref.properties }.must_raise TagLib::Error
+      _(ref.fetch_properties(['TRACKNUMBER'])).must_equal({ 'TRACKNUMBER' => ['1/10'] })
+    end
+
+    it 'truncates values over max_value_size with oversize: :truncate' do
+      ref = TagLib::Simple::FileRef.new(fixture_mp3, nil, max_value_size: 4, oversize: :truncate)
+      _(ref.tag.title).must_equal 'iTun'
+      _(ref.properties['ALBUM']).must_equal ['Albu']
+      _(ref.properties.values.flatten.map(&:bytesize).max).must_equal 4
+    end
+
+    it 'truncates on a character boundary' do
+      with_filecopy(fixture_mp3) do |tf|
+        ref = TagLib::Simple::FileRef.new(tf, nil, max_value_size: 5, oversize: :truncate)
+        ref.merge_properties({ 'TITLE' => ['ééé'] })
+        _(ref.properties['TITLE']).must_equal ['éé']
+        _(ref.properties['TITLE'].first.valid_encoding?).must_equal true
+      end
+    end
+
+    it 'truncates non-ASCII values to an ASCII prefix that equals an ASCII literal' do
+      with_filecopy(fixture_mp3) do |tf|
+        ref = TagLib::Simple::FileRef.new(tf, nil, max_value_size: 3, oversize: :truncate)
+        ref.merge_properties({ 'TITLE' => ['Café'] })
+        truncated = ref.properties['TITLE'].first
+        _(truncated).must_equal 'Caf'
+        _(truncated.ascii_only?).must_equal true
+        _({ 'Caf' => 1 }[truncated]).must_equal 1
+      end
+    end
+
+    it 'bounds the bytes converted by each call with max_total_size' do
+      _ { TagLib::Simple::FileRef.new(fixture_mp3, nil, max_total_size: 10).properties }.must_raise TagLib::Error
+
+      ref = TagLib::Simple::FileRef.new(fixture_mp3, nil, max_total_size: 10, oversize: :truncate)
+      # property names count too, and are dropped with their values rather than truncated
+      _(ref.properties).must_equal({ 'ALBUM' => ['Album'] })
+      _(ref.tag.title).must_equal 'iTunes10MP'
+      _(ref.tag_fields([:artist])).must_equal({ artist: 'Artist' })
+    end
+
+    it 'raises ArgumentError for an invalid oversize:' do
+      _ { TagLib::Simple::FileRef.new(fixture_mp3, nil, oversize: :drop) }.must_raise ArgumentError
+    end
+
+    it 'refuses other fibers while parsing IO objects' do
+      ref = TagLib::Simple::FileRef.new(fixture_m4a, nil)
+      error = nil
+      with_yielding_scheduler do
+        Fiber.schedule { ref.reopen(File.open(fixture_mp3, 'rb'), nil) }
+        Fiber.schedule do
+          ref.tag
+        rescue TagLib::Error => e
+          error = e
+        end
+      end
+      _(error.message).must_match(/in use/)
+      _(ref.tag.title).must_equal 'iTunes10MP3'
+    end
   end
 
   describe "#audio_properties" do
@@ -107,6 +432,8 @@ describe TagLib::Simple::FileRef do
       _(ap.bitrate).must_equal 3
       _(ap.channels).must_equal 2
       _(ap.sample_rate).must_equal 44100
+      _(ap).must_be :frozen?
+      _(ap).must_equal TagLib::AudioProperties.new(3708, 3, 44100, 2)
     end
 
     it "raises error when accessing properties after close" do
@@ -116,6 +443,39 @@ describe TagLib::Simple::FileRef do
     end
   end
 
+  describe "#reopen" do
+    it "rebinds to another file" do
+      ref = TagLib::Simple::FileRef.new(fixture_mp3, nil)
+      _(ref.properties['TITLE']).must_equal ['iTunes10MP3']
+      _(ref.reopen(fixture_m4a, :average)).must_equal true
+      _(ref.audio_properties.sample_rate).must_equal 44_100
+      _(ref.properties).wont_include 'LYRICS'
+    end
+
+    it "rebinds to IO objects, keeping them alive" do
+      ref = TagLib::Simple::FileRef.new(fixture_m4a, nil)
+      ref.reopen(File.open(fixture_mp3, 'rb'), nil)
+      GC.start
+      _(ref.tag.title).must_equal 'iTunes10MP3'
+    end
+
+    it "returns false and is invalid if the new file cannot be read" do
+      ref = TagLib::Simple::FileRef.new(fixture_mp3, nil)
+      _(ref.reopen(fixture_path('empty.file'))).must_equal false
+      _(ref.valid?).must_equal false
+      _(-> { ref.tag }).must_raise TagLib::Error
+      _(ref.reopen(fixture_mp3)).must_equal true
+    end
+
+    it "reopens closed refs" do
+      ref = TagLib::Simple::FileRef.new(fixture_mp3, nil)
+      ref.close
+      _(ref.valid?).must_equal false
+      ref.close # wont raise
+      _(ref.reopen(fixture_mp3)).must_equal true
+    end
+  end
+
   describe "#tag" do
     it "returns expected values" do
       ref = TagLib::Simple::FileRef.new(fixture_mp3, nil)
@@ -129,6 +489,31 @@ describe TagLib::Simple::FileRef do
       _(tag.year).must_equal 2011
       _(tag.track).must_equal 1
     end
+
+    it "returns a frozen AudioTag equivalent to one built in Ruby" do
+      tag = TagLib::Simple::FileRef.new(fixture_mp3, nil).tag
+      _(tag).must_be :frozen?
+      _(tag).must_equal TagLib::AudioTag.new('iTunes10MP3', 'Artist', 'Album', 'Heavy Metal', 2011, 1, 'Comments')
+      GC.compact if GC.respond_to?(:compact)
+      _(TagLib::Simple::FileRef.new(fixture_mp3, nil).tag).must_equal tag
+    end
+  end
+
+  describe "#tag_fields" do
+    it "returns only the requested fields" do
+      ref = TagLib::Simple::FileRef.new(fixture_mp3, nil)
+      _(ref.tag_fields(%i[title year])).must_equal({ title: 'iTunes10MP3', year: 2011 })
+    end
+
+    it "excludes empty fields" do
+      ref = TagLib::Simple::FileRef.new(empty_ogg, nil)
+      _(ref.tag_fields(%i[title artist])).must_equal({})
+    end
+
+    it "raises KeyError for unknown fields" do
+      ref = TagLib::Simple::FileRef.new(fixture_mp3, nil)
+      _(-> { ref.tag_fields(%i[title unknown]) }).must_raise KeyError
+    end
   end
 
   describe "#merge_tag_properties" do
@@ -181,6 +566,226 @@ describe TagLib::Simple::FileRef do
       assert_properties(props)
       _(props).must_equal(mp3_properties)
     end
+
+    it "caches properties until they are merged" do
+      with_filecopy(empty_ogg) do |tf|
+        ref = TagLib::Simple::FileRef.new(tf, nil)
+        props = ref.properties
+        _(ref.properties).must_be_same_as props
+        ref.merge_properties({ 'TITLE' => ['New Title'] })
+        _(ref.properties).wont_be_same_as props
+        _(ref.properties).must_equal({ 'TITLE' => ['New Title'] })
+      end
+    end
+
+    it "returns interned keys shared across files" do
+      first = TagLib::Simple::FileRef.new(fixture_mp3, nil).properties.keys
+      second = TagLib::Simple::FileRef.new(fixture_mp3, nil).properties.keys
+      _(first.all?(&:frozen?)).must_equal true
+      first.zip(second).each { |a, b| _(a).must_be_same_as b }
+    end
+  end
+
+  describe "#fetch_properties" do
+    it "returns only the requested properties that exist" do
+      ref = TagLib::Simple::FileRef.new(fixture_mp3, nil)
+      props = ref.fetch_properties(%w[TITLE ARTIST UNKNOWN])
+      assert_properties(props)
+      _(props).must_equal({ 'TITLE' => ['iTunes10MP3'], 'ARTIST' => ['Artist'] })
+    end
+  end
+
+  describe "#audio_digest" do
+    it "is unchanged by retagging" do
+      with_named_filecopy(fixture_mp3) do |path|
+        digest = TagLib::Simple::FileRef.new(path, nil).audio_digest
+        _(digest).must_match(/\A\h{16}\z/)
+
+        ref = TagLib::Simple::FileRef.new(path, nil)
+        ref.merge_properties({ 'LYRICS' => ['x' * 100_000] })
+        ref.save
+        _(ref.audio_digest).must_equal digest
+        File.open(path, 'rb') { |io| _(TagLib::Simple::FileRef.new(io, nil).audio_digest).must_equal digest }
+      end
+    end
+
+    it "is unchanged by retagging Ogg files" do
+      with_named_filecopy(fixture_path('test.ogg')) do |path|
+        digest = TagLib::Simple::FileRef.new(path, nil).audio_digest
+
+        ref = TagLib::Simple::FileRef.new(path, nil)
+        ref.merge_properties({ 'LYRICS' => ['x' * 100_000] })
+        ref.save
+        ref.close
+        _(TagLib::Simple::FileRef.new(path, nil).audio_digest).must_equal digest
+      end
+    end
+
+    it "is the XXH64 of the audio data" do
+      { '' => 'ef46db3751d8e999', 'a' => 'd24ec4f1a98c6e5b', 'abc' => '44bc2cf5ad770999' }.each do |data, expected|
+        fmt = ['fmt ', 16, 1, 1, 8000, 8000, 1, 8].pack('a4VvvVVvv')
+        chunk = ['data', data.bytesize].pack('a4V') + data + ("\0" * (data.bytesize % 2))
+        wav = ['RIFF', 4 + fmt.bytesize + chunk.bytesize, 'WAVE'].pack('a4Va4') + fmt + chunk
+        Tempfile.create(%w[vector .wav]) do |tf|
+          tf.binmode
+          tf.write(wav)
+          tf.close
+          _(TagLib::Simple::FileRef.new(tf.path, nil).audio_digest).must_equal expected, data.inspect
+        end
+      end
+    end
+
+    it "differs between files" do
+      digests = %w[itunes10.mp3 test.ogg has-tags.m4a].map do |f|
+        TagLib::Simple::FileRef.new(fixture_path(f), nil).audio_digest(algorithm: :xxh64)
+      end
+      _(digests.uniq.size).must_equal 3
+    end
+
+    it "rejects unsupported algorithms" do
+      _ { TagLib::Simple::FileRef.new(fixture_mp3, nil).audio_digest(algorithm: :md5) }.must_raise ArgumentError
+    end
+  end
+
+  describe "#memory_usage" do
+    it "counts the tag values TagLib holds" do
+      ref = TagLib::Simple::FileRef.new(fixture_mp3, nil)
+      _(ref.memory_usage).must_be :>=, mp3_properties.values.flatten.sum(&:length)
+      since_taglib2 { _(ref.memory_usage).must_be :>, 2315 }
+      ref.close
+      _(ref.memory_usage).must_equal 0
+    end
+
+    it "counts prefetched windows and merged values" do
+      File.open(fixture_mp3, 'rb') do |io|
+        unbuffered = TagLib::Simple::FileRef.new(io, nil, read_ahead: 0).memory_usage
+        io.rewind
+        prefetched = TagLib::Simple::FileRef.new(io, nil, read_ahead: 0, prefetch: { head: 4096 }).memory_usage
+        _(prefetched).must_be :>=, unbuffered + 4096
+      end
+
+      ref = TagLib::Simple::FileRef.new(fixture_mp3, nil)
+      before = ref.memory_usage
+      ref.merge_properties({ 'LYRICS' => ['x' * 100_000] })
+      _(ref.memory_usage).must_be :>, before + 100_000
+    end
+  end
+
+  describe "#save" do
+    it "saves in place when the tag still fits" do
+      with_named_filecopy(fixture_mp3) do |path|
+        size = File.size(path)
+        ref = TagLib::Simple::FileRef.new(path, nil)
+        ref.merge_properties({ 'TITLE' => ['Short'] })
+        ref.save(strategy: :in_place_or_fail)
+        ref.close
+        _(File.size(path)).must_equal size
+        _(TagLib::Simple::FileRef.new(path, nil).properties['TITLE']).must_equal ['Short']
+      end
+    end
+
+    it "refuses to rewrite with :in_place_or_fail, leaving changes pending" do
+      with_filecopy(fixture_mp3) do |tf|
+        original = tf.read
+        ref = TagLib::Simple::FileRef.new(tf, nil)
+        ref.merge_properties({ 'LYRICS' => ['x' * 100_000] })
+        _ { ref.save(strategy: :in_place_or_fail) }.must_raise TagLib::RewriteRequired
+        tf.rewind
+        _(tf.read).must_equal original
+        _(ref.properties['LYRICS']).must_equal ['x' * 100_000]
+
+        ref.save(strategy: :rewrite)
+        ref.close
+        tf.rewind
+        _(TagLib::Simple::FileRef.new(tf, nil).properties['LYRICS']).must_equal ['x' * 100_000]
+      end
+    end
+
+    it "discards the journal if writing it out fails" do
+      with_filecopy(fixture_mp3) do |tf|
+        failing_io = Class.new(SimpleDelegator) { def write(*) = raise(IOError, 'disk full') }.new(tf)
+        ref = TagLib::Simple::FileRef.new(failing_io, nil)
+        ref.merge_properties({ 'TITLE' => ['Short'] })
+        _ { ref.save(strategy: :in_place_or_fail) }.must_raise IOError
+        # nothing is left pending to be replayed over the partly written stream
+        _(ref.save).must_equal false
+        ref.close
+      end
+    end
+
+    it "atomically replaces files with :atomic" do
+      with_named_filecopy(fixture_mp3) do |path|
+        inode = File.stat(path).ino
+        ref = TagLib::Simple::FileRef.new(path, nil)
+        ref.merge_properties({ 'LYRICS' => ['x' * 100_000] })
+        ref.save(strategy: :atomic)
+        _(File.stat(path).ino).wont_equal inode
+        _(Dir.children(File.dirname(path)).grep(/#{Regexp.escape(File.basename(path))}\./)).must_be_empty
+
+        # still usable against the new file
+        ref.merge_properties({ 'TITLE' => ['After'] })
+        ref.save
+        ref.close
+        props = TagLib::Simple::FileRef.new(path, nil).properties
+        _(props['LYRICS']).must_equal ['x' * 100_000]
+        _(props['TITLE']).must_equal ['After']
+      end
+    end
+
+    it "raises SystemCallError with the failed operation for :atomic" do
+      skip 'root ignores directory permissions' if Process.uid.zero?
+      Dir.mktmpdir('taglib_atomic') do |dir|
+        path = File.join(dir, 'copy.mp3')
+        FileUtils.cp(fixture_mp3, path)
+        ref = TagLib::Simple::FileRef.new(path, nil)
+        ref.merge_properties({ 'TITLE' => ['Atomic'] })
+        File.chmod(0o555, dir)
+        begin
+          error = _ { ref.save(strategy: :atomic) }.must_raise Errno::EACCES
+          _(error.message).must_match(/mkstemp/)
+          _(error.message.scan(Errno::EACCES.new.message).size).must_equal 1
+        ensure
+          File.chmod(0o755, dir)
+          ref.close
+        end
+      end
+    end
+
+    it "requires a file name for :atomic" do
+      with_filecopy(fixture_mp3) do |tf|
+        _ { TagLib::Simple::FileRef.new(tf, nil).save(strategy: :atomic) }.must_raise ArgumentError
+      end
+    end
+
+    it "does not save when merges change nothing" do
+      with_filecopy(fixture_mp3) do |tf|
+        original = tf.read
+        ref = TagLib::Simple::FileRef.new(tf, nil)
+        _(ref.merge_properties(ref.properties.to_h { |k, v| [k, v.dup] })).must_equal false
+        _(ref.merge_properties({ 'TITLE' => ['iTunes10MP3'] })).must_equal false
+        _(ref.merge_tag_properties({ artist: 'Artist', year: 2011 })).must_equal false
+        since_taglib2 { _(ref.merge_complex_properties({ 'PICTURE' => ref.complex_property('PICTURE') })).must_equal false }
+        _(ref.save).must_equal false
+        tf.rewind
+        _(tf.read).must_equal original
+
+        _(ref.merge_tag_properties({ artist: 'New Artist' })).must_equal true
+        _(ref.save).must_equal true
+        _(ref.save).must_equal false
+      end
+    end
+
+    it "saves unchanged files if forced" do
+      with_filecopy(fixture_mp3) do |tf|
+        _(TagLib::Simple::FileRef.new(tf, nil).save(force: true)).must_equal true
+      end
+    end
+
+    it "rejects unknown strategies" do
+      with_filecopy(fixture_mp3) do |tf|
+        _ { TagLib::Simple::FileRef.new(tf, nil).save(strategy: :unknown) }.must_raise ArgumentError
+      end
+    end
   end
 
   describe "#merge_properties" do
@@ -212,6 +817,16 @@ describe TagLib::Simple::FileRef do
       end
     end
 
+    it "persists properties for file names" do
+      with_named_filecopy(empty_ogg) do |path|
+        ref = TagLib::Simple::FileRef.new(path, nil)
+        ref.merge_properties({ 'TITLE' => ['Test Song'] })
+        ref.save
+        ref.close
+        _(TagLib::Simple::FileRef.new(path, nil).properties).must_equal({ 'TITLE' => ['Test Song'] })
+      end
+    end
+
     it "replaces all existing properties if requested" do
       properties = {
         'TITLE' => ['Test Song'],
@@ -231,6 +846,34 @@ describe TagLib::Simple::FileRef do
         _(ref.properties).must_equal(properties)
       end
     end
+
+    it "converts values from their Ruby encoding and returns UTF-8" do
+      with_filecopy(empty_ogg) do |tf|
+        ref = TagLib::Simple::FileRef.new(tf, nil)
+        ref.merge_properties({
+                               'TITLE' => ['Café Ünïcödé 🎵'.encode('UTF-16LE')],
+                               'ARTIST' => 'Björk'.encode('ISO-8859-1'),
+                               'ALBUM' => ['Plain ASCII'.encode('US-ASCII')],
+                               'COMMENT' => ['ビョーク 🎵']
+                             })
+        props = ref.properties
+        _(props['TITLE']).must_equal ['Café Ünïcödé 🎵']
+        _(props['ARTIST']).must_equal ['Björk']
+        _(props['ALBUM']).must_equal ['Plain ASCII']
+        _(props['COMMENT']).must_equal ['ビョーク 🎵']
+        _(props.values.flatten.map(&:encoding).uniq).must_equal [Encoding::UTF_8]
+        _(props.values.flatten.all?(&:valid_encoding?)).must_equal true
+      end
+    end
+
+    it "replaces invalid UTF-8 sequences" do
+      with_filecopy(empty_ogg) do |tf|
+        ref = TagLib::Simple::FileRef.new(tf, nil)
+        ref.merge_properties({ 'TITLE' => ["ok\xFFok"], 'ARTIST' => ['long ' * 100_000] })
+        _(ref.properties['TITLE']).must_equal ["ok\uFFFDok"]
+        _(ref.properties['ARTIST'].first.length).must_equal 500_000
+      end
+    end
   end
 
   describe "#complex_properties" do
@@ -250,6 +893,60 @@ describe TagLib::Simple::FileRef do
       _(picture['data'].length).must_equal 2315
       _(picture['data'][0..4]).must_equal "\x89PNG\r".b, "PNG Header"
     end
+
+    it "leaves out binary values if data: false" do
+      since_taglib2
+      ref = TagLib::Simple::FileRef.new(fixture_path('itunes10.mp3'), nil)
+      picture = ref.complex_property('PICTURE', data: false).first
+      _(picture['mimeType']).must_equal 'image/png'
+      _(picture.key?('data')).must_equal false
+      _(ref.complex_property('PICTURE', data: true).first['data'].length).must_equal 2315
+    end
+
+    it "applies max_value_size to binary values" do
+      since_taglib2
+      ref = TagLib::Simple::FileRef.new(fixture_path('itunes10.mp3'), nil, max_value_size: 1000, oversize: :truncate)
+      picture = ref.complex_property('PICTURE').first
+      _(picture['mimeType']).must_equal 'image/png'
+      # binary data is dropped rather than cut short
+      _(picture).wont_include 'data'
+      _ { TagLib::Simple::FileRef.new(fixture_path('itunes10.mp3'), nil, max_value_size: 1000).complex_property('PICTURE') }.must_raise TagLib::Error
+    end
+  end
+
+  describe "#write_complex_property_data" do
+    let(:ref) { TagLib::Simple::FileRef.new(fixture_path('itunes10.mp3'), nil) }
+
+    it "writes picture data to an IO in chunks" do
+      since_taglib2
+      io = StringIO.new(''.b)
+      writes = 0
+      io.define_singleton_method(:write) { |chunk| writes += 1; super(chunk) }
+      _(ref.write_complex_property_data('PICTURE', io, chunk_size: 1000)).must_equal 2315
+      _(writes).must_equal 3
+      _(io.string).must_equal ref.complex_property('PICTURE').first['data']
+    end
+
+    it "writes picture data to a file" do
+      since_taglib2
+      Tempfile.create(['picture', '.png']) do |tf|
+        tf.close
+        _(ref.write_complex_property_data('PICTURE', Pathname.new(tf.path))).must_equal 2315
+        _(File.binread(tf.path)).must_equal ref.complex_property('PICTURE').first['data']
+      end
+    end
+
+    it "returns nil for missing values" do
+      since_taglib2
+      _(ref.write_complex_property_data('PICTURE', StringIO.new, index: 1)).must_be_nil
+      _(ref.write_complex_property_data('PICTURE', StringIO.new, field: 'mimeType')).must_be_nil
+      _(ref.write_complex_property_data('NOTHING', StringIO.new)).must_be_nil
+    end
+
+    it "raises for unwritable paths" do
+      since_taglib2
+      _ { ref.write_complex_property_data('PICTURE', '/nonexistent/dir/picture.png') }.must_raise SystemCallError
+    end
   end
 
   describe "#merge_complex_properties" do
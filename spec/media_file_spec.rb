@@ -318,6 +318,14 @@ describe TagLib::MediaFile do
       end
     end
 
+    describe 'with complex_property_data: false' do
+      it 'retrieves complex properties without binary values' do
+        retrieve.merge!(complex_property_keys: %w[PICTURE], complex_property_data: false)
+        mock_fileref.expect(:complex_property, [complex.except('data')], ['PICTURE'], data: false)
+        _(media_file.picture).must_equal(complex.except('data'))
+      end
+    end
+
     describe 'with complex_property_keys = :all' do
       it 'retrieves all complex properties' do
         retrieve[:complex_property_keys] = :all
@@ -584,6 +592,14 @@ describe TagLib::MediaFile do
       _(mf.closed?).must_equal true
       _(mf.writable?).must_equal false
     end
+    it 'reads only the requested property keys' do
+      mock_fileref.expect(:tag, tag)
+      mock_fileref.expect(:fetch_properties, properties.slice('TITLE'), [%w[TITLE]])
+      expect_close
+      mf = TagLib::MediaFile.read(mock_fileref, properties: %w[TITLE])
+      _(mf.properties).must_equal({ 'TITLE' => %w[Title] })
+    end
+
     it 'reads everything if all is true' do
       mock_fileref.expect(:audio_properties, audio_properties)
       mock_fileref.expect(:tag, tag)
@@ -613,6 +629,17 @@ describe TagLib::MediaFile do
         _(picture['mimeType']).must_equal 'image/png'
       end
     end
+    it 'reads only the requested tag families' do
+      _(TagLib::MediaFile.read(fixture_mp3, tags: [:id3v2]).title).must_equal 'iTunes10MP3'
+      _(TagLib::MediaFile.read(fixture_mp3, tags: [:id3v1]).properties).must_equal({})
+    end
+
+    it 'bounds the values read with limits:' do
+      mf = TagLib::MediaFile.read(fixture_mp3, limits: { max_value_size: 4, oversize: :truncate })
+      _(mf.title).must_equal 'iTun'
+      _ { TagLib::MediaFile.read(fixture_mp3, limits: { max_value_size: 4 }) }.must_raise TagLib::Error
+    end
+
     it 'reads and writes with File IO' do
       with_filecopy(fixture_mp3) do |io|
         TagLib::MediaFile.open(io, audio_properties: :fast) do |mf|
@@ -655,6 +682,11 @@ describe TagLib::MediaFile do
         _(mf.complex_property_keys).must_be_empty
       end
     end
+    it 'reads selected properties' do
+      mf = TagLib::MediaFile.read(fixture_mp3, properties: %w[TITLE ARTIST UNKNOWN])
+      _(mf.properties).must_equal({ 'TITLE' => ['iTunes10MP3'], 'ARTIST' => ['Artist'] })
+    end
+
     it 'audio_properties are not read by default' do
       mf = TagLib::MediaFile.new(fixture_mp3)
       _(mf.audio_properties).must_be_nil
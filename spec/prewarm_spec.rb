@@ -0,0 +1,35 @@
+# frozen_string_literal: true
+
+require_relative 'spec_helper'
+
+describe 'TagLib::Simple.prewarm!' do
+  it 'can be called again' do
+    _(TagLib::Simple.prewarm!).must_be_nil
+    _(TagLib::Simple.prewarm!).must_be_nil
+  end
+
+  it 'leaves forked children able to read files' do
+    skip 'fork not supported' unless Process.respond_to?(:fork)
+
+    TagLib::Simple.prewarm!
+    reader, writer = IO.pipe
+    pid = fork do
+      reader.close
+      writer.write(TagLib::Simple::FileRef.new(fixture_path('itunes10.mp3'), nil).tag.title.to_s)
+      writer.close
+      exit!(0)
+    end
+    writer.close
+    title = reader.read
+    Process.wait(pid)
+    _($?.success?).must_equal true
+    _(title).must_equal TagLib::Simple::FileRef.new(fixture_path('itunes10.mp3'), nil).tag.title.to_s
+  end
+
+  it 'raises TagLib errors after warming' do
+    TagLib::Simple.prewarm!
+    ref = TagLib::Simple::FileRef.new(fixture_path('itunes10.mp3'), nil)
+    ref.close
+    _(-> { ref.tag }).must_raise TagLib::Error
+  end
+end
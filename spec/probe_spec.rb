@@ -0,0 +1,71 @@
+# frozen_string_literal: true
+
+require_relative 'spec_helper'
+require 'delegate'
+require 'stringio'
+
+describe 'TagLib::Simple.probe' do
+  it 'finds ID3v2 tags and MPEG audio' do
+    result = TagLib::Simple.probe(fixture_path('itunes10.mp3'))
+    _(result).must_equal({
+                           format: :mpeg, size: 12_312, audio_offset: 10_433, audio_size: 1_879,
+                           tags: [{ type: :id3v2, offset: 0, size: 10_433 }]
+                         })
+    _(result).must_be :frozen?
+  end
+
+  it 'finds MP4 metadata and media data' do
+    result = TagLib::Simple.probe(fixture_path('has-tags.m4a'))
+    _(result[:format]).must_equal :mp4
+    _(result[:tags].map { |t| t[:type] }).must_equal [:mp4]
+    _(result[:audio_offset]).must_be :>, 0
+  end
+
+  it 'finds Ogg comment header pages' do
+    result = TagLib::Simple.probe(Pathname.new(fixture_path('test.ogg')))
+    _(result[:format]).must_equal :ogg_vorbis
+    tag = result[:tags].first
+    _(tag[:type]).must_equal :xiph_comment
+    _(result[:audio_offset]).must_equal tag[:offset] + tag[:size]
+    _(result[:audio_offset] + result[:audio_size]).must_equal result[:size]
+  end
+
+  it 'probes IO objects, restoring their position' do
+    File.open(fixture_path('itunes10.mp3'), 'rb') do |io|
+      io.seek(100)
+      _(TagLib::Simple.probe(io)).must_equal TagLib::Simple.probe(fixture_path('itunes10.mp3'))
+      _(io.tell).must_equal 100
+    end
+  end
+
+  it 'restores the IO position if probing raises' do
+    File.open(fixture_path('itunes10.mp3'), 'rb') do |file|
+      failing_io = Class.new(SimpleDelegator) { def read(*) = raise(IOError, 'read failed') }.new(file)
+      file.seek(100)
+      _ { TagLib::Simple.probe(failing_io) }.must_raise IOError
+      _(file.tell).must_equal 100
+    end
+  end
+
+  it 'does not mistake stray frame syncs for MPEG audio' do
+    # JPEG-like data: a plausible MPEG-1 Layer III header with nothing valid where its next frame should be
+    junk = "\xFF\xD8\xFF\xE0".b + ("\x00".b * 60) + "\xFF\xFB\x90\x00".b + ("\x11".b * 2000)
+    result = TagLib::Simple.probe(StringIO.new(junk))
+    _(result && result[:format]).wont_equal :mpeg
+  end
+
+  it 'ignores an ADTS sync too short to hold a header at the end of the stream' do
+    ["\xFF\xF1\x50\x80".b, "\xFF\xF1\x50\x80\x02".b].each do |tail|
+      _(TagLib::Simple.probe(StringIO.new(('junk' * 4).b + tail))).must_be_nil
+    end
+  end
+
+  it 'returns nil for unrecognised or missing files' do
+    _(TagLib::Simple.probe(fixture_path('empty.file'))).must_be_nil
+    _(TagLib::Simple.probe(fixture_path('does-not-exist.mp3'))).must_be_nil
+  end
+
+  it 'rejects other objects' do
+    _ { TagLib::Simple.probe(42) }.must_raise TypeError
+  end
+end
@@ -28,10 +28,57 @@ def with_filecopy(filename)
   end
 end
 
+def with_named_filecopy(filename)
+  Tempfile.create(['copy', File.extname(filename)]) do |tf|
+    tf.binmode
+    tf.write(File.read(filename))
+    tf.close
+    yield tf.path
+  end
+end
+
 def since_taglib2(feature = 'Complex Properties')
   if block_given?
     yield if TagLib::MAJOR_VERSION >= 2
   elsif TagLib::MAJOR_VERSION < 2
     skip "#{feature} not available in Taglib #{TagLib::MAJOR_VERSION} (needs 2+)"
   end
-end
\ No newline at end of file
+end
+
+# Just enough of a Fiber scheduler to interleave fibers that sleep (or yield with sleep(0)) on one thread
+class YieldingScheduler
+  attr_reader :yields
+
+  def initialize
+    @ready = []
+    @yields = 0
+  end
+
+  def fiber(&block)
+    Fiber.new(blocking: false, &block).tap(&:resume)
+  end
+
+  def kernel_sleep(_duration = nil)
+    @yields += 1
+    @ready << Fiber.current
+    Fiber.yield
+  end
+
+  def block(_blocker, _timeout = nil) = kernel_sleep
+  def unblock(_blocker, fiber) = @ready << fiber
+  def io_wait(_io, events, _timeout) = events
+
+  def close
+    @ready.shift.resume until @ready.empty?
+  end
+end
+
+# Run the block on a new thread with a YieldingScheduler, returning the scheduler once all its fibers are done
+def with_yielding_scheduler
+  scheduler = YieldingScheduler.new
+  Thread.new do
+    Fiber.set_scheduler(scheduler)
+    yield scheduler
+  end.join
+  scheduler
+end
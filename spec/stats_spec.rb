@@ -0,0 +1,39 @@
+# frozen_string_literal: true
+
+require_relative 'spec_helper'
+
+describe 'TagLib::Simple.stats' do
+  before do
+    skip 'extension built with --disable-stats' if TagLib::Simple.stats.empty?
+    TagLib::Simple.reset_stats
+  end
+
+  it 'resets to zero' do
+    _(TagLib::Simple.stats.values.uniq).must_equal [0]
+  end
+
+  it 'counts IO stream reads and parse time' do
+    File.open(fixture_path('itunes10.mp3'), 'rb') do |io|
+      TagLib::Simple::FileRef.new(io, nil).properties
+    end
+    stats = TagLib::Simple.stats
+    _(stats[:read_block_calls]).must_be :>, 0
+    _(stats[:read_block_bytes]).must_be :>, 0
+    _(stats[:ruby_read_calls]).must_be :>, 0
+    _(stats[:ruby_read_calls]).must_be :<=, stats[:read_block_calls]
+    _(stats[:parse_ns]).must_be :>, 0
+    _(stats[:convert_ns]).must_be :>, 0
+  end
+
+  it 'counts rewritten bytes when a tag grows' do
+    with_filecopy(fixture_path('itunes10.mp3')) do |tf|
+      ref = TagLib::Simple::FileRef.new(tf, nil)
+      ref.merge_properties({ 'LYRICS' => ['x' * 10_000] })
+      ref.save
+    end
+    stats = TagLib::Simple.stats
+    _(stats[:rewrite_bytes]).must_be :>, 0
+    _(stats[:ruby_write_calls]).must_be :>, 0
+    _(stats[:save_ns]).must_be :>, 0
+  end
+end
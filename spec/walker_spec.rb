@@ -0,0 +1,80 @@
+# frozen_string_literal: true
+
+require_relative 'spec_helper'
+require 'fileutils'
+require 'tmpdir'
+
+describe 'TagLib::Simple.each_file' do
+  before do
+    @root = Dir.mktmpdir('taglib_walk')
+    FileUtils.mkdir_p(File.join(@root, 'a', 'b'))
+    FileUtils.cp(fixture_path('itunes10.mp3'), File.join(@root, 'top.mp3'))
+    FileUtils.cp(fixture_path('has-tags.m4a'), File.join(@root, 'a', 'nested.M4A'))
+    FileUtils.cp(fixture_path('test.ogg'), File.join(@root, 'a', 'b', 'deep.ogg'))
+    FileUtils.cp(fixture_path('empty.file'), File.join(@root, 'a', 'broken.mp3'))
+    File.write(File.join(@root, 'notes.txt'), 'not audio')
+  end
+
+  after do
+    FileUtils.remove_entry(@root)
+  end
+
+  def walked(**options)
+    TagLib::Simple.each_file(@root, **options).map { |entry| entry[:path].delete_prefix("#{@root}/") }.sort
+  end
+
+  it 'yields every readable file with a supported extension' do
+    _(walked(threads: 2)).must_equal %w[a/b/deep.ogg a/nested.M4A top.mp3]
+  end
+
+  it 'yields entries as per scan' do
+    path = File.join(@root, 'top.mp3')
+    entry = TagLib::Simple.each_file(@root, extensions: ['mp3'], audio_properties: :average).first
+    _(entry).must_equal TagLib::Simple.scan([path], audio_properties: :average).first
+  end
+
+  it 'applies conversion limits to each file' do
+    entry = TagLib::Simple.each_file(@root, extensions: ['mp3'], max_value_size: 4, oversize: :truncate).first
+    _(entry[:tag].title).must_equal 'iTun'
+    _ { TagLib::Simple.each_file(@root, extensions: ['mp3'], max_value_size: 4).first }.must_raise TagLib::Error
+  end
+
+  it 'rejects a negative number of threads' do
+    _ { TagLib::Simple.each_file(@root, threads: -1) { nil } }.must_raise ArgumentError
+  end
+
+  it 'filters by extension' do
+    _(walked(extensions: %w[.MP3 ogg])).must_equal %w[a/b/deep.ogg top.mp3]
+  end
+
+  it 'stops when the block breaks' do
+    count = 0
+    TagLib::Simple.each_file(@root, threads: 1) do
+      count += 1
+      break
+    end
+    _(count).must_equal 1
+  end
+
+  it 'returns an Enumerator without a block' do
+    _(TagLib::Simple.each_file(@root)).must_be_kind_of Enumerator
+  end
+
+  it 'skips directories that cannot be read and does not follow directory symlinks' do
+    skip 'root ignores directory permissions' if Process.uid.zero?
+
+    locked = File.join(@root, 'locked')
+    FileUtils.mkdir(locked)
+    FileUtils.cp(fixture_path('itunes10.mp3'), File.join(locked, 'hidden.mp3'))
+    File.symlink(File.join(@root, 'a'), File.join(@root, 'link'))
+    File.chmod(0o000, locked)
+    _(walked).must_equal %w[a/b/deep.ogg a/nested.M4A top.mp3]
+  ensure
+    File.chmod(0o755, locked) if locked && File.exist?(locked)
+  end
+
+  it 'raises SystemCallError if root is not a directory' do
+    _ { TagLib::Simple.each_file(File.join(@root, 'missing')) { nil } }.must_raise Errno::ENOENT
+    _ { TagLib::Simple.each_file(File.join(@root, 'top.mp3')) { nil } }.must_raise Errno::ENOTDIR
+  end
+end